@@ -0,0 +1,279 @@
+#!/usr/bin/env python3
+
+import base64
+import os
+import socket
+import struct
+import sys
+import time
+import urllib.parse
+
+# Constants
+
+PREFACE         = b'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n'
+
+DATA            = 0x0
+HEADERS         = 0x1
+RST_STREAM      = 0x3
+SETTINGS        = 0x4
+PING            = 0x6
+GOAWAY          = 0x7
+WINDOW_UPDATE   = 0x8
+CONTINUATION    = 0x9
+
+END_STREAM      = 0x1
+ACK             = 0x1
+END_HEADERS     = 0x4
+
+STATIC_TABLE = [
+    (':authority', ''), (':method', 'GET'), (':method', 'POST'), (':path', '/'),
+    (':path', '/index.html'), (':scheme', 'http'), (':scheme', 'https'),
+    (':status', '200'), (':status', '204'), (':status', '206'), (':status', '304'),
+    (':status', '400'), (':status', '404'), (':status', '500'),
+    ('accept-charset', ''), ('accept-encoding', 'gzip, deflate'),
+    ('accept-language', ''), ('accept-ranges', ''), ('accept', ''),
+    ('access-control-allow-origin', ''), ('age', ''), ('allow', ''),
+    ('authorization', ''), ('cache-control', ''), ('content-disposition', ''),
+    ('content-encoding', ''), ('content-language', ''), ('content-length', ''),
+    ('content-location', ''), ('content-range', ''), ('content-type', ''),
+    ('cookie', ''), ('date', ''), ('etag', ''), ('expect', ''), ('expires', ''),
+    ('from', ''), ('host', ''), ('if-match', ''), ('if-modified-since', ''),
+    ('if-none-match', ''), ('if-range', ''), ('if-unmodified-since', ''),
+    ('last-modified', ''), ('link', ''), ('location', ''), ('max-forwards', ''),
+    ('proxy-authenticate', ''), ('proxy-authorization', ''), ('range', ''),
+    ('referer', ''), ('refresh', ''), ('retry-after', ''), ('server', ''),
+    ('set-cookie', ''), ('strict-transport-security', ''),
+    ('transfer-encoding', ''), ('user-agent', ''), ('vary', ''), ('via', ''),
+    ('www-authenticate', ''),
+]
+
+# Functions
+
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [-u -v] URL [PATH ...]
+    -u              Start with an HTTP/1.1 Upgrade: h2c request
+    -v              Display response headers and bodies
+
+Requests URL and any additional PATHs concurrently as streams on a single
+HTTP/2 cleartext connection, then reports the status, size, and header
+block size of each response.
+    ''')
+    sys.exit(status)
+
+
+def encode_integer(value, prefix, flags=0):
+    ''' Encode HPACK integer with prefix bits '''
+    limit = (1 << prefix) - 1
+    if value < limit:
+        return bytes([flags | value])
+    data  = [flags | limit]
+    value -= limit
+    while value >= 0x80:
+        data.append((value & 0x7f) | 0x80)
+        value >>= 7
+    return bytes(data + [value])
+
+
+def encode_headers(headers):
+    ''' Encode header list as literals without indexing (no Huffman) '''
+    block = b''
+    for name, value in headers:
+        block += b'\x00'
+        block += encode_integer(len(name), 7) + name.encode()
+        block += encode_integer(len(value), 7) + value.encode()
+    return block
+
+
+class Decoder:
+    ''' Minimal HPACK decoder (no Huffman, which spidey does not send) '''
+
+    def __init__(self):
+        self.table = []
+
+    def integer(self, data, i, prefix):
+        limit = (1 << prefix) - 1
+        value = data[i] & limit
+        i    += 1
+        if value < limit:
+            return value, i
+        shift = 0
+        while True:
+            value += (data[i] & 0x7f) << shift
+            shift += 7
+            i     += 1
+            if not data[i - 1] & 0x80:
+                return value, i
+
+    def string(self, data, i):
+        if data[i] & 0x80:
+            raise ValueError('Huffman strings are not supported')
+        length, i = self.integer(data, i, 7)
+        return data[i:i + length].decode(), i + length
+
+    def lookup(self, index):
+        if index <= len(STATIC_TABLE):
+            return STATIC_TABLE[index - 1]
+        return self.table[index - len(STATIC_TABLE) - 1]
+
+    def decode(self, data):
+        headers = []
+        i = 0
+        while i < len(data):
+            byte = data[i]
+            if byte & 0x80:
+                index, i = self.integer(data, i, 7)
+                headers.append(self.lookup(index))
+            elif byte & 0xe0 == 0x20:
+                size, i = self.integer(data, i, 5)
+                while sum(len(n) + len(v) + 32 for n, v in self.table) > size:
+                    self.table.pop()
+            else:
+                incremental = byte & 0x40
+                index, i = self.integer(data, i, 6 if incremental else 4)
+                name = self.lookup(index)[0] if index else None
+                if name is None:
+                    name, i = self.string(data, i)
+                value, i = self.string(data, i)
+                headers.append((name, value))
+                if incremental:
+                    self.table.insert(0, (name, value))
+                    while sum(len(n) + len(v) + 32 for n, v in self.table) > 4096:
+                        self.table.pop()
+        return headers
+
+
+def send_frame(sock, kind, flags, stream, payload=b''):
+    ''' Write one frame '''
+    header = struct.pack('>I', len(payload))[1:] + bytes([kind, flags])
+    sock.sendall(header + struct.pack('>I', stream) + payload)
+
+
+def recv_exact(sock, length):
+    ''' Read exactly length bytes '''
+    data = b''
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            raise EOFError('connection closed')
+        data += chunk
+    return data
+
+
+def recv_frame(sock):
+    ''' Read one frame and return (type, flags, stream, payload) '''
+    header = recv_exact(sock, 9)
+    length = struct.unpack('>I', b'\x00' + header[:3])[0]
+    stream = struct.unpack('>I', header[5:])[0] & 0x7fffffff
+    return header[3], header[4], stream, recv_exact(sock, length)
+
+
+def main():
+    arguments = sys.argv[1:]
+    upgrade   = False
+    verbose   = False
+    paths     = []
+
+    # Parse command line arguments
+    while arguments:
+        argument = arguments.pop(0)
+        if argument == '-u':
+            upgrade = True
+        elif argument == '-v':
+            verbose = True
+        elif argument == '-h':
+            usage(0)
+        else:
+            paths.append(argument)
+
+    if not paths:
+        usage(1)
+
+    url       = urllib.parse.urlsplit(paths.pop(0))
+    authority = url.netloc
+    paths     = [(url.path or '/') + ('?' + url.query if url.query else '')] + paths
+    sock      = socket.create_connection((url.hostname, url.port or 80))
+    responses = {}
+    decoder   = Decoder()
+    startTime = time.time()
+
+    # Open connection (stream 1 is the upgraded request, if any)
+    if upgrade:
+        settings = base64.urlsafe_b64encode(b'').decode()
+        sock.sendall((f'GET {paths[0]} HTTP/1.1\r\nHost: {authority}\r\n'
+                      f'Connection: Upgrade, HTTP2-Settings\r\nUpgrade: h2c\r\n'
+                      f'HTTP2-Settings: {settings}\r\n\r\n').encode())
+        line = b''
+        while not line.endswith(b'\r\n\r\n'):
+            line += recv_exact(sock, 1)
+        if b' 101 ' not in line.split(b'\r\n')[0]:
+            print(line.decode(errors='replace'))
+            sys.exit(1)
+        responses[1] = {'path': paths.pop(0)}
+
+    sock.sendall(PREFACE)
+    send_frame(sock, SETTINGS, 0, 0)
+
+    # Send all requests at once
+    stream = 3 if upgrade else 1
+    for path in paths:
+        block = encode_headers([(':method', 'GET'), (':scheme', 'http'),
+                                (':authority', authority), (':path', path),
+                                ('user-agent', 'h2c.py')])
+        send_frame(sock, HEADERS, END_STREAM | END_HEADERS, stream, block)
+        responses[stream] = {'path': path}
+        stream += 2
+
+    # Read frames until every stream has ended
+    pending = set(responses)
+    while pending:
+        kind, flags, stream, payload = recv_frame(sock)
+        if kind == SETTINGS and not flags & ACK:
+            send_frame(sock, SETTINGS, ACK, 0)
+        elif kind == PING and not flags & ACK:
+            send_frame(sock, PING, ACK, 0, payload)
+        elif kind in (HEADERS, CONTINUATION):
+            response = responses[stream]
+            response['block'] = response.get('block', b'') + payload
+            if flags & END_HEADERS:
+                response['headers'] = decoder.decode(response['block'])
+        elif kind == DATA:
+            response = responses[stream]
+            response['body'] = response.get('body', b'') + payload
+            if payload:
+                send_frame(sock, WINDOW_UPDATE, 0, 0, struct.pack('>I', len(payload)))
+                send_frame(sock, WINDOW_UPDATE, 0, stream, struct.pack('>I', len(payload)))
+        elif kind == RST_STREAM:
+            responses[stream]['reset'] = struct.unpack('>I', payload)[0]
+            pending.discard(stream)
+        elif kind == GOAWAY:
+            print(f'GOAWAY: {struct.unpack(">II", payload[:8])}')
+            break
+
+        if kind in (HEADERS, DATA) and flags & END_STREAM:
+            pending.discard(stream)
+
+    send_frame(sock, GOAWAY, 0, 0, struct.pack('>II', 0, 0))
+    sock.close()
+
+    # Report results
+    for stream, response in sorted(responses.items()):
+        headers = dict(response.get('headers', []))
+        status  = headers.get(':status', f'RST {response.get("reset", "?")}')
+        body    = response.get('body', b'')
+        print(f'Stream: {stream:>3}, Status: {status}, Body: {len(body):>8} bytes, '
+              f'Header Block: {len(response.get("block", b"")):>4} bytes, Path: {response["path"]}')
+        if verbose:
+            for name, value in response.get('headers', []):
+                print(f'    {name}: {value}')
+            print(body.decode(errors='replace'))
+
+    print(f'TOTAL ELAPSED TIME: {time.time() - startTime:.3f}')
+
+
+# Main execution
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+
+import ctypes
+import ctypes.util
+import mmap
+import os
+import socket
+import statistics
+import sys
+import threading
+import time
+import urllib.parse
+
+# Functions
+
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [-c CLIENTS -n REQUESTS -r ROOT] URL LARGE SMALL...
+    -c  CLIENTS     Concurrent downloads of LARGE (4)
+    -n  REQUESTS    Requests for small files per phase (1000)
+    -r  ROOT        Local document root: report how much of the small files
+                    stays in the page cache
+
+Measures small-file latency alone, then again while CLIENTS clients
+download LARGE over and over, and reports the download throughput.  To see
+page cache eviction, LARGE must be larger than free memory.  Compare a
+server started with default tunables against one started with
+"-o drop_behind=0", or with "-o direct_io=1", for example:
+
+    {progname} -r www http://localhost:9898/ /big.iso /index.html /style.css
+    ''')
+    sys.exit(status)
+
+
+def fetch(host, port, path):
+    ''' Make one HTTP request and return (seconds, bytes) for the response.
+
+    - host:     Server host name
+    - port:     Server port number
+    - path:     Resource path to request
+    '''
+    request = f'GET {path} HTTP/1.0\r\nHost: {host}\r\n\r\n'.encode()
+    received = 0
+
+    startTime = time.perf_counter()
+    with socket.create_connection((host, port)) as sock:
+        sock.sendall(request)
+        while True:
+            data = sock.recv(262144)
+            if not data:
+                break
+            received += len(data)
+
+    return time.perf_counter() - startTime, received
+
+
+def resident(root, paths):
+    ''' Return fraction of the pages of files under root that are cached.
+
+    - root:     Local document root
+    - paths:    Resource paths of files
+    '''
+    libc    = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+    libc.mmap.restype = ctypes.c_void_p
+    libc.mmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int,
+                          ctypes.c_int, ctypes.c_int, ctypes.c_long]
+    libc.munmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+    libc.mincore.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_char_p]
+    cached  = 0
+    total   = 0
+
+    for path in paths:
+        fd = os.open(os.path.join(root, path.lstrip('/')), os.O_RDONLY)
+        try:
+            size = os.fstat(fd).st_size
+            if size == 0:
+                continue
+            pages   = (size + mmap.PAGESIZE - 1) // mmap.PAGESIZE
+            vector  = ctypes.create_string_buffer(pages)
+            address = libc.mmap(None, size, mmap.PROT_READ, mmap.MAP_SHARED, fd, 0)
+            libc.mincore(address, size, vector)
+            libc.munmap(address, size)
+            cached += sum(byte & 1 for byte in vector.raw)
+            total  += pages
+        finally:
+            os.close(fd)
+
+    return cached / total if total else 1.0
+
+
+def report(label, times):
+    ''' Print latency summary of a phase. '''
+    times = sorted(times)
+    p99   = times[min(len(times) - 1, int(len(times) * 0.99))]
+    print(f'{label:<12} MEDIAN: {statistics.median(times) * 1e6:.0f} us, '
+          f'P99: {p99 * 1e6:.0f} us, '
+          f'MAX: {times[-1] * 1e6:.0f} us')
+
+
+def main():
+    arguments = sys.argv[1:]
+    clients   = 4
+    requests  = 1000
+    root      = None
+    paths     = []
+
+    # Parse command line arguments
+    while arguments:
+        argument = arguments.pop(0)
+        try:
+            if argument == '-c':
+                clients = int(arguments.pop(0))
+            elif argument == '-n':
+                requests = int(arguments.pop(0))
+            elif argument == '-r':
+                root = arguments.pop(0)
+            elif argument == '-h':
+                usage(0)
+            else:
+                paths.append(argument)
+        except (IndexError, ValueError):
+            usage(1)
+
+    if len(paths) < 3:
+        usage(1)
+
+    url   = urllib.parse.urlsplit(paths[0])
+    host  = url.hostname
+    port  = url.port or 80
+    large = paths[1]
+    small = paths[2:]
+
+    # Warm up small files, then measure them alone
+    for path in small:
+        fetch(host, port, path)
+    if root:
+        print(f'SMALL CACHED: {resident(root, small) * 100:.1f}%')
+    report('IDLE', [fetch(host, port, small[i % len(small)])[0] for i in range(requests)])
+
+    # Measure them again while clients download the large file
+    stop       = threading.Event()
+    downloaded = [0] * clients
+
+    def download(index):
+        while not stop.is_set():
+            downloaded[index] += fetch(host, port, large)[1]
+
+    threads = [threading.Thread(target=download, args=(i,)) for i in range(clients)]
+    startTime = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    times = [fetch(host, port, small[i % len(small)])[0] for i in range(requests)]
+    stop.set()
+    for thread in threads:
+        thread.join()
+    elapsed = time.perf_counter() - startTime
+
+    report('DOWNLOADING', times)
+    print(f'DOWNLOADS:   {clients} clients, {sum(downloaded) / elapsed / 2**20:.1f} MiB/s')
+    if root:
+        print(f'SMALL CACHED: {resident(root, small) * 100:.1f}%')
+
+
+# Main execution
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,285 @@
+#!/usr/bin/env python3
+
+import csv
+import json
+import os
+import random
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# Globals
+
+BIN      = os.path.dirname(os.path.abspath(__file__))
+SPIDEY   = os.path.join(BIN, 'spidey')
+BENCH    = os.path.join(BIN, 'spidey-bench')
+WORKERS  = max(2, os.cpu_count() or 1)
+
+# Concurrency modes: name and spidey arguments (add new modes here)
+MODES = [
+    ('single',          ['-c', 'single']),
+    ('forking',         ['-c', 'forking']),
+    ('event',           ['-c', 'event']),
+    ('forking-workers', ['-c', 'forking', '-o', f'workers={WORKERS}']),
+    ('event-workers',   ['-c', 'event',   '-o', f'workers={WORKERS}']),
+]
+
+# Request mix of the generated trace: kind, share of requests
+MIX = [
+    ('small',     0.70),
+    ('medium',    0.12),
+    ('large',     0.02),
+    ('directory', 0.06),
+    ('cgi',       0.05),
+    ('missing',   0.05),
+]
+
+# Functions
+
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [options]
+    -b  BASELINE    Compare against earlier JSON results and fail if any
+                    mode's requests per second drop by more than -f
+    -c  CLIENTS     Comma-separated connection counts to sweep (1,16,64)
+    -d  SECONDS     Duration of each measurement (5)
+    -f  FRACTION    Tolerated drop in requests per second (0.10)
+    -m  MODES       Comma-separated modes to run ({",".join(m for m, _ in MODES)})
+    -o  PREFIX      Write PREFIX.csv and PREFIX.json (perf)
+    -r  ROOT        Serve ROOT instead of a generated document root
+    -t  TRACE       Replay TRACE ("METHOD URI [STATUS]" lines) instead of a
+                    generated one
+
+Starts bin/spidey in each mode, replays the trace with bin/spidey-bench at
+each connection count, and writes a matrix of requests per second, p99
+latency, server CPU and server RSS.''')
+    sys.exit(status)
+
+
+def generate_root(root):
+    ''' Fill root with resources of each kind and return their URIs by kind.
+
+    - root:     Directory to fill
+    '''
+    rng   = random.Random(20289)
+    uris  = {kind: [] for kind, _ in MIX}
+
+    def write(path, size):
+        with open(os.path.join(root, path), 'wb') as fs:
+            fs.write(rng.randbytes(size))
+
+    for i in range(100):
+        write(f'small{i}.html', rng.randint(256, 4096))
+        uris['small'].append(f'/small{i}.html')
+    for i in range(20):
+        write(f'medium{i}.bin', rng.randint(32768, 262144))
+        uris['medium'].append(f'/medium{i}.bin')
+    for i in range(2):
+        write(f'large{i}.bin', 8 << 20)
+        uris['large'].append(f'/large{i}.bin')
+    for i in range(5):
+        os.mkdir(os.path.join(root, f'dir{i}'))
+        for j in range(50):
+            write(f'dir{i}/file{j}.txt', 64)
+        uris['directory'].append(f'/dir{i}/')
+
+    script = os.path.join(root, 'hello.cgi')
+    with open(script, 'w') as fs:
+        fs.write('#!/bin/sh\nprintf "HTTP/1.0 200 OK\\r\\nContent-Type: text/plain\\r\\n\\r\\nquery=%s\\n" "$QUERY_STRING"\n')
+    os.chmod(script, 0o755)
+    uris['cgi'] = [f'/hello.cgi?n={i}' for i in range(10)]
+
+    uris['missing'] = [f'/missing{i}.html' for i in range(20)]
+    return uris
+
+
+def generate_trace(path, uris, length=2000):
+    ''' Write a trace of length requests drawn from MIX (the same every run).
+
+    - path:     Trace file to write
+    - uris:     URIs of each kind (from generate_root)
+    - length:   Number of requests
+    '''
+    rng     = random.Random(20289)
+    kinds   = [kind for kind, _ in MIX]
+    weights = [share for _, share in MIX]
+
+    with open(path, 'w') as fs:
+        fs.write('# Generated by perf.py: ' + ', '.join(f'{k} {w:.0%}' for k, w in MIX) + '\n')
+        for kind in rng.choices(kinds, weights, k=length):
+            status = ' 404' if kind == 'missing' else ''
+            fs.write(f'GET {rng.choice(uris[kind])}{status}\n')
+
+
+def free_port():
+    ''' Return a TCP port nothing is listening on. '''
+    with socket.socket() as sock:
+        sock.bind(('localhost', 0))
+        return sock.getsockname()[1]
+
+
+def start_server(root, port, arguments):
+    ''' Start spidey and wait until it accepts connections.
+
+    - root:         Document root
+    - port:         Port to listen on
+    - arguments:    Mode arguments
+    '''
+    server = subprocess.Popen([SPIDEY, '-p', str(port), '-r', root] + arguments,
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                              start_new_session=True)
+    for _ in range(100):
+        try:
+            socket.create_connection(('localhost', port), timeout=1).close()
+            return server
+        except OSError:
+            if server.poll() is not None:
+                break
+            time.sleep(0.05)
+
+    stop_server(server)
+    raise RuntimeError(f'spidey {" ".join(arguments)} did not start')
+
+
+def stop_server(server):
+    ''' Stop spidey and everything it started (workers, children, CGI
+    scripts): they share its session and process group. '''
+    try:
+        os.killpg(server.pid, signal.SIGTERM)
+    except ProcessLookupError:
+        pass
+    try:
+        server.wait(5)
+    except subprocess.TimeoutExpired:
+        pass
+
+    # Kill stragglers (workers are reparented, so only signals can tell)
+    for _ in range(50):
+        try:
+            os.killpg(server.pid, 0)
+        except ProcessLookupError:
+            break
+        time.sleep(0.1)
+    else:
+        os.killpg(server.pid, signal.SIGKILL)
+    server.wait()
+
+
+def measure(server, port, trace, clients, duration):
+    ''' Replay trace with spidey-bench and return its results as a dict. '''
+    output = subprocess.run([BENCH, '-H', '-c', str(clients), '-d', str(duration),
+                             '-p', str(server.pid), f'localhost:{port}', trace],
+                            stdout=subprocess.PIPE, text=True, check=True).stdout
+    row    = next(csv.DictReader(output.splitlines()))
+    return {k: int(v) if k in ('clients', 'requests', 'errors') else float(v) for k, v in row.items()}
+
+
+def compare(results, baseline, fraction):
+    ''' Print rows whose requests per second dropped by more than fraction
+    from baseline, and return how many there were. '''
+    previous    = {(r['mode'], r['clients']): r['rps'] for r in baseline}
+    regressions = 0
+
+    for row in results:
+        before = previous.get((row['mode'], row['clients']))
+        if before and row['rps'] < before * (1 - fraction):
+            print(f'REGRESSION: {row["mode"]} with {row["clients"]} clients: '
+                  f'{row["rps"]:.1f} rps (was {before:.1f})', file=sys.stderr)
+            regressions += 1
+    return regressions
+
+
+def main():
+    arguments = sys.argv[1:]
+    baseline  = None
+    clients   = [1, 16, 64]
+    duration  = 5
+    fraction  = 0.10
+    modes     = [m for m, _ in MODES]
+    prefix    = 'perf'
+    root      = None
+    trace     = None
+
+    # Parse command line arguments
+    while arguments:
+        argument = arguments.pop(0)
+        try:
+            if argument == '-b':
+                baseline = arguments.pop(0)
+            elif argument == '-c':
+                clients = [int(c) for c in arguments.pop(0).split(',')]
+            elif argument == '-d':
+                duration = int(arguments.pop(0))
+            elif argument == '-f':
+                fraction = float(arguments.pop(0))
+            elif argument == '-m':
+                modes = arguments.pop(0).split(',')
+            elif argument == '-o':
+                prefix = arguments.pop(0)
+            elif argument == '-r':
+                root = arguments.pop(0)
+            elif argument == '-t':
+                trace = arguments.pop(0)
+            elif argument == '-h':
+                usage(0)
+            else:
+                usage(1)
+        except (IndexError, ValueError):
+            usage(1)
+
+    if any(m not in dict(MODES) for m in modes) or (root and not trace):
+        usage(1)
+
+    # Generate document root and trace unless given
+    workspace = tempfile.mkdtemp(prefix='spidey-perf-')
+    try:
+        if not root:
+            root = os.path.join(workspace, 'www')
+            os.mkdir(root)
+            uris = generate_root(root)
+        if not trace:
+            trace = os.path.join(workspace, 'trace')
+            generate_trace(trace, uris)
+
+        # Measure each mode at each connection count, on a fresh server
+        results = []
+        print(f'{"MODE":<16} {"CLIENTS":>7} {"RPS":>10} {"P99_MS":>9} {"CPU_PCT":>8} {"RSS_MIB":>8} {"ERRORS":>7}')
+        for mode in modes:
+            for count in clients:
+                port   = free_port()
+                server = start_server(root, port, dict(MODES)[mode])
+                try:
+                    row = {'mode': mode, **measure(server, port, trace, count, duration)}
+                finally:
+                    stop_server(server)
+                results.append(row)
+                print(f'{mode:<16} {count:>7} {row["rps"]:>10.1f} {row["p99_ms"]:>9.3f} '
+                      f'{row["cpu_pct"]:>8.1f} {row["rss_mib"]:>8.1f} {row["errors"]:>7}')
+    finally:
+        shutil.rmtree(workspace)
+
+    # Write matrix
+    with open(f'{prefix}.csv', 'w', newline='') as fs:
+        writer = csv.DictWriter(fs, fieldnames=list(results[0].keys()))
+        writer.writeheader()
+        writer.writerows(results)
+    with open(f'{prefix}.json', 'w') as fs:
+        json.dump(results, fs, indent=2)
+    print(f'Wrote {prefix}.csv and {prefix}.json')
+
+    if baseline:
+        with open(baseline) as fs:
+            if compare(results, json.load(fs), fraction):
+                sys.exit(1)
+
+
+# Main execution
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+import os
+import socket
+import statistics
+import sys
+import time
+import urllib.parse
+
+# Functions
+
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [-n REQUESTS -f] URL
+    -n  REQUESTS    Number of requests to make (100)
+    -f              Use TCP Fast Open (requires net.ipv4.tcp_fastopen & 1)
+
+Measures handshake-to-first-byte latency: the time from starting the TCP
+connection to receiving the first byte of the response.  Compare a server
+started with default tunables against one started with, for example,
+"-o fastopen=0 -o defer_accept=0 -o nodelay=0 -o cork=0".
+    ''')
+    sys.exit(status)
+
+
+def first_byte(host, port, path, fastopen):
+    ''' Make one HTTP request and return seconds until first response byte.
+
+    - host:     Server host name
+    - port:     Server port number
+    - path:     Resource path to request
+    - fastopen: Whether to send the request in the SYN with TCP Fast Open
+    '''
+    request = f'GET {path} HTTP/1.0\r\nHost: {host}\r\n\r\n'.encode()
+    address = socket.getaddrinfo(host, port, type=socket.SOCK_STREAM)[0]
+
+    with socket.socket(address[0], address[1]) as sock:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        startTime = time.perf_counter()
+        if fastopen:
+            sock.sendto(request, socket.MSG_FASTOPEN, address[4])
+        else:
+            sock.connect(address[4])
+            sock.sendall(request)
+        sock.recv(1)
+        elapsed = time.perf_counter() - startTime
+
+        # Drain response so the server is not left blocked on a full socket
+        while sock.recv(65536):
+            pass
+
+    return elapsed
+
+
+def main():
+    arguments = sys.argv[1:]
+    requests = 100
+    fastopen = False
+    URL = None
+
+    # Parse command line arguments
+    while arguments:
+        argument = arguments.pop(0)
+        if argument == '-n':
+            try:
+                requests = int(arguments.pop(0))
+            except (IndexError, ValueError):
+                usage(1)
+        elif argument == '-f':
+            fastopen = True
+        elif argument == '-h':
+            usage(0)
+        elif not arguments:
+            URL = argument
+        else:
+            usage(1)
+
+    if URL is None:
+        usage(1)
+
+    url  = urllib.parse.urlsplit(URL)
+    path = url.path or '/'
+    if url.query:
+        path += '?' + url.query
+
+    # Warm up (also primes the Fast Open cookie)
+    first_byte(url.hostname, url.port or 80, path, fastopen)
+
+    times = sorted(first_byte(url.hostname, url.port or 80, path, fastopen) for _ in range(requests))
+    p99   = times[min(len(times) - 1, int(len(times) * 0.99))]
+
+    print(f'REQUESTS: {requests}, FASTOPEN: {fastopen}')
+    print(f'MIN: {times[0] * 1e6:.0f} us, '
+          f'MEDIAN: {statistics.median(times) * 1e6:.0f} us, '
+          f'MEAN: {statistics.mean(times) * 1e6:.0f} us, '
+          f'P99: {p99 * 1e6:.0f} us')
+
+
+# Main execution
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
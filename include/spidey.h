@@ -3,10 +3,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
@@ -19,6 +22,7 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    EVENT,                              /**< Coroutine per connection on an epoll loop */
     UNKNOWN
 } ServerMode;
 
@@ -28,6 +32,49 @@ extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern int   RootFd;                    /**< Directory descriptor of RootPath */
+extern char *CertificatePath;           /**< Path to TLS certificate chain (NULL for cleartext) */
+extern char *KeyPath;                   /**< Path to TLS private key */
+extern char *ConfigPath;                /**< Path to tunables file (NULL for none) */
+extern char *ArchivePath;               /**< Path to packed docroot archive (NULL for none) */
+
+/* Tunables (set with -o name=value) */
+
+extern int   ListenBacklog;             /**< Length of listen(2) backlog */
+extern int   DualStack;                 /**< Accept IPv4 on IPv6 socket */
+extern int   DeferAccept;               /**< TCP_DEFER_ACCEPT timeout (seconds) */
+extern int   FastOpenQueue;             /**< TCP_FASTOPEN queue length (0 disables) */
+extern int   TcpNoDelay;                /**< Disable Nagle on client sockets */
+extern int   TcpCork;                   /**< Cork client sockets around responses */
+extern int   MaxConnections;            /**< Stop accepting above this many clients */
+extern int   IdleTimeout;               /**< Seconds to wait for first request byte */
+extern int   HeaderTimeout;             /**< Seconds to receive complete request head */
+extern int   BodyTimeout;               /**< Seconds of inactivity reading request body */
+extern int   WriteTimeout;              /**< Seconds of inactivity writing response */
+extern int   KernelTls;                 /**< Offload TLS record encryption to kernel */
+extern int   ProxyTimeout;              /**< Seconds to wait on upstream servers */
+extern int   ProxyPoolSize;             /**< Idle keep-alive connections per upstream */
+extern int   RateLimit;                 /**< Requests per second per client (0 disables) */
+extern int   RateBurst;                 /**< Requests a client may burst above RateLimit */
+extern int   ClientConnections;         /**< Open connections per client (0 disables) */
+extern int   RateSlots;                 /**< Clients tracked in rate limit table */
+extern int   BrowseSort;                /**< Largest directory listed in sorted order */
+extern int   CgiCacheTtl;               /**< Seconds to cache CGI responses (0 disables) */
+extern int   CgiCacheMax;               /**< Largest cached CGI response (bytes) */
+extern int   CgiCacheSlots;             /**< Entries in CGI cache (keys share slots) */
+extern int   NegativeSlots;             /**< URIs kept in negative cache (0 disables) */
+extern int   LargeFileSize;             /**< Files streamed with readahead and drop-behind (bytes, 0 disables) */
+extern int   ReadaheadSize;             /**< Bytes read ahead of large file sends */
+extern int   DropBehind;                /**< Drop sent pages of large files from the page cache */
+extern int   DirectIo;                  /**< Read large files with O_DIRECT */
+extern int   SendRate;                  /**< Body bytes per second per connection (0 disables) */
+extern int   TotalRate;                 /**< Body bytes per second across all connections (0 disables) */
+extern int   SendSlice;                 /**< Bytes of body sent before other clients get a turn */
+extern int   Profile;                   /**< Serve profiler endpoint and count phase cycles */
+extern int   Workers;                   /**< Server processes (0 for one per CPU) */
+extern int   CpuAffinity;               /**< Pin workers and children to CPUs */
+extern int   AcceptShard;               /**< Give each worker its own SO_REUSEPORT socket */
+extern int   CoroutineStack;            /**< Stack size of coroutines (bytes) */
 
 /* Logging Macros */
 
@@ -40,6 +87,48 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Timers */
+
+#define TIMER_LEVELS    4               /* Levels of timer wheel */
+#define TIMER_SLOTS     64              /* Slots per level */
+
+typedef struct timer Timer;
+struct timer {
+    Timer    *next;                     /*< Next timer in slot (NULL if idle) */
+    Timer    *prev;                     /*< Previous timer in slot */
+    uint64_t  expires;                  /*< Expiration time (milliseconds) */
+    void    (*callback)(Timer *timer);  /*< Function called on expiration */
+    void     *data;                     /*< User data for callback */
+};
+
+typedef struct {
+    Timer     slots[TIMER_LEVELS][TIMER_SLOTS]; /*< Slot list heads */
+    uint64_t  now;                      /*< Time wheel has advanced to */
+    size_t    count;                    /*< Number of pending timers */
+} TimerWheel;
+
+extern TimerWheel Timers;               /**< Process-wide timer wheel */
+
+uint64_t    now_ms(void);
+void        timer_wheel_init(TimerWheel *wheel, uint64_t now);
+void        timer_add(TimerWheel *wheel, Timer *timer, uint64_t expires);
+void        timer_cancel(TimerWheel *wheel, Timer *timer);
+size_t      timer_advance(TimerWheel *wheel, uint64_t now);
+int         timer_timeout(TimerWheel *wheel, uint64_t now);
+
+/* Coroutines */
+
+typedef struct coroutine Coroutine;
+
+bool        coroutine_init(void);
+bool        coroutine_spawn(void (*function)(void *), void *argument);
+Coroutine * coroutine_self(void);
+size_t      coroutine_count(void);
+int         coroutine_wait(int fd, short events, uint64_t deadline);
+void        coroutine_watch(int sfd);
+bool        coroutine_schedule(void);
+void        coroutine_yield(void);
+
 /* HTTP Request */
 
 typedef struct header Header;
@@ -49,52 +138,337 @@ struct header {
     Header  *next;                      /*< Next header entry */
 };
 
+/**
+ * Connection deadlines
+ */
+typedef enum {
+    DEADLINE_NONE,                      /**< No deadline */
+    DEADLINE_IDLE,                      /**< Waiting for first byte of request */
+    DEADLINE_HEADER,                    /**< Reading request line and headers */
+    DEADLINE_BODY,                      /**< Reading request body */
+    DEADLINE_WRITE,                     /**< Writing response */
+} Deadline;
+
+typedef struct sink Sink;
+typedef struct limit_slot LimitSlot;
+
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *stream;                    /*< Client socket file stream */
+    Sink    *sink;                      /*< Destination of response bytes */
+    struct ssl_st *tls;                 /*< TLS session (NULL for cleartext) */
+    LimitSlot *limit;                   /*< Rate limit slot counting this connection */
+    char     input[BUFSIZ];             /*< Buffered client input */
+    size_t   input_start;               /*< Offset of unread input */
+    size_t   input_end;                 /*< Offset past buffered input */
+    Timer    timer;                     /*< Deadline timer */
+    Deadline deadline;                  /*< Current deadline */
+    bool     timed_out;                 /*< Whether current deadline expired */
+    uint64_t shaped;                    /*< Send bucket of connection (see shaping_slice) */
+    uint64_t generation;                /*< Reload generation connection was accepted in (see control_retire) */
+
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
+    const struct virtual_host *vhost;   /*< Virtual host serving request */
+    char    *path;                      /*< Real path corrsponding to URI and host root */
+    int      file_fd;                   /*< Opened file descriptor of path */
     char    *query;                     /*< HTTP query string */
 
-    char     host[NI_MAXHOST];          /*< Host name of client */
-    char     port[NI_MAXSERV];          /*< Port number of client */
+    struct sockaddr_storage addr;       /*< Address of client */
+    socklen_t addrlen;                  /*< Length of client address */
+    char     host[NI_MAXHOST];          /*< Host name of client (see request_host) */
+    char     port[NI_MAXSERV];          /*< Port number of client (see request_port) */
 
     Header  *headers;                   /*< List of name, data Header pairs */
 } Request;
 
+#define ACCEPT_BATCH    64              /* Maximum clients accepted per wakeup */
+
 Request *   accept_request(int sfd);
+size_t      accept_requests(int sfd, Request **requests, size_t n);
+size_t      accept_pending(int sfd, Request **requests, size_t n);
+const char *request_host(Request *request);
+const char *request_port(Request *request);
 void	    free_request(Request *request);
 int	    parse_request(Request *request);
+void        request_deadline(Request *request, Deadline deadline);
+int         request_wait(Request *request, short events);
+char *      request_gets(Request *request, char *buffer, size_t size);
+const char *request_header(Request *request, const char *name);
+ssize_t     request_read(Request *request, void *buffer, size_t size);
 
 /* HTTP Request Handlers */
 
 typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_TOO_MANY_REQUESTS,	/* 429 Too Many Requests */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
 } Status;
 
+extern const char *CgiHeaders[][2];     /**< Request headers exported to CGI scripts, and their variables */
+
 Status      handle_request(Request *request);
+Status      dispatch_request(Request *request);
+Status      handle_error(Request *request, Status status);
+
+/* Response Sinks */
+
+struct sink {
+    /* Write response bytes (status line, headers, body) for request */
+    ssize_t (*writev)(Request *request, struct iovec *iov, int iovcnt, bool more);
+};
+
+extern Sink SocketSink;                 /**< Writes directly to client socket */
+
+/* HTTP Response */
+
+#define RESPONSE_IOVECS 16
+
+typedef struct {
+    Status        status;               /*< HTTP status of response */
+    struct iovec  iov[RESPONSE_IOVECS]; /*< Status line, headers, and body */
+    int           iovcnt;               /*< Number of used iovecs */
+    char          length[48];           /*< Formatted Content-Length header */
+} Response;
+
+void        response_init(Response *response, Status status);
+void        response_header(Response *response, const char *block, size_t length);
+void        response_content_type(Response *response, const char *mimetype);
+void        response_content_length(Response *response, size_t length);
+void        response_body(Response *response, const void *body, size_t length);
+ssize_t     response_send(Request *request, Response *response, bool more);
+ssize_t     response_write(Request *request, const void *buffer, size_t length);
+ssize_t     response_sendfile(Request *request, int fd, off_t offset, size_t length);
+
+/* Bandwidth Shaping */
+
+void        shaping_init(void);
+size_t      shaping_slice(Request *request, size_t sent, size_t remaining);
+
+/* Profiling */
+
+#define PROFILE_PREFIX  "/_spidey/"     /* URIs of profiler endpoint (loopback clients only) */
+
+typedef enum {
+    PHASE_PARSE,                        /**< parse_request */
+    PHASE_PATH,                         /**< determine_request_path */
+    PHASE_MIMETYPE,                     /**< determine_mimetype */
+    PHASE_FILE,                         /**< handle_file_request */
+    PHASE_BROWSE,                       /**< handle_browse_request */
+    PHASE_CGI,                          /**< handle_cgi_request */
+    PHASE_ARCHIVE,                      /**< handle_archive_request */
+    PHASE_PROXY,                        /**< handle_proxy_request */
+    PHASE_COUNT,
+} Phase;
+
+void        profile_init(void);
+uint64_t    profile_clock(void);
+void        profile_phase(Phase phase, uint64_t start);
+Status      handle_profile_request(Request *request);
+
+/* Large Files */
+
+ssize_t     stream_file(Request *request, int fd, off_t offset, size_t length);
+
+/* HTTP/2 */
+
+#define HPACK_TABLE_SIZE    4096        /* Default and maximum dynamic table size */
+#define HPACK_BLOCK_MAX     65536       /* Largest accepted header block */
+
+typedef struct {
+    char    *name;                      /*< Header name */
+    char    *value;                     /*< Header value */
+} HpackEntry;
+
+typedef struct {
+    HpackEntry *entries;                /*< Dynamic entries, oldest first */
+    size_t      count;                  /*< Number of entries */
+    size_t      capacity;               /*< Allocated entries */
+    size_t      size;                   /*< Size in octets (RFC 7541 4.1) */
+    size_t      max_size;               /*< Maximum size in octets */
+} HpackTable;
+
+typedef void (*HpackEmit)(void *context, const char *name, const char *value);
+
+void        hpack_table_init(HpackTable *table, size_t max_size);
+void        hpack_table_free(HpackTable *table);
+void        hpack_table_resize(HpackTable *table, size_t max_size);
+int         hpack_decode(HpackTable *table, const uint8_t *block, size_t length, HpackEmit emit, void *context);
+ssize_t     hpack_encode(HpackTable *table, uint8_t *buffer, size_t size, const char *name, const char *value, bool index);
+ssize_t     hpack_encode_table_size(HpackTable *table, uint8_t *buffer, size_t size, size_t max_size);
+
+bool        http2_upgrade_requested(Request *request);
+Status      http2_serve(Request *request, bool upgrade);
+
+/* Virtual Hosts */
+
+typedef struct virtual_host {
+    char    *name;                      /*< Host name ("*.example.com" matches subdomains) */
+    char    *path;                      /*< Document root as configured */
+    char    *root;                      /*< Real path of document root */
+    int      rootfd;                    /*< Directory descriptor of root */
+    char    *mimetype;                  /*< Default mimetype */
+    bool     cgi;                       /*< Run executable files as CGI scripts */
+    bool     browse;                    /*< List directories */
+    bool     archive;                   /*< Look up files in packed archive (-A) first */
+} VirtualHost;
+
+bool        vhost_add(const char *spec);
+void        vhost_build(void);
+void        vhost_reload(void);
+void        vhost_foreach(void (*callback)(const VirtualHost *host));
+const VirtualHost *vhost_lookup(const char *name);
+
+/* Negative Cache */
+
+typedef struct {
+    uint64_t hash;                      /*< Hash of root and URI (0 if not cached) */
+    uint32_t generation;                /*< Generation when URI was looked up */
+} NegativeKey;
+
+void        negcache_init(void);
+bool        negcache_lookup(const VirtualHost *host, const char *uri, NegativeKey *key);
+void        negcache_insert(const NegativeKey *key);
+
+/* CGI Cache */
+
+#define CGI_CACHE_HEAD  4096            /* Response head examined for Cache-Control */
+
+typedef struct {
+    char    *key;                       /*< Cache key (script, query, and headers) */
+    size_t   key_length;                /*< Length of key */
+    char     name[24];                  /*< Entry file name (slot of key) */
+    char     temporary[48];             /*< Entry being filled */
+    int      lockfd;                    /*< Key lock held while filling (-1 if none) */
+    int      fd;                        /*< Entry being filled (-1 if not filling) */
+    size_t   length;                    /*< Response bytes captured */
+    bool     oversized;                 /*< Response exceeded CgiCacheMax */
+    char     head[CGI_CACHE_HEAD];      /*< Start of response */
+    size_t   head_length;               /*< Bytes in head */
+} CgiCacheFill;
+
+void        cgicache_init(void);
+bool        cgicache_serve(Request *request, CgiCacheFill *fill, Status *status);
+void        cgicache_capture(CgiCacheFill *fill, const void *data, size_t length);
+void        cgicache_finish(CgiCacheFill *fill, bool complete);
+
+/* Packed Archives (built by spidey-pack, served with -A) */
+
+#define ARCHIVE_MAGIC   "SPDYPAK1"      /* First bytes of archive (format version) */
+
+/**
+ * Archive layout: header, bodies, index, entries, strings.  Offsets are from
+ * the start of the archive.  The index is an open-addressed table of entry
+ * numbers plus one (0 marks an empty slot), probed from hash_string(path).
+ */
+typedef struct {
+    char     magic[8];                  /*< ARCHIVE_MAGIC */
+    uint64_t size;                      /*< Size of archive */
+    uint64_t index;                     /*< Offset of index (slots uint32_t) */
+    uint64_t entries;                   /*< Offset of entries (count ArchiveEntry) */
+    uint32_t count;                     /*< Number of entries */
+    uint32_t slots;                     /*< Number of index slots (power of 2) */
+} ArchiveHeader;
+
+typedef struct {
+    uint64_t head;                      /*< Offset of header block (Content-Type, -Length, ETag) */
+    uint64_t etag;                      /*< Offset of quoted entity tag */
+    uint64_t body;                      /*< Offset of body */
+    uint64_t length;                    /*< Length of body */
+    uint32_t head_length;               /*< Length of header block (0 if variant is absent) */
+    uint32_t etag_length;               /*< Length of entity tag */
+} ArchiveVariant;
+
+typedef struct {
+    uint64_t path;                      /*< Offset of path relative to root (NUL-terminated) */
+    uint32_t hash;                      /*< hash_string(path) */
+    uint32_t path_length;               /*< Length of path */
+    ArchiveVariant identity;            /*< Contents as is */
+    ArchiveVariant gzip;                /*< Precompressed contents (optional) */
+} ArchiveEntry;
+
+bool        archive_open(const char *path);
+const ArchiveEntry *archive_lookup(const char *uri);
+Status      handle_archive_request(Request *request, const ArchiveEntry *entry);
+
+/* Reverse Proxy */
+
+typedef struct proxy_route ProxyRoute;
+
+bool        proxy_add_route(const char *spec);
+ProxyRoute *proxy_route(const char *uri);
+Status      handle_proxy_request(Request *request, ProxyRoute *route);
+
+/* Rate Limiting */
+
+void        ratelimit_init(void);
+Status      ratelimit_accept(Request *request);
+Status      ratelimit_request(Request *request);
+void        ratelimit_release(Request *request);
+void        ratelimit_disown(Request *request);
+void        ratelimit_reject(Request *request, Status status);
+
+/* TLS */
+
+extern Sink TlsSink;                    /**< Encrypts with OpenSSL (no kernel TLS) */
+
+int         tls_init(const char *certificate, const char *key);
+bool        tls_enabled(void);
+int         tls_accept(Request *request);
+ssize_t     tls_recv(Request *request, void *buffer, size_t size);
+void        tls_close(Request *request);
 
 /* HTTP Server */
 
 int         single_server(int sfd);
 int         forking_server(int sfd);
+bool        forking_child(void);
+int         event_server(int sfd);
+void        server_reload(void);
+
+/* Worker Processes */
+
+void        workers_init(void);
+int         workers_server(int sfd, int (*server)(int sfd));
+void        workers_signal(int signum);
+void        workers_pin_client(int fd);
+
+/* Reload and Upgrade Control */
+
+void        control_init(char *argv[]);
+void        control_worker(void);
+void        control_ready(void);
+bool        control_poll(int sfd);
+bool        control_reaped(pid_t pid);
+void        control_hold(Request *r);
+void        control_release(Request *r);
+void        control_retire(void *data, size_t size, int fd);
 
 /* Socket */
 
+#define SOCKET_INHERIT_FD   3           /* Listening socket passed on upgrade (as systemd does) */
+
 int	    socket_listen(const char *port);
+int	    socket_clone(int sfd);
+bool	    socket_inherited(void);
+void	    socket_cork(int fd, bool cork);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	    determine_mimetype(const char *path);
-char *	    determine_request_path(const char *uri);
+bool	    mimetypes_load(const char *path);
+char *	    determine_mimetype(const char *path, const char *fallback);
+char *	    determine_request_path(const VirtualHost *host, const char *uri, int *fd);
+uint32_t    hash_string(const char *s);
 const char *http_status_string(Status status);
+int	    normalize_uri(const char *uri, char *buffer, size_t size);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
 
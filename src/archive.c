@@ -0,0 +1,238 @@
+/* archive.c: Packed Docroot Archives */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARCHIVE_INLINE  65536           /* Largest body sent from the mapping with the head */
+
+static const char *Archive = NULL;      /* Mapped archive */
+static size_t      ArchiveSize = 0;     /* Size of mapping */
+static int         ArchiveFd = -1;      /* Archive file (for sendfile) */
+
+/**
+ * Check that range lies within archive of given size.
+ **/
+static bool archive_range(uint64_t size, uint64_t offset, uint64_t length)
+{
+    return offset <= size && length <= size - offset;
+}
+
+/**
+ * Check that variant (if present) lies within archive.
+ **/
+static bool archive_variant(uint64_t size, const ArchiveVariant *v)
+{
+    return v->head_length == 0 ||
+           (archive_range(size, v->head, v->head_length) &&
+            archive_range(size, v->etag, v->etag_length) &&
+            archive_range(size, v->body, v->length));
+}
+
+/**
+ * Map packed archive.
+ *
+ * @param   path        Path to archive built by spidey-pack.
+ * @return  true if the archive was mapped (replacing any previous one).
+ *
+ * Every offset in the archive is checked here, once, so that lookups can
+ * trust it.  The mapping is shared with forked children and with other
+ * servers mapping the same file, so all of them serve from one copy in the
+ * page cache.  Only the index is read ahead; bodies are faulted in (or sent
+ * with sendfile) as they are requested.
+ **/
+bool archive_open(const char *path)
+{
+    const ArchiveHeader *header;
+    const ArchiveEntry *entries;
+    const uint32_t *index;
+    uint32_t used = 0;
+    struct stat s;
+    char *map;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &s) < 0)
+    {
+        log("Unable to open archive %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    if ((size_t)s.st_size < sizeof(ArchiveHeader))
+    {
+        log("Invalid archive %s: truncated", path);
+        goto fail;
+    }
+
+    map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        log("Unable to map archive %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    /* Validate header, index, and every entry */
+    header = (const ArchiveHeader *)map;
+    if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) || header->size != (uint64_t)s.st_size ||
+        header->slots == 0 || (header->slots & (header->slots - 1)) || header->count >= header->slots ||
+        !archive_range(s.st_size, header->index, (uint64_t)header->slots * sizeof(uint32_t)) ||
+        !archive_range(s.st_size, header->entries, (uint64_t)header->count * sizeof(ArchiveEntry)) ||
+        header->index % sizeof(uint32_t) || header->entries % sizeof(uint64_t))
+    {
+        log("Invalid archive %s: bad header", path);
+        goto unmap;
+    }
+
+    /* An empty slot must remain, so that every probe sequence ends */
+    index = (const uint32_t *)(map + header->index);
+    for (uint32_t i = 0; i < header->slots; i++)
+    {
+        used += index[i] != 0;
+        if (index[i] > header->count || used == header->slots)
+        {
+            log("Invalid archive %s: bad index", path);
+            goto unmap;
+        }
+    }
+
+    entries = (const ArchiveEntry *)(map + header->entries);
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        const ArchiveEntry *e = &entries[i];
+
+        if (!archive_range(s.st_size, e->path, (uint64_t)e->path_length + 1) || map[e->path + e->path_length] ||
+            e->identity.head_length == 0 || !archive_variant(s.st_size, &e->identity) ||
+            !archive_variant(s.st_size, &e->gzip))
+        {
+            log("Invalid archive %s: bad entry %u", path, i);
+            goto unmap;
+        }
+    }
+
+    /* Read ahead index, entries, and strings (they follow the bodies) */
+    uint64_t start = header->index & ~(uint64_t)(getpagesize() - 1);
+    madvise(map + start, s.st_size - start, MADV_WILLNEED);
+
+    /* Replace current archive (requests in flight may still be using it) */
+    if (Archive)
+        control_retire((void *)Archive, ArchiveSize, ArchiveFd);
+    Archive = map;
+    ArchiveSize = s.st_size;
+    ArchiveFd = fd;
+    debug("Archive         = %s (%u files)", path, header->count);
+    return true;
+
+unmap:
+    munmap(map, s.st_size);
+fail:
+    if (fd >= 0)
+        close(fd);
+    return false;
+}
+
+/**
+ * Look up URI in archive.
+ *
+ * @param   uri         Request URI (without query).
+ * @return  Entry for URI or NULL if it is not in the archive.
+ *
+ * The URI is normalized as for the file system (see normalize_uri), so this
+ * makes no system calls.
+ **/
+const ArchiveEntry *archive_lookup(const char *uri)
+{
+    const ArchiveHeader *header = (const ArchiveHeader *)Archive;
+    const ArchiveEntry *entries;
+    const uint32_t *index;
+    char relative[PATH_MAX];
+    int length;
+
+    if (!Archive || (length = normalize_uri(uri, relative, sizeof(relative))) < 0)
+        return NULL;
+
+    index = (const uint32_t *)(Archive + header->index);
+    entries = (const ArchiveEntry *)(Archive + header->entries);
+
+    uint32_t hash = hash_string(relative);
+    for (uint32_t slot = hash & (header->slots - 1); index[slot]; slot = (slot + 1) & (header->slots - 1))
+    {
+        const ArchiveEntry *e = &entries[index[slot] - 1];
+
+        if (e->hash == hash && e->path_length == (uint32_t)length && !memcmp(Archive + e->path, relative, length))
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * Handle request for archived file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   entry       Archive entry (from archive_lookup).
+ * @return  Status of the HTTP request.
+ *
+ * The mimetype, Content-Length, and ETag headers were formatted by
+ * spidey-pack, so a response is the precomputed head plus the body, sent
+ * straight from the mapping (or with sendfile for large bodies).  Clients
+ * that accept gzip get the precompressed variant when there is one, and a
+ * matching If-None-Match gets 304 Not Modified.
+ *
+ * The entry must come from the current archive.  If a reload replaces it
+ * while the response is being sent, the old mapping and file stay open until
+ * the request is freed (see control_retire).
+ **/
+Status handle_archive_request(Request *r, const ArchiveEntry *entry)
+{
+    const char *archive = Archive;      /* A reload may replace these while we yield */
+    int fd = ArchiveFd;
+    const ArchiveVariant *variant = &entry->identity;
+    const char *encodings = request_header(r, "Accept-Encoding");
+    const char *match = request_header(r, "If-None-Match");
+    Response response;
+    bool large;
+
+    log("Handling archive request (in)");
+
+    if (entry->gzip.head_length && encodings && strstr(encodings, "gzip"))
+        variant = &entry->gzip;
+
+    /* Revalidation: the quoted ETag appears in If-None-Match */
+    if (match && (streq(match, "*") || memmem(match, strlen(match), archive + variant->etag, variant->etag_length)))
+    {
+        static const char ETag[] = "ETag: ";
+
+        response_init(&response, HTTP_STATUS_NOT_MODIFIED);
+        response_header(&response, ETag, sizeof(ETag) - 1);
+        response_header(&response, archive + variant->etag, variant->etag_length);
+        response_header(&response, "\r\n", 2);
+        response_body(&response, NULL, 0);
+        return response_send(r, &response, false) < 0 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_NOT_MODIFIED;
+    }
+
+    /* Large bodies go out with sendfile when writing straight to the socket */
+    large = variant->length > ARCHIVE_INLINE && r->sink == &SocketSink;
+
+    if (large)
+        socket_cork(r->fd, true);
+    response_init(&response, HTTP_STATUS_OK);
+    response_header(&response, archive + variant->head, variant->head_length);
+    response_body(&response, archive + variant->body, large ? 0 : variant->length);
+    if (response_send(r, &response, large) < 0 ||
+        (large && response_sendfile(r, fd, variant->body, variant->length) < 0))
+    {
+        if (large)
+            socket_cork(r->fd, false);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    if (large)
+        socket_cork(r->fd, false);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
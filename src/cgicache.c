@@ -0,0 +1,423 @@
+/* cgicache.c: CGI Response Micro-Cache */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CGI_CACHE_MAGIC "SPDYCGI1"      /* First bytes of cache entry */
+#define CGI_CACHE_PASS  0x1             /* Entry marks key as uncacheable */
+#define CGI_CACHE_POLL  10              /* Milliseconds between lock attempts in a coroutine */
+
+/**
+ * Cache entry header, followed by the key and the response.
+ **/
+typedef struct {
+    char     magic[8];                  /*< CGI_CACHE_MAGIC */
+    uint64_t expires;                   /*< Expiration (wall clock milliseconds) */
+    uint64_t length;                    /*< Length of response */
+    uint32_t key_length;                /*< Length of key */
+    uint32_t flags;                     /*< CGI_CACHE_PASS */
+} CgiCacheHeader;
+
+static int CacheDirFd = -1;             /* Cache directory (shared by all processes) */
+
+/**
+ * Return wall clock time in milliseconds (comparable across processes and
+ * server restarts).
+ **/
+static uint64_t cgicache_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Return number of cache slots.
+ **/
+static size_t cgicache_slots(void)
+{
+    return CgiCacheSlots > 0 ? (size_t)CgiCacheSlots : 1;
+}
+
+/**
+ * Remove files that belong to no current slot.
+ *
+ * These are left by a server with more slots (or an older naming), and
+ * would otherwise never be reused or removed.
+ **/
+static void cgicache_prune(void)
+{
+    int fd = openat(CacheDirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    struct dirent *e;
+
+    if (!d)
+    {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    while ((e = readdir(d)))
+    {
+        char *end;
+        unsigned long slot;
+
+        if (e->d_name[0] == '.')
+            continue;
+        slot = strtoul(e->d_name, &end, 16);
+        if (end - e->d_name != 8 || slot >= cgicache_slots() || (*end && *end != '.'))
+            unlinkat(CacheDirFd, e->d_name, 0);
+    }
+    closedir(d);
+}
+
+/**
+ * Open cache directory.
+ *
+ * Entries are files in a private directory (on tmpfs when /dev/shm exists)
+ * named after the port, so forked workers share them and an upgraded server
+ * (see control_upgrade) starts with a warm cache.  Nothing is done unless
+ * CgiCacheTtl is set.
+ *
+ * Keys are hashed into CgiCacheSlots slots, each an entry file and a lock
+ * file, so the cache never holds more than CgiCacheSlots * CgiCacheMax bytes
+ * however many distinct keys clients send.
+ **/
+void cgicache_init(void)
+{
+    char path[PATH_MAX];
+    struct stat s;
+
+    if (CgiCacheTtl <= 0)
+        return;
+    if (CacheDirFd >= 0)
+    {
+        cgicache_prune();               /* CgiCacheSlots may have shrunk */
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/spidey-cgi-%s", access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp", Port);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+    {
+        log("Unable to create CGI cache %s: %s", path, strerror(errno));
+        return;
+    }
+
+    /* Refuse a directory someone else could write to */
+    CacheDirFd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (CacheDirFd < 0 || fstat(CacheDirFd, &s) < 0 || s.st_uid != geteuid() || (s.st_mode & 077))
+    {
+        log("Unable to use CGI cache %s: %s", path, CacheDirFd < 0 ? strerror(errno) : "not private");
+        if (CacheDirFd >= 0)
+            close(CacheDirFd);
+        CacheDirFd = -1;
+        return;
+    }
+    debug("CgiCache        = %s", path);
+    cgicache_prune();
+}
+
+/**
+ * Open cache entry if it is current and belongs to key.
+ *
+ * @return  File descriptor of entry (positioned after the key), or -1.
+ **/
+static int cgicache_open(const CgiCacheFill *fill, CgiCacheHeader *header)
+{
+    char key[1024];
+    int fd = openat(CacheDirFd, fill->name, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+        memcmp(header->magic, CGI_CACHE_MAGIC, sizeof(header->magic)) ||
+        header->expires <= cgicache_now() || header->key_length != fill->key_length)
+        goto stale;
+
+    /* Compare key in pieces (it may be longer than the buffer) */
+    for (size_t offset = 0; offset < fill->key_length; offset += sizeof(key))
+    {
+        size_t n = fill->key_length - offset < sizeof(key) ? fill->key_length - offset : sizeof(key);
+        if (pread(fd, key, n, sizeof(*header) + offset) != (ssize_t)n || memcmp(key, fill->key + offset, n))
+            goto stale;
+    }
+    return fd;
+
+stale:
+    close(fd);
+    return -1;
+}
+
+/**
+ * Send cached response.
+ **/
+static Status cgicache_send(Request *r, int fd, const CgiCacheHeader *header)
+{
+    ssize_t n;
+
+    socket_cork(r->fd, true);
+    n = response_sendfile(r, fd, sizeof(*header) + header->key_length, header->length);
+    socket_cork(r->fd, false);
+    close(fd);
+    return n < 0 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
+}
+
+/**
+ * Take exclusive lock on key.
+ **/
+static int cgicache_lock(int fd)
+{
+    if (!coroutine_self())
+        return flock(fd, LOCK_EX);
+
+    while (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        if (errno != EWOULDBLOCK)
+            return -1;
+        coroutine_wait(-1, 0, now_ms() + CGI_CACHE_POLL);
+    }
+    return 0;
+}
+
+/**
+ * Serve CGI request from cache or prepare to fill it.
+ *
+ * @param   r           HTTP Request structure (path resolved to a CGI script).
+ * @param   fill        Fill state for cgicache_capture and cgicache_finish.
+ * @param   status      Set to the status of the response if it was served.
+ * @return  true if the response was served from the cache.
+ *
+ * Only GET requests are cached.  The key holds every variable exported to the
+ * script (see handle_cgi_request) that can vary between requests for it: the
+ * script path, document root, request URI, query string, scheme, and each
+ * header in CgiHeaders (an absent header, unset for the script, differs from
+ * an empty one).  The client's address and port are left out, since they
+ * would make every request a miss; scripts that depend on them should send
+ * Cache-Control: private.
+ *
+ * Keys that share a slot replace each other's entries (the key stored in the
+ * entry tells them apart) and share its lock.
+ *
+ * On a miss, the caller becomes the only process running the script for the
+ * key: concurrent misses wait on the key's lock (flock) and are then served
+ * the response it stored.  If the response turned out to be uncacheable, a
+ * "pass" entry lets later requests run the script without waiting.
+ **/
+bool cgicache_serve(Request *r, CgiCacheFill *fill, Status *status)
+{
+    CgiCacheHeader header;
+    char lock[sizeof(fill->name) + 8];
+    uint64_t hash = 14695981039346656037ull;
+    int fd;
+
+    memset(fill, 0, sizeof(*fill));
+    fill->fd = fill->lockfd = -1;
+
+    if (CacheDirFd < 0 || CgiCacheTtl <= 0 || !streq(r->method, "GET"))
+        return false;
+
+    char *key;
+    size_t n;
+    FILE *fs = open_memstream(&key, &n);
+
+    if (!fs)
+        return false;
+    fprintf(fs, "%s\n%s\n%s\n%s\n%s", r->path, r->vhost->root, r->uri, r->query, r->tls ? "https" : "http");
+    for (size_t i = 0; CgiHeaders[i][0]; i++)
+    {
+        const char *value = request_header(r, CgiHeaders[i][0]);
+        fprintf(fs, "\n%s%s", value ? "=" : "", value ? value : "");
+    }
+    if (fclose(fs) != 0)
+    {
+        free(key);
+        return false;
+    }
+    fill->key = key;
+    fill->key_length = n;
+
+    for (size_t i = 0; i < n; i++)
+        hash = (hash ^ (unsigned char)fill->key[i]) * 1099511628211ull;
+    snprintf(fill->name, sizeof(fill->name), "%08zx", (size_t)(hash % cgicache_slots()));
+
+    /* Hit (or pass) without locking */
+    if ((fd = cgicache_open(fill, &header)) >= 0)
+    {
+        cgicache_finish(fill, false);
+        if (header.flags & CGI_CACHE_PASS)
+        {
+            close(fd);
+            return false;
+        }
+        debug("CGI cache hit: %s", fill->name);
+        *status = cgicache_send(r, fd, &header);
+        return true;
+    }
+
+    /* Miss: wait for any process filling the entry, then look again.  A
+     * coroutine polls the lock instead, since the filler may be another
+     * coroutine of this process that cannot run while we block. */
+    snprintf(lock, sizeof(lock), "%s.lock", fill->name);
+    fill->lockfd = openat(CacheDirFd, lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fill->lockfd < 0 || cgicache_lock(fill->lockfd) < 0)
+    {
+        debug("Unable to lock CGI cache entry %s: %s", fill->name, strerror(errno));
+        return false;
+    }
+
+    if ((fd = cgicache_open(fill, &header)) >= 0)
+    {
+        cgicache_finish(fill, false);
+        if (header.flags & CGI_CACHE_PASS)
+        {
+            close(fd);
+            return false;
+        }
+        debug("CGI cache hit after wait: %s", fill->name);
+        *status = cgicache_send(r, fd, &header);
+        return true;
+    }
+
+    /* Fill: capture response into a temporary entry */
+    snprintf(fill->temporary, sizeof(fill->temporary), "%s.%d.tmp", fill->name, getpid());
+    fill->fd = openat(CacheDirFd, fill->temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fill->fd < 0 || pwrite(fill->fd, fill->key, fill->key_length, sizeof(CgiCacheHeader)) != (ssize_t)fill->key_length)
+    {
+        debug("Unable to create CGI cache entry %s: %s", fill->temporary, strerror(errno));
+        cgicache_finish(fill, false);
+    }
+    debug("CGI cache miss: %s", fill->name);
+    return false;
+}
+
+/**
+ * Capture response bytes written to the client.
+ **/
+void cgicache_capture(CgiCacheFill *fill, const void *data, size_t length)
+{
+    if (fill->fd < 0)
+        return;
+
+    if (fill->head_length < sizeof(fill->head))
+    {
+        size_t n = sizeof(fill->head) - fill->head_length < length ? sizeof(fill->head) - fill->head_length : length;
+        memcpy(fill->head + fill->head_length, data, n);
+        fill->head_length += n;
+    }
+
+    if (fill->length + length > (size_t)CgiCacheMax ||
+        pwrite(fill->fd, data, length, sizeof(CgiCacheHeader) + fill->key_length + fill->length) != (ssize_t)length)
+    {
+        fill->oversized = true;
+        return;
+    }
+    fill->length += length;
+}
+
+/**
+ * Determine how long captured response may be cached.
+ *
+ * @return  Time to live in seconds (0 if the response must not be cached).
+ *
+ * Only 200 responses are cached, for CgiCacheTtl seconds unless the script's
+ * Cache-Control header sets max-age (or s-maxage).  Responses that set cookies
+ * or whose Cache-Control contains no-store, no-cache, or private are not.
+ **/
+static long cgicache_ttl(CgiCacheFill *fill)
+{
+    char *saveptr;
+    char *line;
+    long ttl = CgiCacheTtl;
+    bool ok = false;
+
+    fill->head[fill->head_length < sizeof(fill->head) ? fill->head_length : sizeof(fill->head) - 1] = '\0';
+    for (line = strtok_r(fill->head, "\r\n", &saveptr); line && *line; line = strtok_r(NULL, "\r\n", &saveptr))
+    {
+        if (!strncmp(line, "HTTP/", 5))
+        {
+            ok = !strncmp(skip_whitespace(skip_nonwhitespace(line)), "200", 3);
+        }
+        else if (!strncasecmp(line, "Status:", 7))
+        {
+            ok = !strncmp(skip_whitespace(line + 7), "200", 3);
+        }
+        else if (!strncasecmp(line, "Set-Cookie:", 11))
+        {
+            return 0;
+        }
+        else if (!strncasecmp(line, "Cache-Control:", 14))
+        {
+            for (char *c = line + 14; *c; c++)
+                *c = tolower(*c);
+            if (strstr(line, "no-store") || strstr(line, "no-cache") || strstr(line, "private"))
+                return 0;
+
+            char *age = strstr(line, "s-maxage=");
+            if (age || (age = strstr(line, "max-age=")))
+                ttl = strtol(strchr(age, '=') + 1, NULL, 10);
+        }
+    }
+    return ok ? ttl : 0;
+}
+
+/**
+ * Store captured response (or pass entry) and release key lock.
+ *
+ * @param   fill        Fill state from cgicache_serve.
+ * @param   complete    Whether the whole response was captured.
+ *
+ * An incomplete capture stores nothing, so the next request for the key
+ * runs the script again.
+ **/
+void cgicache_finish(CgiCacheFill *fill, bool complete)
+{
+    if (fill->fd >= 0)
+    {
+        long ttl = complete && !fill->oversized ? cgicache_ttl(fill) : 0;
+        CgiCacheHeader header = {
+            .expires    = cgicache_now() + (ttl > 0 ? ttl : CgiCacheTtl) * 1000,
+            .length     = ttl > 0 ? fill->length : 0,
+            .key_length = fill->key_length,
+            .flags      = ttl > 0 ? 0 : CGI_CACHE_PASS,
+        };
+        memcpy(header.magic, CGI_CACHE_MAGIC, sizeof(header.magic));
+
+        if (complete && pwrite(fill->fd, &header, sizeof(header), 0) == sizeof(header) &&
+            ftruncate(fill->fd, sizeof(header) + fill->key_length + header.length) == 0 &&
+            renameat(CacheDirFd, fill->temporary, CacheDirFd, fill->name) == 0)
+        {
+            debug("CGI cache %s: %s (%ld s)", ttl > 0 ? "stored" : "pass", fill->name, ttl > 0 ? ttl : (long)CgiCacheTtl);
+        }
+        else
+        {
+            unlinkat(CacheDirFd, fill->temporary, 0);
+        }
+        close(fill->fd);
+        fill->fd = -1;
+    }
+
+    if (fill->lockfd >= 0)
+    {
+        close(fill->lockfd);            /* Releases flock */
+        fill->lockfd = -1;
+    }
+    free(fill->key);
+    fill->key = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,309 @@
+/* control.c: Reload, Upgrade, and Drain Signals */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static char **Arguments = NULL;         /* Command line to re-execute */
+static pid_t  UpgradePid = -1;          /* New server started by upgrade */
+static pid_t  ParentPid = -1;           /* Old server to drain once we are ready */
+static bool   Worker = false;           /* Whether this process is a worker (see workers_server) */
+
+typedef struct retired {
+    void   *data;                       /* Mapping (size nonzero) or allocation */
+    size_t  size;                       /* Size of mapping */
+    int     fd;                         /* File descriptor (or -1) */
+    uint64_t generation;                /* Generation it was replaced in */
+    size_t  holders;                    /* Connections that may still use it */
+    struct retired *next;
+} Retired;
+
+static uint64_t Generation = 1;         /* Current reload generation */
+static size_t   Connections = 0;        /* Connections held (see control_hold) */
+static Retired *RetiredList = NULL;     /* Resources replaced by reloads */
+
+static volatile sig_atomic_t ReloadPending  = 0;
+static volatile sig_atomic_t UpgradePending = 0;
+static volatile sig_atomic_t DrainPending   = 0;
+
+/**
+ * Record control signal for the server loop.
+ **/
+static void control_handler(int signum)
+{
+    switch (signum)
+    {
+    case SIGHUP:  ReloadPending  = 1; break;
+    case SIGUSR2: UpgradePending = 1; break;
+    case SIGQUIT: DrainPending   = 1; break;
+    }
+}
+
+/**
+ * Install control signal handlers.
+ *
+ * @param   argv        Command line of server (re-executed on upgrade).
+ *
+ * - SIGHUP reloads the configuration (see server_reload).
+ * - SIGUSR2 starts the (possibly replaced) binary with the same command line,
+ *   handing it the listening socket.
+ * - SIGQUIT stops accepting clients and exits once in-flight requests finish.
+ *
+ * Handlers only set flags, which the server loop checks between batches of
+ * clients (the accept wait is interrupted by the signal).  SA_RESTART keeps a
+ * signal from failing I/O of a request in progress.
+ *
+ * If this server was started by an upgrade, the old server's pid is taken
+ * from SPIDEY_PARENT for control_ready.
+ **/
+void control_init(char *argv[])
+{
+    struct sigaction action = {.sa_handler = control_handler, .sa_flags = SA_RESTART};
+    const char *parent = getenv("SPIDEY_PARENT");
+
+    Arguments = argv;
+    if (parent)
+    {
+        ParentPid = atoi(parent);
+        unsetenv("SPIDEY_PARENT");
+    }
+
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGQUIT, &action, NULL);
+}
+
+/**
+ * Mark this process as a worker.
+ *
+ * Workers reload and drain when their supervisor forwards SIGHUP and
+ * SIGQUIT, but leave upgrades to it: SIGUSR2 sent to a worker is passed on
+ * to the supervisor, which holds the listening sockets.
+ **/
+void control_worker(void)
+{
+    Worker = true;
+}
+
+/**
+ * Tell the old server that this one is accepting clients.
+ *
+ * The old server is asked to drain (SIGQUIT) only if it is still our parent,
+ * so a stale SPIDEY_PARENT cannot signal an unrelated process.  If this server
+ * fails before getting here, the old one keeps serving.
+ **/
+void control_ready(void)
+{
+    if (ParentPid > 0 && getppid() == ParentPid)
+    {
+        log("Upgrade complete: draining old server %d", ParentPid);
+        kill(ParentPid, SIGQUIT);
+    }
+    ParentPid = -1;
+}
+
+/**
+ * Start new server binary that inherits the listening socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ *
+ * The child moves the socket to SOCKET_INHERIT_FD (clearing close-on-exec),
+ * announces it with LISTEN_FDS and LISTEN_PID, and executes the original
+ * command line.  Both servers accept from the same socket until the new one
+ * calls control_ready, so no client in the backlog is dropped.
+ **/
+static void control_upgrade(int sfd)
+{
+    char pid[16];
+
+    if (UpgradePid > 0)
+    {
+        log("Upgrade already in progress (%d)", UpgradePid);
+        return;
+    }
+
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    UpgradePid = fork();
+    if (UpgradePid < 0)
+    {
+        log("Unable to fork upgrade: %s", strerror(errno));
+        return;
+    }
+
+    if (UpgradePid == 0)
+    {
+        if (sfd == SOCKET_INHERIT_FD)
+            fcntl(sfd, F_SETFD, 0);
+        else if (dup2(sfd, SOCKET_INHERIT_FD) < 0)
+            _exit(EXIT_FAILURE);
+
+        setenv("SPIDEY_PARENT", pid, 1);
+        setenv("LISTEN_FDS", "1", 1);
+        snprintf(pid, sizeof(pid), "%d", getpid());
+        setenv("LISTEN_PID", pid, 1);
+
+        signal(SIGCHLD, SIG_DFL);
+        execvp(Arguments[0], Arguments);
+        log("Unable to execute %s: %s", Arguments[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    log("Upgrading: started %s as %d", Arguments[0], UpgradePid);
+}
+
+/**
+ * Handle pending control signals.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  true to keep accepting clients, false to drain and exit.
+ **/
+bool control_poll(int sfd)
+{
+    if (ReloadPending)
+    {
+        ReloadPending = 0;
+        log("Reloading configuration");
+        server_reload();
+        Generation++;
+        workers_signal(SIGHUP);
+    }
+
+    if (UpgradePending)
+    {
+        UpgradePending = 0;
+        if (Worker)
+            kill(getppid(), SIGUSR2);
+        else
+            control_upgrade(sfd);
+    }
+
+    /* Notice an upgrade that failed (e.g. exec error) outside forking mode */
+    if (UpgradePid > 0 && waitpid(UpgradePid, NULL, WNOHANG) == UpgradePid)
+        control_reaped(UpgradePid);
+
+    if (DrainPending)
+    {
+        log("Draining: no longer accepting clients");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Account for reaped child process.
+ *
+ * @param   pid         Process id returned by waitpid.
+ * @return  true if pid was the server started by an upgrade (not a worker).
+ **/
+bool control_reaped(pid_t pid)
+{
+    if (pid <= 0 || pid != UpgradePid)
+        return false;
+
+    log("Upgrade failed: new server %d exited", pid);
+    UpgradePid = -1;
+    return true;
+}
+
+/**
+ * Count connection as using the current configuration.
+ *
+ * @param   r           Request structure (from accept_request).
+ **/
+void control_hold(Request *r)
+{
+    r->generation = Generation;
+    Connections++;
+}
+
+/**
+ * Free resource (see control_retire).
+ **/
+static void control_free(void *data, size_t size, int fd)
+{
+    if (size)
+        munmap(data, size);
+    else
+        free(data);
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * Stop counting connection, freeing resources it was the last user of.
+ *
+ * @param   r           Request structure (ignored unless held).
+ **/
+void control_release(Request *r)
+{
+    Retired **link = &RetiredList;
+
+    if (!r->generation)
+        return;
+
+    Connections--;
+    while (*link)
+    {
+        Retired *retired = *link;
+
+        /* Connections accepted after the reload never saw it */
+        if (retired->generation >= r->generation && --retired->holders == 0)
+        {
+            *link = retired->next;
+            control_free(retired->data, retired->size, retired->fd);
+            free(retired);
+            continue;
+        }
+        link = &retired->next;
+    }
+    r->generation = 0;
+}
+
+/**
+ * Free resource replaced by a reload once no connection can still use it.
+ *
+ * @param   data        Mapping (if size is nonzero) or allocation (or NULL).
+ * @param   size        Size of mapping (0 for an allocation).
+ * @param   fd          File descriptor to close (or -1).
+ *
+ * In event mode, a reload runs while coroutines are suspended in the middle
+ * of responses, which may still be reading the old archive or opening files
+ * beneath the old roots.  Each connection records the generation it was
+ * accepted in, and the resource is freed when the last connection accepted
+ * before this reload is released.  Elsewhere reloads happen between requests,
+ * so it is freed right away.
+ **/
+void control_retire(void *data, size_t size, int fd)
+{
+    Retired *retired;
+
+    if (Connections == 0)
+    {
+        control_free(data, size, fd);
+        return;
+    }
+
+    if (!(retired = calloc(1, sizeof(Retired))))
+    {
+        log("Unable to defer release of replaced resource (leaking it): %s", strerror(errno));
+        return;
+    }
+
+    retired->data = data;
+    retired->size = size;
+    retired->fd = fd;
+    retired->generation = Generation;
+    retired->holders = Connections;
+    retired->next = RetiredList;
+    RetiredList = retired;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,416 @@
+/* coroutine.c: Stackful Coroutines on an epoll Scheduler */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Switch stacks with a few instructions where we can: ucontext saves and
+ * restores the signal mask (a system call) on every switch.  With control
+ * flow protection (shadow stacks), glibc's ucontext is needed to keep the
+ * shadow stack in step. */
+#if defined(__x86_64__) && !defined(__CET__)
+#define COROUTINE_SWITCH_ASM
+#else
+#include <ucontext.h>
+#endif
+
+#define COROUTINE_POOL      256         /* Finished coroutines kept for reuse (with stacks) */
+#define COROUTINE_EVENTS    64          /* Events handled per epoll_wait */
+
+typedef struct {
+#ifdef COROUTINE_SWITCH_ASM
+    void       *sp;                     /*< Saved stack pointer */
+#else
+    ucontext_t  uc;                     /*< Saved registers and stack */
+#endif
+} Context;
+
+struct coroutine {
+    Context     context;                /*< Suspended execution state */
+    char       *mapping;                /*< Stack mapping (guard page first) */
+    size_t      size;                   /*< Size of mapping */
+    void      (*function)(void *);      /*< Function run by coroutine */
+    void       *argument;               /*< Argument of function */
+    Coroutine  *next;                   /*< Next in ready queue or free list */
+    Timer       timer;                  /*< Wait deadline */
+    int         fd;                     /*< Descriptor registered with epoll (-1 if none) */
+    int         result;                 /*< Wait result (1 ready, 0 timed out) */
+    bool        waiting;                /*< Suspended in coroutine_wait */
+    bool        done;                   /*< Function has returned */
+};
+
+static int        Epoll = -1;           /* Scheduler epoll instance */
+static int        Watched = -1;         /* Listening socket registered with epoll */
+static Context    Scheduler;            /* Context of scheduler (coroutine_schedule) */
+static Coroutine *Current = NULL;       /* Running coroutine */
+static Coroutine *ReadyHead = NULL;     /* Coroutines ready to run */
+static Coroutine *ReadyTail = NULL;
+static Coroutine *Free = NULL;          /* Finished coroutines with stacks */
+static size_t     FreeCount = 0;        /* Number of finished coroutines kept */
+static size_t     Live = 0;             /* Coroutines not yet finished */
+
+#ifdef COROUTINE_SWITCH_ASM
+/* Save callee-saved registers on the current stack, store the stack pointer
+ * in *from, then switch to the stack at to and restore its registers. */
+void context_swap(void **from, void *to) __attribute__((visibility("hidden")));
+__asm__(
+    ".text\n"
+    ".globl context_swap\n"
+    ".type context_swap, @function\n"
+    "context_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size context_swap, .-context_swap\n");
+#endif
+
+static void coroutine_entry(void);
+
+/**
+ * Prepare context to start coroutine_entry on stack.
+ **/
+static void context_make(Context *context, char *stack, size_t size)
+{
+#ifdef COROUTINE_SWITCH_ASM
+    /* Six zeroed registers, then coroutine_entry as the return address, so
+     * that it starts with the stack aligned as if it had been called */
+    void **sp = (void **)(stack + size) - 8;
+
+    memset(sp, 0, 8 * sizeof(void *));
+    sp[6] = (void *)coroutine_entry;
+    context->sp = sp;
+#else
+    getcontext(&context->uc);
+    context->uc.uc_stack.ss_sp = stack;
+    context->uc.uc_stack.ss_size = size;
+    context->uc.uc_link = NULL;
+    makecontext(&context->uc, coroutine_entry, 0);
+#endif
+}
+
+/**
+ * Save current context in from and resume to.
+ **/
+static void context_switch(Context *from, Context *to)
+{
+#ifdef COROUTINE_SWITCH_ASM
+    context_swap(&from->sp, to->sp);
+#else
+    swapcontext(&from->uc, &to->uc);
+#endif
+}
+
+/**
+ * Run coroutine function, then return to the scheduler for good.
+ **/
+static void coroutine_entry(void)
+{
+    Coroutine *co = Current;
+
+    co->function(co->argument);
+    co->done = true;
+    context_switch(&co->context, &Scheduler);
+    abort();                            /* Finished coroutines are never resumed */
+}
+
+/**
+ * Make suspended coroutine runnable.
+ **/
+static void coroutine_ready(Coroutine *co)
+{
+    co->next = NULL;
+    if (ReadyTail)
+        ReadyTail->next = co;
+    else
+        ReadyHead = co;
+    ReadyTail = co;
+}
+
+/**
+ * Wake waiting coroutine (once its fd is ready or its deadline passes).
+ **/
+static void coroutine_wake(Coroutine *co, int result)
+{
+    if (!co->waiting)
+        return;
+
+    co->waiting = false;
+    co->result = result;
+    timer_cancel(&Timers, &co->timer);
+    coroutine_ready(co);
+}
+
+/**
+ * Wake coroutine whose wait deadline passed.
+ **/
+static void coroutine_expired(Timer *timer)
+{
+    coroutine_wake(timer->data, 0);
+}
+
+/**
+ * Create epoll instance of scheduler.
+ *
+ * @return  true on success.
+ **/
+bool coroutine_init(void)
+{
+    if (Epoll < 0 && (Epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        log("Unable to create epoll instance: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Start coroutine.
+ *
+ * @param   function    Function to run (with its own stack).
+ * @param   argument    Argument of function.
+ * @return  true if the coroutine was created (it runs on the next
+ * coroutine_schedule).
+ *
+ * Stacks are CoroutineStack bytes with a guard page below them, so an
+ * overflow faults instead of corrupting a neighbor.  Finished coroutines are
+ * kept (up to COROUTINE_POOL) so their stacks, already faulted in, are
+ * reused.
+ **/
+bool coroutine_spawn(void (*function)(void *), void *argument)
+{
+    size_t page = getpagesize();
+    size_t size = ((size_t)CoroutineStack + page - 1) / page * page + page;
+    Coroutine *co = Free;
+
+    if (co && co->size == size)
+    {
+        Free = co->next;
+        FreeCount--;
+    }
+    else
+    {
+        co = calloc(1, sizeof(Coroutine));
+        if (!co)
+            return false;
+
+        co->size = size;
+        co->mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+        if (co->mapping == MAP_FAILED || mprotect(co->mapping, page, PROT_NONE) < 0)
+        {
+            log("Unable to allocate coroutine stack: %s", strerror(errno));
+            if (co->mapping != MAP_FAILED)
+                munmap(co->mapping, size);
+            free(co);
+            return false;
+        }
+        co->timer.callback = coroutine_expired;
+        co->timer.data = co;
+    }
+
+    co->function = function;
+    co->argument = argument;
+    co->fd = -1;
+    co->waiting = co->done = false;
+    context_make(&co->context, co->mapping + page, size - page);
+
+    Live++;
+    coroutine_ready(co);
+    return true;
+}
+
+/**
+ * Return running coroutine (NULL outside coroutines).
+ **/
+Coroutine *coroutine_self(void)
+{
+    return Current;
+}
+
+/**
+ * Return number of coroutines that have not finished.
+ **/
+size_t coroutine_count(void)
+{
+    return Live;
+}
+
+/**
+ * Suspend running coroutine until fd is ready or deadline passes.
+ *
+ * @param   fd          Descriptor to wait on (-1 to only sleep).
+ * @param   events      poll(2) events to wait for (POLLIN or POLLOUT).
+ * @param   deadline    Absolute time in milliseconds (0 for none).
+ * @return  1 when ready, 0 if the deadline passed, -1 on error.
+ *
+ * The descriptor stays registered (one-shot) after the wait, so waiting on
+ * it again costs one epoll_ctl.  A registration left behind by a closed
+ * descriptor is removed by the kernel.
+ **/
+int coroutine_wait(int fd, short events, uint64_t deadline)
+{
+    Coroutine *co = Current;
+
+    if (!co)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fd >= 0)
+    {
+        struct epoll_event event = {
+            .events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0) | EPOLLONESHOT,
+            .data.ptr = co,
+        };
+        int op = fd == co->fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+        if (epoll_ctl(Epoll, op, fd, &event) < 0 &&
+            (errno != (op == EPOLL_CTL_MOD ? ENOENT : EEXIST) ||
+             epoll_ctl(Epoll, op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) < 0))
+            return -1;
+        co->fd = fd;
+    }
+
+    if (deadline)
+        timer_add(&Timers, &co->timer, deadline);
+
+    co->waiting = true;
+    context_switch(&co->context, &Scheduler);
+
+    /* Disarm registration the deadline beat, so it cannot wake us later */
+    if (fd >= 0 && co->result == 0)
+    {
+        struct epoll_event event = {.events = 0, .data.ptr = co};
+        epoll_ctl(Epoll, EPOLL_CTL_MOD, fd, &event);
+    }
+    return co->result;
+}
+
+/**
+ * Let other coroutines run before the running one continues.
+ *
+ * The coroutine goes to the back of the ready queue, and resumes after the
+ * scheduler has polled for events once, so a long transfer cannot keep
+ * newly ready clients waiting.
+ **/
+void coroutine_yield(void)
+{
+    Coroutine *co = Current;
+
+    if (!co)
+        return;
+
+    coroutine_ready(co);
+    context_switch(&co->context, &Scheduler);
+}
+
+/**
+ * Resume coroutine until it waits or finishes.
+ **/
+static void coroutine_resume(Coroutine *co)
+{
+    Current = co;
+    context_switch(&Scheduler, &co->context);
+    Current = NULL;
+
+    if (co->done)
+    {
+        Live--;
+        if (FreeCount < COROUTINE_POOL)
+        {
+            co->next = Free;
+            Free = co;
+            FreeCount++;
+        }
+        else
+        {
+            munmap(co->mapping, co->size);
+            free(co);
+        }
+    }
+}
+
+/**
+ * Watch listening socket in the scheduler.
+ *
+ * @param   sfd         Listening socket (-1 to stop watching).
+ *
+ * The socket is unregistered before it stops being watched, which must
+ * happen before it is closed: forked processes may still hold it open.
+ **/
+void coroutine_watch(int sfd)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+
+    if (sfd == Watched)
+        return;
+
+    if (Watched >= 0)
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, Watched, NULL);
+    if (sfd >= 0 && epoll_ctl(Epoll, EPOLL_CTL_ADD, sfd, &event) < 0)
+        log("Unable to watch listening socket: %s", strerror(errno));
+    Watched = sfd;
+}
+
+/**
+ * Run ready coroutines, then wait for events.
+ *
+ * @return  true if the watched listening socket is readable.
+ *
+ * The wait ends on the first event, the next timer (the process timer wheel
+ * is driven from here), or a signal.  It does not block while coroutines
+ * are ready.
+ **/
+bool coroutine_schedule(void)
+{
+    struct epoll_event events[COROUTINE_EVENTS];
+    bool readable = false;
+
+    /* Run coroutines that were ready on entry (those readied meanwhile,
+     * including ones that yielded, run after the next poll) */
+    Coroutine *co = ReadyHead;
+    ReadyHead = ReadyTail = NULL;
+    while (co)
+    {
+        Coroutine *next = co->next;
+        coroutine_resume(co);
+        co = next;
+    }
+
+    /* Nothing left to wait for (draining) */
+    if (Live == 0 && Watched < 0)
+        return false;
+
+    int timeout = ReadyHead ? 0 : timer_timeout(&Timers, now_ms());
+    int n = epoll_wait(Epoll, events, COROUTINE_EVENTS, timeout);
+    timer_advance(&Timers, now_ms());
+
+    for (int i = 0; i < n; i++)
+    {
+        if (events[i].data.ptr)
+            coroutine_wake(events[i].data.ptr, 1);
+        else
+            readable = true;
+    }
+    return readable;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,74 @@
+/* event.c: Event-Driven HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+/**
+ * Handle request in its own coroutine.
+ **/
+static void event_handle(void *argument)
+{
+    Request *r = argument;
+
+    handle_request(r);
+    free_request(r);
+}
+
+/**
+ * Handle HTTP requests concurrently in coroutines on an epoll loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS or EXIT_FAILURE).
+ *
+ * Each client gets a coroutine running the ordinary request handlers.
+ * Wherever they would block on a socket (request_wait), a pipe, or an
+ * upstream, the coroutine yields to the loop instead, so one process serves
+ * many clients without forking.
+ *
+ * Clients are accepted while fewer than MaxConnections are in flight.  When
+ * told to drain, the server stops accepting and exits once every coroutine
+ * has finished.
+ **/
+int event_server(int sfd)
+{
+    Request *requests[ACCEPT_BATCH];
+
+    if (!coroutine_init())
+        return EXIT_FAILURE;
+
+    /* Accept and handle HTTP requests (until told to drain) */
+    while (control_poll(sfd))
+    {
+        long slots = MaxConnections > 0 ? MaxConnections - (long)coroutine_count() : ACCEPT_BATCH;
+
+        coroutine_watch(slots > 0 ? sfd : -1);
+        if (!coroutine_schedule())
+            continue;
+
+        size_t n = accept_pending(sfd, requests, slots < ACCEPT_BATCH ? slots : ACCEPT_BATCH);
+        if (n == 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            poll(NULL, 0, 10);              /* Out of resources: back off rather than spin */
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!coroutine_spawn(event_handle, requests[i]))
+            {
+                debug("Unable to start coroutine: %s", strerror(errno));
+                free_request(requests[i]);
+            }
+        }
+    }
+
+    /* Stop accepting and let coroutines finish */
+    coroutine_watch(-1);
+    close(sfd);
+    while (coroutine_count() > 0)
+        coroutine_schedule();
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
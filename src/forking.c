@@ -6,8 +6,18 @@
 #include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
+static bool Child = false;              /* Whether this process was forked to handle one request */
+
+/**
+ * Interrupt the accept wait when a child exits so it can be reaped.
+ **/
+static void sigchld_handler(int signum)
+{
+}
+
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
@@ -16,48 +26,102 @@
  *
  * The parent should accept a request and then fork off and let the child
  * handle the request.
+ *
+ * The parent tracks live children and stops accepting once MaxConnections
+ * are in flight, leaving further clients in the kernel backlog until a child
+ * exits.
+ *
+ * Control signals are handled by the parent between batches; when told to
+ * drain, it closes the server socket and waits for its children to finish
+ * their requests before exiting.
  **/
 int forking_server(int sfd)
 {
-    /* Accept and handle HTTP request */
-    Request *r;
+    Request *requests[ACCEPT_BATCH];
+    size_t children = 0;
     pid_t pid;
 
-    while (true)
-    {
-        /* Accept request */
-        r = accept_request(sfd);
-        signal(SIGINT, SIG_IGN);
-        if (!r)
-            continue;
+    /* Reap children (no SA_RESTART, so SIGCHLD wakes the accept wait) */
+    struct sigaction action = {.sa_handler = sigchld_handler};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
 
-        /* Ignore children */
-        pid = fork();
+    /* Accept and handle HTTP request */
+    while (control_poll(sfd))
+    {
+        /* Reap exited children (an upgraded server is not a worker) */
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+            if (!control_reaped(pid))
+                children--;
 
-        if (pid < 0)
+        /* Apply backpressure: wait for a child before accepting more */
+        if (MaxConnections > 0 && children >= (size_t)MaxConnections)
         {
-            debug("Fork Failed: %s", strerror(errno));
-            free_request(r);
-            exit(EXIT_FAILURE);
-        }
-        /* Fork off child process to handle request */
-        else if (pid == 0)
-        {
-            close(sfd);
-            handle_request(r);
-            free_request(r);
-            exit(EXIT_SUCCESS);
+            if ((pid = waitpid(-1, NULL, 0)) > 0 && !control_reaped(pid))
+                children--;
+            continue;
         }
 
-        else
+        /* Accept requests */
+        size_t slots = MaxConnections > 0 ? MaxConnections - children : ACCEPT_BATCH;
+        size_t n = accept_requests(sfd, requests, slots < ACCEPT_BATCH ? slots : ACCEPT_BATCH);
+        signal(SIGINT, SIG_IGN);
+
+        for (size_t i = 0; i < n; i++)
         {
-            free_request(r);
+            /* Fork off child process to handle request */
+            pid = fork();
+
+            if (pid < 0)
+            {
+                debug("Fork Failed: %s", strerror(errno));
+                for (; i < n; i++)
+                    free_request(requests[i]);
+                exit(EXIT_FAILURE);
+            }
+            else if (pid == 0)
+            {
+                Child = true;
+                signal(SIGCHLD, SIG_DFL);
+                workers_pin_client(requests[i]->fd);
+                close(sfd);
+                for (size_t j = i + 1; j < n; j++)
+                {
+                    ratelimit_disown(requests[j]);  /* Owned by later children */
+                    free_request(requests[j]);
+                }
+                handle_request(requests[i]);
+                free_request(requests[i]);
+                exit(EXIT_SUCCESS);
+            }
+            else
+            {
+                children++;
+                ratelimit_disown(requests[i]);      /* Child releases connection */
+                free_request(requests[i]);
+            }
         }
     }
 
-    /* Close server socket */
+    /* Close server socket and let children finish */
     close(sfd);
+    while (children > 0)
+    {
+        if ((pid = waitpid(-1, NULL, 0)) > 0 && !control_reaped(pid))
+            children--;
+        else if (pid < 0 && errno != EINTR)
+            break;
+    }
     return EXIT_SUCCESS;
 }
 
+/**
+ * Return whether this process was forked to handle a single request (and
+ * so may block without holding up other clients).
+ **/
+bool forking_child(void)
+{
+    return Child;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,19 +2,37 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Internal Declarations */
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
-Status handle_error(Request *request, Status status);
+Status handle_missing(Request *request);
+
+/* Request headers exported to CGI scripts (see cgicache_serve) */
+const char *CgiHeaders[][2] = {
+    {"Host",            "HTTP_HOST"},
+    {"Accept",          "HTTP_ACCEPT"},
+    {"Accept-Language", "HTTP_ACCEPT_LANGUAGE"},
+    {"Accept-Encoding", "HTTP_ACCEPT_ENCODING"},
+    {"Connection",      "HTTP_CONNECTION"},
+    {"User-Agent",      "HTTP_USER_AGENT"},
+    {NULL,              NULL},
+};
 
 /**
  * Handle HTTP Request.
@@ -22,26 +40,119 @@ Status handle_error(Request *request, Status status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This completes the TLS handshake (if the listener terminates TLS), parses a
+ * request and then dispatches it, unless the client asked for HTTP/2
+ * (prior-knowledge preface, h2c upgrade, or "h2" negotiated with ALPN, which
+ * starts with the preface), in which case the whole connection is handed to
+ * the HTTP/2 layer.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
 Status  handle_request(Request *r) {
-    Status result;
-
     log("Handling request");
 
+    /* Complete TLS handshake: on failure there is no channel to report on */
+    if(tls_enabled() && tls_accept(r) < 0){
+      log("TLS handshake failed");
+      return HTTP_STATUS_BAD_REQUEST;
+    }
+
     /* Parse request */
-    if(parse_request(r) == -1){ // -1 from function means failure
+    uint64_t start = profile_clock();
+    int parsed = parse_request(r);
+    profile_phase(PHASE_PARSE, start);
+    if(parsed == -1){ // -1 from function means failure
+      if(r->timed_out && r->deadline == DEADLINE_IDLE){ // never sent anything: just close
+        log("Idle connection timed out");
+        return HTTP_STATUS_REQUEST_TIMEOUT;
+      }
+      if(r->timed_out){
+        log("Request head timed out");
+        return handle_error(r, HTTP_STATUS_REQUEST_TIMEOUT);
+      }
       log("parse_request failed");
       return handle_error(r, HTTP_STATUS_BAD_REQUEST);
     }
 
+    /* Switch protocols to HTTP/2 */
+    if(streq(r->method, "PRI") && streq(r->uri, "*")){
+      return http2_serve(r, false);
+    }
+    if(http2_upgrade_requested(r)){
+      return http2_serve(r, true);
+    }
+
+    return dispatch_request(r);
+}
+
+/**
+ * Dispatch parsed HTTP Request.
+ *
+ * @param   r           HTTP Request structure (parsed)
+ * @return  Status of the HTTP request.
+ *
+ * This determines the virtual host and request path, determines the request
+ * type, and then dispatches to the appropriate handler type (as permitted by
+ * the host's settings).  URIs under a proxy route (-P) are forwarded upstream
+ * instead, and files in the packed archive (-A) are served from it.  Responses are written through r->sink, so
+ * this serves HTTP/1 connections and HTTP/2 streams alike.
+ **/
+Status  dispatch_request(Request *r) {
+    Status result;
+    uint64_t start;
+
+    /* Charge request to client's rate limit */
+    if((result = ratelimit_request(r)) != HTTP_STATUS_OK){
+      log("Client %s is over its request rate", request_host(r));
+      return handle_error(r, result);
+    }
+
+    /* Serve profiler endpoint */
+    if(Profile && !strncmp(r->uri, PROFILE_PREFIX, sizeof(PROFILE_PREFIX) - 1)){
+      log("Handling profile request (out)");
+      return handle_profile_request(r);
+    }
+
+    /* Forward requests matching a proxy route */
+    ProxyRoute *route = proxy_route(r->uri);
+    if(route){
+      log("Handling proxy request (out)");
+      start = profile_clock();
+      result = handle_proxy_request(r, route);
+      profile_phase(PHASE_PROXY, start);
+      log("HTTP REQUEST STATUS: %s", http_status_string(result));
+      return result;
+    }
+
+    /* Determine virtual host, then serve files packed into the archive (-A)
+     * without touching the file system */
+    r->vhost = vhost_lookup(request_header(r, "Host"));
+    const ArchiveEntry *entry;
+    if(r->vhost->archive && (entry = archive_lookup(r->uri))){
+      log("Handling archive request (out)");
+      start = profile_clock();
+      result = handle_archive_request(r, entry);
+      profile_phase(PHASE_ARCHIVE, start);
+      log("HTTP REQUEST STATUS: %s", http_status_string(result));
+      return result;
+    }
+
+    /* Answer URIs recently found missing without touching the file system */
+    NegativeKey key;
+    if(negcache_lookup(r->vhost, r->uri, &key)){
+      return handle_missing(r);
+    }
+
     /* Determine request path */
-    r->path = determine_request_path(r->uri);
+    start = profile_clock();
+    r->path = determine_request_path(r->vhost, r->uri, &r->file_fd);
+    profile_phase(PHASE_PATH, start);
     if(!r->path){
       log("URI path missing");
+      if(errno == ENOENT || errno == ENOTDIR){
+        negcache_insert(&key);
+        return handle_missing(r);
+      }
       return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
     debug("HTTP REQUEST PATH: %s", r->path);
@@ -49,19 +160,29 @@ Status  handle_request(Request *r) {
     /* Dispatch to appropriate request handler type based on file type */
     struct stat s;
 
-    if (stat(r->path, &s) < 0){ // file don't exist
-        log("stat call failed. File nonexistent?");
+    if (fstat(r->file_fd, &s) < 0){ // file don't exist
+        log("fstat call failed. File nonexistent?");
+        result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }else if (S_ISDIR(s.st_mode) && !r->vhost->browse){ // listing disabled for host
+        log("Directory browsing disabled");
         result = handle_error(r, HTTP_STATUS_NOT_FOUND);
     }else if (S_ISDIR(s.st_mode)){  // directory
         log("Handling browse request (out)");
+        start = profile_clock();
         result = handle_browse_request(r);
+        profile_phase(PHASE_BROWSE, start);
     }else if(S_ISREG(s.st_mode)){ // regular file
-        if(access(r->path, X_OK) == 0){ // if can execute regular file
+        // only consult access() when some execute bit is set at all
+        if(r->vhost->cgi && (s.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) && access(r->path, X_OK) == 0){ // if can execute regular file
             log("Handling CGI request (out)");
+            start = profile_clock();
             result = handle_cgi_request(r);
-        }else if(access(r->path, R_OK) == 0){ // if can read (and can't execute) regular file
+            profile_phase(PHASE_CGI, start);
+        }else{ // file request reports unreadable files itself
             log("Handling file request (out)");
+            start = profile_clock();
             result = handle_file_request(r);
+            profile_phase(PHASE_FILE, start);
         }
     }else{
         log("file has insufficient permissions for any handling");
@@ -72,58 +193,292 @@ Status  handle_request(Request *r) {
     return result;
 }
 
+/* Directory Listings */
+
+#define BROWSE_BUFFER   32768           /* Size of getdents64 and output buffers */
+
+typedef struct {
+    Request *r;                         /*< Request being answered */
+    bool     json;                      /*< Emit JSON instead of HTML */
+    long     offset;                    /*< Entries to skip */
+    long     limit;                     /*< Entries to list (0 for all) */
+    long     index;                     /*< Entries seen so far */
+    long     listed;                    /*< Entries listed so far */
+    bool     done;                      /*< Limit reached */
+    bool     more;                      /*< Entries remain after limit */
+    bool     failed;                    /*< Write to client failed */
+    size_t   used;                      /*< Bytes in output buffer */
+    char     output[BROWSE_BUFFER];     /*< Pending output */
+} Browse;
+
+typedef struct {
+    char         *name;                 /*< Entry name */
+    unsigned char type;                 /*< Entry type (DT_*) */
+} BrowseEntry;
+
+/**
+ * Find query parameter.
+ *
+ * @return  Start of value (terminated by '&' or NUL), or NULL if absent.
+ **/
+static const char *browse_param(const char *query, const char *name) {
+    size_t length = strlen(name);
+
+    for(const char *p = query; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL){
+      if(!strncmp(p, name, length) && p[length] == '=')
+        return p + length + 1;
+    }
+    return NULL;
+}
+
+/**
+ * Flush pending listing output to client.
+ **/
+static void browse_flush(Browse *b) {
+    if(b->used > 0 && !b->failed && response_write(b->r, b->output, b->used) < 0)
+      b->failed = true;
+    b->used = 0;
+}
+
+/**
+ * Append to listing output, flushing whenever the buffer fills.
+ **/
+static void browse_write(Browse *b, const char *data, size_t length) {
+    while(length > 0 && !b->failed){
+      size_t n = sizeof(b->output) - b->used < length ? sizeof(b->output) - b->used : length;
+      memcpy(b->output + b->used, data, n);
+      b->used += n;
+      data += n;
+      length -= n;
+      if(b->used == sizeof(b->output))
+        browse_flush(b);
+    }
+}
+
+/**
+ * Append string to listing output, escaped for HTML ('h'), a URI path ('u'),
+ * or a JSON string ('j').
+ **/
+static void browse_escaped(Browse *b, const char *s, size_t length, char context) {
+    static const char Hex[] = "0123456789ABCDEF";
+    char buffer[8];
+
+    for(size_t i = 0; i < length; i++){
+      unsigned char c = s[i];
+      const char *escape = NULL;
+      size_t n = 0;
+
+      if(context == 'h'){
+        escape = c == '&' ? "&amp;" : c == '<' ? "&lt;" : c == '>' ? "&gt;" : c == '"' ? "&quot;" : c == '\'' ? "&#39;" : NULL;
+      }else if(context == 'u' && !isalnum(c) && !strchr("-._~/", c)){
+        buffer[n++] = '%'; buffer[n++] = Hex[c >> 4]; buffer[n++] = Hex[c & 15];
+      }else if(context == 'j' && (c == '"' || c == '\\')){
+        buffer[n++] = '\\'; buffer[n++] = c;
+      }else if(context == 'j' && c < 0x20){
+        n = snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      }
+
+      if(escape)
+        browse_write(b, escape, strlen(escape));
+      else if(n)
+        browse_write(b, buffer, n);
+      else
+        browse_write(b, (const char *)&c, 1);
+    }
+}
+
+#define browse_literal(b, s)    browse_write((b), (s), sizeof(s) - 1)
+
+/**
+ * List one directory entry, subject to pagination.
+ *
+ * @param   b           Listing state.
+ * @param   dirfd       Directory descriptor (to stat entries of unknown type).
+ * @param   name        Entry name.
+ * @param   type        Entry type (DT_*).
+ **/
+static void browse_entry(Browse *b, int dirfd, const char *name, unsigned char type) {
+    static const char *Types[] = {[DT_REG] = "file", [DT_DIR] = "directory", [DT_LNK] = "link"};
+
+    if(b->index++ < b->offset)
+      return;
+    if(b->limit > 0 && b->listed == b->limit){
+      b->more = b->done = true;
+      return;
+    }
+
+    if(b->json){
+      struct stat s;
+      if(type == DT_UNKNOWN && fstatat(dirfd, name, &s, AT_SYMLINK_NOFOLLOW) == 0)
+        type = S_ISREG(s.st_mode) ? DT_REG : S_ISDIR(s.st_mode) ? DT_DIR : S_ISLNK(s.st_mode) ? DT_LNK : DT_UNKNOWN;
+
+      if(b->listed > 0)
+        browse_literal(b, ",");
+      browse_literal(b, "\n{\"name\":\"");
+      browse_escaped(b, name, strlen(name), 'j');
+      browse_literal(b, "\",\"type\":\"");
+      const char *t = type < sizeof(Types) / sizeof(Types[0]) && Types[type] ? Types[type] : "other";
+      browse_write(b, t, strlen(t));
+      browse_literal(b, "\"}");
+    }else{
+      size_t prefix = strlen(b->r->uri);
+      while(prefix > 0 && b->r->uri[prefix - 1] == '/')
+        prefix--;
+
+      // HTML: <a href = "address that clicking takes you"> clickable text </a>
+      browse_literal(b, "<li><a href=\"");
+      browse_escaped(b, b->r->uri, prefix, 'h');
+      browse_literal(b, "/");
+      browse_escaped(b, name, strlen(name), 'u');
+      browse_literal(b, "\">");
+      browse_escaped(b, name, strlen(name), 'h');
+      browse_literal(b, "</a></li>\n");
+    }
+    b->listed++;
+}
+
+/**
+ * Collect directory entry to be sorted.
+ *
+ * @return  false if out of memory.
+ **/
+static bool browse_collect(BrowseEntry **entries, size_t *n, const struct dirent64 *d) {
+    if(*n % 256 == 0){
+      BrowseEntry *grown = realloc(*entries, (*n + 256) * sizeof(BrowseEntry));
+      if(!grown)
+        return false;
+      *entries = grown;
+    }
+    if(!((*entries)[*n].name = strdup(d->d_name)))
+      return false;
+    (*entries)[(*n)++].type = d->d_type;
+    return true;
+}
+
+/**
+ * Compare listing entries by name (as alphasort does).
+ **/
+static int browse_compare(const void *a, const void *b) {
+    return strcoll(((const BrowseEntry *)a)->name, ((const BrowseEntry *)b)->name);
+}
+
 /**
  * Handle browse request.
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP browse request.
  *
- * This lists the contents of a directory in HTML.
+ * This lists the contents of a directory in HTML, or in JSON with
+ * ?format=json.  ?offset=N skips the first N entries and ?limit=N lists at
+ * most N (with a link to, or the offset of, the next page).
+ *
+ * Entries are read with getdents64(2) into a reused buffer and written as
+ * they are read, in a body that ends when the connection (or HTTP/2 stream)
+ * does, so memory use does not grow with the directory.  Directories with up
+ * to BrowseSort entries are first collected and listed in sorted order;
+ * larger ones are listed in directory order, which is stable (and so can be
+ * paginated) as long as the directory does not change.
  *
- * If the path cannot be opened or scanned as a directory, then handle error
+ * If the path cannot be opened or read as a directory, then handle error
  * with HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_browse_request(Request *r) {
-    struct dirent **entries;
-    int n;
+    static const char HtmlHead[] = "<!doctype html><html><head><meta charset=\"utf-8\"><meta name=\"viewport\" content=\"width=device-width, initial-scale=1, shrink-to-fit=no\"><link rel=\"stylesheet\" href=\"https://stackpath.bootstrapcdn.com/bootstrap/4.4.1/css/bootstrap.min.css\" integrity=\"sha384-Vkoo8x4CGsO3+Hhxv8T/Q5PaXtkKtu6ug5TOeNV6gBiFeWPGFN9MuhOf23Q9Ifjh\" crossorigin=\"anonymous\"><style>body { background-color: rgb(128, 96, 0); } a:link { color: rgb(1, 0, 91); } ul { list-style: none; } ul li::before { content: \"•\"; color: rgb(1, 0, 91); font-weight: bold; display: inline-block; width: 1em; margin-left: -1em; } a:visited { color: rgb(1, 0, 91); } </style></head><ul>\n<ul>\n";
+    const char *format = browse_param(r->query, "format");
+    const char *value;
+    char dents[BROWSE_BUFFER];
+    char number[64];
+    BrowseEntry *sorted = NULL;
+    size_t nsorted = 0;
+    bool sorting = BrowseSort > 0;
+    Response response;
+    Browse *b;
+    ssize_t n;
+    int fd;
 
     log("Handling browsing request (in)");
 
-    /* Open a directory for reading or scanning */
-    n = scandir(r->path, &entries, 0, alphasort);
-    if(n < 0){
-      debug("scandir failed: %s", strerror(errno));
+    /* Open directory for reading (the request may hold an O_PATH descriptor) */
+    fd = openat(r->file_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0 || !(b = calloc(1, sizeof(Browse)))){
+      debug("Unable to open directory: %s", strerror(errno));
+      if(fd >= 0)
+        close(fd);
       return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
+    b->r = r;
+    b->json = format && !strncmp(format, "json", 4) && (format[4] == '&' || !format[4]);
+    b->offset = (value = browse_param(r->query, "offset")) ? strtol(value, NULL, 10) : 0;
+    b->limit = (value = browse_param(r->query, "limit")) ? strtol(value, NULL, 10) : 0;
+
+    /* Write headers (the body is not buffered, so it has no Content-Length) */
+    response_init(&response, HTTP_STATUS_OK);
+    response_content_type(&response, b->json ? "application/json" : "text/html");
+    response_body(&response, NULL, 0);
+    if(response_send(r, &response, true) < 0){
+      b->failed = true;
+    }
+
+    if(b->json){
+      browse_literal(b, "{\"path\":\"");
+      browse_escaped(b, r->uri, strlen(r->uri), 'j');
+      browse_write(b, number, snprintf(number, sizeof(number), "\",\"offset\":%ld,\"entries\":[", b->offset));
+    }else{
+      browse_literal(b, HtmlHead);
+    }
+
+    /* List entries as they are read, once there are too many to sort */
+    while(!b->done && !b->failed && (n = getdents64(fd, dents, sizeof(dents))) > 0){
+      for(ssize_t i = 0; i < n && !b->done; ){
+        struct dirent64 *d = (struct dirent64 *)(dents + i);
+        i += d->d_reclen;
 
-    fprintf(r->stream, "<!doctype html><html><head><meta charset=\"utf-8\"><meta name=\"viewport\" content=\"width=device-width, initial-scale=1, shrink-to-fit=no\"><link rel=\"stylesheet\" href=\"https://stackpath.bootstrapcdn.com/bootstrap/4.4.1/css/bootstrap.min.css\" integrity=\"sha384-Vkoo8x4CGsO3+Hhxv8T/Q5PaXtkKtu6ug5TOeNV6gBiFeWPGFN9MuhOf23Q9Ifjh\" crossorigin=\"anonymous\"><style>body { background-color: rgb(128, 96, 0); } a:link { color: rgb(1, 0, 91); } ul { list-style: none; } ul li::before { content: \"•\"; color: rgb(1, 0, 91); font-weight: bold; display: inline-block; width: 1em; margin-left: -1em; } a:visited { color: rgb(1, 0, 91); } </style></head><ul>\n");
+        if(streq(d->d_name, ".") || (b->json && streq(d->d_name, "..")))
+          continue;
 
-    /* For each entry in directory, emit HTML list item */
-    fprintf(r->stream, "<ul>\n"); // start unordered list
+        if(sorting && nsorted < (size_t)BrowseSort && browse_collect(&sorted, &nsorted, d))
+          continue;
 
-    for(int i = 0; i < n; i++){ // each entry put into list
-      if(!streq(entries[i]->d_name, ".")){
-        fprintf(r->stream, "<li>");
-        // HTML: <a href = "address that clicking takes you"> clickable text </a>
-        fprintf(r->stream, "<a href=\"%s/%s\">%s</a>", streq(r->uri, "/") ? "" : r->uri,
-                                                     entries[i]->d_name,
-                                                     entries[i]->d_name);
-        fprintf(r->stream, "</li>\n");
+        /* Too many entries (or no memory) to sort: list the collected ones as is */
+        if(sorting){
+          debug("Directory has more than %d entries: listing unsorted", BrowseSort);
+          for(size_t j = 0; j < nsorted; j++)
+            browse_entry(b, fd, sorted[j].name, sorted[j].type);
+          sorting = false;
+        }
+        browse_entry(b, fd, d->d_name, d->d_type);
       }
-      free(entries[i]);
-    }
-    free(entries);
-    fprintf(r->stream, "</ul>\n"); // end unordered list
-    
-    for(int i = 0 ; i< 50; i++)
-    fprintf(r->stream, "<br>");
-    /* Return OK */
-    return HTTP_STATUS_OK;
+    }
+
+    if(sorting){
+      qsort(sorted, nsorted, sizeof(BrowseEntry), browse_compare);
+      for(size_t j = 0; j < nsorted && !b->done; j++)
+        browse_entry(b, fd, sorted[j].name, sorted[j].type);
+    }
+    for(size_t j = 0; j < nsorted; j++)
+      free(sorted[j].name);
+    free(sorted);
+    close(fd);
+
+    /* Close listing with the offset of the next page, if any */
+    if(b->json){
+      if(b->more)
+        browse_write(b, number, snprintf(number, sizeof(number), "\n],\"next\":%ld}\n", b->offset + b->listed));
+      else
+        browse_literal(b, "\n],\"next\":null}\n");
+    }else{
+      browse_literal(b, "</ul>\n");
+      if(b->more)
+        browse_write(b, number, snprintf(number, sizeof(number), "<a href=\"?offset=%ld&amp;limit=%ld\">Next</a>\n", b->offset + b->listed, b->limit));
+      for(int i = 0; i < 50; i++)
+        browse_literal(b, "<br>");
+    }
+    browse_flush(b);
+
+    Status status = b->failed ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
+    free(b);
+    return status;
 }
 
 /**
@@ -138,48 +493,91 @@ Status  handle_browse_request(Request *r) {
  * HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_file_request(Request *r) {
-    FILE *fs;
+    Response response;
+    struct stat s;
     char buffer[BUFSIZ];
     char *mimetype = NULL;
-    size_t nread;
+    ssize_t nread;
 
     log("Handling file request (in)");
 
-    /* Open file for reading */
-    fs = fopen(r->path, "r");
-    if(!fs){
-      debug("fopen failed: %s", strerror(errno));
+    /* Check file is open for reading (an O_PATH descriptor means unreadable) */
+    if((fcntl(r->file_fd, F_GETFL) & O_PATH) || fstat(r->file_fd, &s) < 0){
+      debug("%s is not readable", r->path);
       return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
-
     /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
+    uint64_t start = profile_clock();
+    mimetype = determine_mimetype(r->path, r->vhost->mimetype);
+    profile_phase(PHASE_MIMETYPE, start);
+
+    /* Read first chunk so small files go out in the same write as headers */
+    nread = read(r->file_fd, buffer, BUFSIZ);
+    if(nread < 0){
+      debug("read failed: %s", strerror(errno));
+      free(mimetype);
+      return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->stream, "\r\n");
+    /* Write HTTP Headers with OK status, determined Content-Type and length
+     * (corked so headers and body fill whole segments) */
+    socket_cork(r->fd, true);
+    response_init(&response, HTTP_STATUS_OK);
+    response_content_type(&response, mimetype);
+    response_content_length(&response, s.st_size);
+    response_body(&response, buffer, nread);
+    if(response_send(r, &response, nread < s.st_size) < 0){
+      goto fail;
+    }
 
-    /* Read from file and write to socket in chunks */
-    while((nread = fread(buffer, 1, BUFSIZ, fs)) > 0){
-      if (fwrite(buffer, 1, nread, r->stream) < 0){
+    /* Send remainder of file (zero-copy when writing to the socket), keeping
+     * large files from flooding the page cache */
+    if(nread < s.st_size && LargeFileSize > 0 && s.st_size >= LargeFileSize){
+      if(stream_file(r, r->file_fd, nread, s.st_size - nread) < 0){
         goto fail;
       }
+    }else if(nread < s.st_size && response_sendfile(r, r->file_fd, nread, s.st_size - nread) < 0){
+      goto fail;
     }
 
-    /* Close file, deallocate mimetype, return OK */
-    fclose(fs);
+    /* Uncork, deallocate mimetype, return OK */
+    socket_cork(r->fd, false);
     free(mimetype);
     return HTTP_STATUS_OK;
 
 fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    fclose(fs);
+    /* Uncork, free mimetype, return INTERNAL_SERVER_ERROR */
+    socket_cork(r->fd, false);
     free(mimetype);
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
 
+/**
+ * Read output of CGI script.
+ *
+ * @param   fd          Pipe from script.
+ * @param   buffer      Buffer to store data.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read, 0 on end-of-file, -1 on error.
+ *
+ * In a coroutine (event mode), the pipe is non-blocking and the coroutine
+ * yields to other clients until the script writes more.
+ **/
+static ssize_t cgi_read(int fd, void *buffer, size_t size) {
+    ssize_t n;
+
+    while((n = read(fd, buffer, size)) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      if(errno != EAGAIN || coroutine_wait(fd, POLLIN, 0) < 0){
+        return -1;
+      }
+    }
+    return n;
+}
+
 /**
  * Handle CGI request
  *
@@ -191,52 +589,79 @@ fail:
  *
  * If the path cannot be popened, then handle error with
  * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ *
+ * With the CGI cache enabled (cgi_cache), GET responses are served from the
+ * cache when possible, and otherwise captured into it as they are streamed.
  **/
 Status  handle_cgi_request(Request *r) {
+    CgiCacheFill fill;
+    Status status;
     FILE *pfs;
     char buffer[BUFSIZ];
+    bool complete = true;
 
     log("Handling CGI request (in)");
 
+    if(cgicache_serve(r, &fill, &status)){
+      return status;
+    }
+
     /* Export CGI environment variables from request:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
     if(setenv("QUERY_STRING", r->query, 1) == -1) debug("Can't set QUERY_STRING: %s", strerror(errno));
-    if(setenv("REMOTE_ADDR", r->host, 1) == -1) debug("Can't set REMOTE_ADDR: %s", strerror(errno));
-    if(setenv("REMOTE_PORT", r->port, 1) == -1) debug("Can't set REMOTE_PORT: %s", strerror(errno));
+    if(setenv("REMOTE_ADDR", request_host(r), 1) == -1) debug("Can't set REMOTE_ADDR: %s", strerror(errno));
+    if(setenv("REMOTE_PORT", request_port(r), 1) == -1) debug("Can't set REMOTE_PORT: %s", strerror(errno));
     if(setenv("REQUEST_METHOD", r->method, 1) == -1) debug("Can't set REQUEST_METHOD: %s", strerror(errno));
     if(setenv("REQUEST_URI", r->uri, 1) == -1) debug("Can't set REQUEST_URI: %s", strerror(errno));
     if(setenv("SCRIPT_FILENAME", r->path, 1) == -1) debug("Can't set SCRIPT_FILENAME: %s", strerror(errno));
 
-    if(setenv("DOCUMENT_ROOT", RootPath, 1) == -1) debug("Can't set DOCUMENT_ROOT: %s", strerror(errno));
+    if(setenv("DOCUMENT_ROOT", r->vhost->root, 1) == -1) debug("Can't set DOCUMENT_ROOT: %s", strerror(errno));
     if(setenv("SERVER_PORT", Port, 1) == -1) debug("Can't set SERVER_PORT: %s", strerror(errno));
+    if(r->tls){
+      if(setenv("HTTPS", "on", 1) == -1) debug("Can't set HTTPS: %s", strerror(errno));
+    }else{
+      unsetenv("HTTPS");
+    }
 
-    /* Export CGI environment variables from request headers */
-    Header * h = r->headers;
-
-    while(h->name){
-      if(streq(h->name, "Host")) setenv("HTTP_HOST", h->data, 1);
-      if(streq(h->name, "Accept")) setenv("HTTP_ACCEPT", h->data, 1);
-      if(streq(h->name, "Accept-Language")) setenv("HTTP_ACCEPT_LANGUAGE", h->data, 1);
-      if(streq(h->name, "Accept-Encoding")) setenv("HTTP_ACCEPT_ENCODING", h->data, 1);
-      if(streq(h->name, "Connection")) setenv("HTTP_CONNECTION", h->data, 1);
-      if(streq(h->name, "User-Agent")) setenv("HTTP_USER_AGENT", h->data, 1);
-      h = h->next; // advance to the next header
+    /* Export CGI environment variables from request headers (clearing those
+     * of absent headers, which would otherwise linger from earlier requests) */
+    for(size_t i = 0; CgiHeaders[i][0]; i++){
+      const char *value = request_header(r, CgiHeaders[i][0]);
+      if(value){
+        if(setenv(CgiHeaders[i][1], value, 1) == -1) debug("Can't set %s: %s", CgiHeaders[i][1], strerror(errno));
+      }else{
+        unsetenv(CgiHeaders[i][1]);
+      }
     }
 
     /* POpen CGI Script */
     pfs = popen(r->path, "r");
     if(!pfs){
-      pclose(pfs);
+      cgicache_finish(&fill, false);
       return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    /* Copy data from popen to socket */
-    while(fgets(buffer, BUFSIZ, pfs)){
-      fputs(buffer, r->stream);
+    if(coroutine_self()){
+      fcntl(fileno(pfs), F_SETFL, fcntl(fileno(pfs), F_GETFL) | O_NONBLOCK);
     }
 
-    /* Close popen, return OK */
-    pclose(pfs);
+    /* Copy data from popen to socket (script writes its own headers) */
+    ssize_t nread;
+    socket_cork(r->fd, true);
+    while((nread = cgi_read(fileno(pfs), buffer, BUFSIZ)) > 0){
+      cgicache_capture(&fill, buffer, nread);
+      if(response_write(r, buffer, nread) < 0){
+        complete = false;
+        break;
+      }
+    }
+
+    /* Uncork, close popen, store response in cache, return OK */
+    socket_cork(r->fd, false);
+    if(pclose(pfs) != 0 || nread < 0){
+      complete = false;
+    }
+    cgicache_finish(&fill, complete);
     return HTTP_STATUS_OK;
 }
 
@@ -250,22 +675,297 @@ Status  handle_cgi_request(Request *r) {
  * notify the user of the error.
  **/
 Status  handle_error(Request *r, Status status) {
-    const char *status_string = http_status_string(status);
+    static const char ErrorBody[] =
+        "<html><body>\n"
+        "<link href=\"//maxcdn.bootstrapcdn.com/bootstrap/4.1.1/css/bootstrap.min.css\" rel=\"stylesheet\" id=\"bootstrap-css\"> <script src=\"//maxcdn.bootstrapcdn.com/bootstrap/4.1.1/js/bootstrap.min.js\"></script> <script src=\"//cdnjs.cloudflare.com/ajax/libs/jquery/3.2.1/jquery.min.js\"></script> <div class=\"d-flex justify-content-center align-items-center\" id=\"main\"> <h1 class=\"mr-3 pr-3 align-top border-right inline-block align-content-center\">404</h1> <div class=\"inline-block align-middle\"> <h2 class=\"font-weight-normal lead\" id=\"desc\">The page you requested was not found.</h2> </div> </div>"
+        "</body></html>\n";
+    Response response;
 
     log("Handling error");
 
-    /* Write HTTP Header */
-    fprintf(r->stream, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
-
-    /* Write HTML Description of Error*/
-    fprintf(r->stream, "<html><body>\n");
-    fprintf(r->stream, "<link href=\"//maxcdn.bootstrapcdn.com/bootstrap/4.1.1/css/bootstrap.min.css\" rel=\"stylesheet\" id=\"bootstrap-css\"> <script src=\"//maxcdn.bootstrapcdn.com/bootstrap/4.1.1/js/bootstrap.min.js\"></script> <script src=\"//cdnjs.cloudflare.com/ajax/libs/jquery/3.2.1/jquery.min.js\"></script> <div class=\"d-flex justify-content-center align-items-center\" id=\"main\"> <h1 class=\"mr-3 pr-3 align-top border-right inline-block align-content-center\">404</h1> <div class=\"inline-block align-middle\"> <h2 class=\"font-weight-normal lead\" id=\"desc\">The page you requested was not found.</h2> </div> </div>");
-    fprintf(r->stream, "</body></html>\n");
+    /* Write HTTP Header and HTML Description of Error */
+    response_init(&response, status);
+    if(status == HTTP_STATUS_TOO_MANY_REQUESTS){
+      response_header(&response, "Retry-After: 1\r\n", 16);
+    }
+    response_content_type(&response, "text/html");
+    response_content_length(&response, sizeof(ErrorBody) - 1);
+    response_body(&response, ErrorBody, sizeof(ErrorBody) - 1);
+    response_send(r, &response, false);
 
     /* Return specified status */
     return status;
 }
 
+/**
+ * Handle request for missing file.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  HTTP_STATUS_NOT_FOUND.
+ *
+ * Missing files (often scanners probing for well-known paths) get a short
+ * 404 whose headers are formatted ahead of time, so the response costs one
+ * write.
+ **/
+Status  handle_missing(Request *r) {
+    static const char MissingBody[] = "<html><body><h1>404 Not Found</h1></body></html>\n";
+    static const char MissingHeaders[] =
+        "Content-Type: text/html\r\n"
+        "Content-Length: 49\r\n";
+    _Static_assert(sizeof(MissingBody) - 1 == 49, "Content-Length of MissingBody");
+    Response response;
+
+    response_init(&response, HTTP_STATUS_NOT_FOUND);
+    response_header(&response, MissingHeaders, sizeof(MissingHeaders) - 1);
+    response_body(&response, MissingBody, sizeof(MissingBody) - 1);
+    response_send(r, &response, false);
+    return HTTP_STATUS_NOT_FOUND;
+}
+
+/* Response Builder */
+
+#define IOV(s)  (struct iovec){ (void *)(s), sizeof(s) - 1 }
+
+static const char StatusPrefix[]  = "HTTP/1.0 ";
+static const char StaticHeaders[] = "Server: spidey\r\nConnection: close\r\n";
+static const char ContentType[]   = "Content-Type: ";
+static const char CRLF[]          = "\r\n";
+
+/**
+ * Return cached Date header line.
+ *
+ * @return  Static string containing "Date: ...\r\n" for the current second.
+ *
+ * The header is only reformatted when the wall clock second changes.
+ **/
+static struct iovec response_date(void) {
+    static char   DateHeader[64];
+    static size_t DateLength = 0;
+    static time_t DateTime   = 0;
+    time_t now = time(NULL);
+
+    if(now != DateTime || !DateLength){
+      struct tm tm;
+      gmtime_r(&now, &tm);
+      DateLength = strftime(DateHeader, sizeof(DateHeader), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+      DateTime   = now;
+    }
+    return (struct iovec){ DateHeader, DateLength };
+}
+
+/**
+ * Wait for client socket to drain under the write deadline.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  0 when writable, -1 on error or timeout.
+ *
+ * The write deadline is re-armed on every wait, so it bounds how long the
+ * client may stall rather than the total transfer time.
+ **/
+static int response_wait(Request *r) {
+    request_deadline(r, DEADLINE_WRITE);
+    return request_wait(r, POLLOUT);
+}
+
+/**
+ * Initialize response with status line and static headers.
+ *
+ * @param   response    Response structure.
+ * @param   status      HTTP Status of response.
+ **/
+void    response_init(Response *response, Status status) {
+    const char *status_string = http_status_string(status);
+
+    response->status = status;
+    response->iovcnt = 0;
+    response->iov[response->iovcnt++] = IOV(StatusPrefix);
+    response->iov[response->iovcnt++] = (struct iovec){ (void *)status_string, strlen(status_string) };
+    response->iov[response->iovcnt++] = IOV(CRLF);
+    response->iov[response->iovcnt++] = IOV(StaticHeaders);
+    response->iov[response->iovcnt++] = response_date();
+}
+
+/**
+ * Append precomputed header block to response.
+ *
+ * @param   response    Response structure.
+ * @param   block       Header lines, each terminated by "\r\n" (must outlive response).
+ * @param   length      Length of block.
+ **/
+void    response_header(Response *response, const char *block, size_t length) {
+    if(response->iovcnt < RESPONSE_IOVECS - 2){
+      response->iov[response->iovcnt++] = (struct iovec){ (void *)block, length };
+    }
+}
+
+/**
+ * Append Content-Type header to response.
+ *
+ * @param   response    Response structure.
+ * @param   mimetype    Mimetype string (must outlive response).
+ **/
+void    response_content_type(Response *response, const char *mimetype) {
+    if(response->iovcnt < RESPONSE_IOVECS - 4){
+      response->iov[response->iovcnt++] = IOV(ContentType);
+      response->iov[response->iovcnt++] = (struct iovec){ (void *)mimetype, strlen(mimetype) };
+      response->iov[response->iovcnt++] = IOV(CRLF);
+    }
+}
+
+/**
+ * Append Content-Length header to response.
+ *
+ * @param   response    Response structure.
+ * @param   length      Length of response body.
+ **/
+void    response_content_length(Response *response, size_t length) {
+    int n = snprintf(response->length, sizeof(response->length), "Content-Length: %zu\r\n", length);
+    response_header(response, response->length, n);
+}
+
+/**
+ * Terminate headers and attach body to response.
+ *
+ * @param   response    Response structure.
+ * @param   body        Pointer to body (must outlive response).
+ * @param   length      Length of body (may be 0).
+ **/
+void    response_body(Response *response, const void *body, size_t length) {
+    response->iov[response->iovcnt++] = IOV(CRLF);
+    if(length > 0){
+      response->iov[response->iovcnt++] = (struct iovec){ (void *)body, length };
+    }
+}
+
+/**
+ * Write response bytes to the client socket (Sink interface).
+ *
+ * @param   r           HTTP Request structure.
+ * @param   iov         Data to write (advanced in place on partial writes).
+ * @param   iovcnt      Number of iovecs.
+ * @param   more        Whether more data will follow (sets MSG_MORE).
+ * @return  Number of bytes written or -1 on error.
+ **/
+static ssize_t socket_writev(Request *r, struct iovec *iov, int iovcnt, bool more) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    ssize_t total = 0;
+
+    while(msg.msg_iovlen > 0){
+      ssize_t n = sendmsg(r->fd, &msg, flags);
+      if(n < 0){
+        if(errno == EINTR)
+          continue;
+        if((errno == EAGAIN || errno == EWOULDBLOCK) && response_wait(r) == 0)
+          continue;
+        debug("sendmsg failed: %s", strerror(errno));
+        return -1;
+      }
+      total += n;
+
+      /* Advance past fully written iovecs after a partial write */
+      while(msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len){
+        n -= msg.msg_iov->iov_len;
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+      if(msg.msg_iovlen > 0){
+        msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+        msg.msg_iov->iov_len -= n;
+      }
+    }
+    return total;
+}
+
+Sink SocketSink = { socket_writev };
+
+/**
+ * Flush response to the request sink.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   response    Response structure (headers terminated by response_body).
+ * @param   more        Whether more body data will follow.
+ * @return  Number of bytes written or -1 on error.
+ *
+ * For a socket, the status line, headers, and body are gathered into a single
+ * sendmsg(2) call.  If more is set, MSG_MORE tells the kernel to hold a
+ * partial packet until the rest of the body is written.
+ **/
+ssize_t response_send(Request *r, Response *response, bool more) {
+    return r->sink->writev(r, response->iov, response->iovcnt, more);
+}
+
+/**
+ * Write additional response body data to the request sink.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   buffer      Data to write.
+ * @param   length      Length of data.
+ * @return  Number of bytes written or -1 on error.
+ **/
+ssize_t response_write(Request *r, const void *buffer, size_t length) {
+    struct iovec iov = { (void *)buffer, length };
+
+    return r->sink->writev(r, &iov, 1, false);
+}
+
+/**
+ * Write file contents as additional response body data.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          File descriptor to read from.
+ * @param   offset      Offset in file of first byte to send.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes written or -1 on error.
+ *
+ * When the request writes straight to its socket (cleartext, or TLS with the
+ * kernel encrypting records) the file is sent with sendfile(2) and never
+ * copied through user space.  Other sinks, and file systems that do not
+ * support sendfile, fall back to reading and writing in chunks.
+ *
+ * The file goes out in slices paced by shaping_slice, so rate limits apply
+ * and, in event mode, other clients get a turn between slices.
+ **/
+ssize_t response_sendfile(Request *r, int fd, off_t offset, size_t length) {
+    char buffer[BUFSIZ];
+    bool zerocopy = r->sink == &SocketSink;
+    size_t total = 0;
+    ssize_t n;
+
+    while(total < length){
+      size_t end = total + shaping_slice(r, total, length - total);
+
+      while(zerocopy && total < end){
+        n = sendfile(r->fd, fd, &offset, end - total);
+        if(n > 0){
+          total += n;
+          continue;
+        }
+        if(n == 0){ // file truncated underneath us
+          return -1;
+        }
+        if(errno == EINTR)
+          continue;
+        if((errno == EAGAIN || errno == EWOULDBLOCK) && response_wait(r) == 0)
+          continue;
+        if(total == 0 && (errno == EINVAL || errno == ENOSYS)){
+          zerocopy = false;
+          break;
+        }
+        debug("sendfile failed: %s", strerror(errno));
+        return -1;
+      }
+
+      while(total < end){
+        size_t want = end - total < sizeof(buffer) ? end - total : sizeof(buffer);
+        if((n = pread(fd, buffer, want, offset)) <= 0 || response_write(r, buffer, n) < 0){
+          return -1;
+        }
+        offset += n;
+        total  += n;
+      }
+    }
+    return total;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,599 @@
+/* hpack.c: HPACK Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Static Table (RFC 7541 Appendix A) */
+
+static const struct {
+    const char *name;
+    const char *value;
+} StaticTable[] = {
+    {":authority",                  ""},
+    {":method",                     "GET"},
+    {":method",                     "POST"},
+    {":path",                       "/"},
+    {":path",                       "/index.html"},
+    {":scheme",                     "http"},
+    {":scheme",                     "https"},
+    {":status",                     "200"},
+    {":status",                     "204"},
+    {":status",                     "206"},
+    {":status",                     "304"},
+    {":status",                     "400"},
+    {":status",                     "404"},
+    {":status",                     "500"},
+    {"accept-charset",              ""},
+    {"accept-encoding",             "gzip, deflate"},
+    {"accept-language",             ""},
+    {"accept-ranges",               ""},
+    {"accept",                      ""},
+    {"access-control-allow-origin", ""},
+    {"age",                         ""},
+    {"allow",                       ""},
+    {"authorization",               ""},
+    {"cache-control",               ""},
+    {"content-disposition",         ""},
+    {"content-encoding",            ""},
+    {"content-language",            ""},
+    {"content-length",              ""},
+    {"content-location",            ""},
+    {"content-range",               ""},
+    {"content-type",                ""},
+    {"cookie",                      ""},
+    {"date",                        ""},
+    {"etag",                        ""},
+    {"expect",                      ""},
+    {"expires",                     ""},
+    {"from",                        ""},
+    {"host",                        ""},
+    {"if-match",                    ""},
+    {"if-modified-since",           ""},
+    {"if-none-match",               ""},
+    {"if-range",                    ""},
+    {"if-unmodified-since",         ""},
+    {"last-modified",               ""},
+    {"link",                        ""},
+    {"location",                    ""},
+    {"max-forwards",                ""},
+    {"proxy-authenticate",          ""},
+    {"proxy-authorization",         ""},
+    {"range",                       ""},
+    {"referer",                     ""},
+    {"refresh",                     ""},
+    {"retry-after",                 ""},
+    {"server",                      ""},
+    {"set-cookie",                  ""},
+    {"strict-transport-security",   ""},
+    {"transfer-encoding",           ""},
+    {"user-agent",                  ""},
+    {"vary",                        ""},
+    {"via",                         ""},
+    {"www-authenticate",            ""},
+};
+
+#define STATIC_ENTRIES  (sizeof(StaticTable) / sizeof(StaticTable[0]))
+#define ENTRY_OVERHEAD  32
+
+/* Huffman Code (RFC 7541 Appendix B): code and bit length per symbol */
+
+static const struct {
+    uint32_t code;
+    uint8_t  bits;
+} HuffmanCodes[257] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+    {0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+    {0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+    {0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+    {0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+    {0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+    {0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+    {0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+    {0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+/**
+ * Decode tree built from HuffmanCodes: positive children are node indices,
+ * negative children are -(symbol + 1), and 0 is an invalid code.
+ **/
+static int16_t HuffmanTree[256][2];
+static int     HuffmanNodes = 0;
+
+/**
+ * Build Huffman decode tree on first use.
+ **/
+static void hpack_huffman_init(void)
+{
+    if (HuffmanNodes)
+        return;
+
+    HuffmanNodes = 1;
+    for (int symbol = 0; symbol < 257; symbol++)
+    {
+        int node = 0;
+        for (int bit = HuffmanCodes[symbol].bits - 1; bit >= 0; bit--)
+        {
+            int branch = (HuffmanCodes[symbol].code >> bit) & 1;
+            if (bit == 0)
+            {
+                HuffmanTree[node][branch] = -(symbol + 1);
+            }
+            else
+            {
+                if (HuffmanTree[node][branch] == 0)
+                    HuffmanTree[node][branch] = HuffmanNodes++;
+                node = HuffmanTree[node][branch];
+            }
+        }
+    }
+}
+
+/**
+ * Decode Huffman encoded string.
+ *
+ * @param   input       Encoded octets.
+ * @param   length      Number of encoded octets.
+ * @return  Newly allocated decoded string, or NULL on invalid input.
+ **/
+static char *hpack_huffman_decode(const uint8_t *input, size_t length)
+{
+    char  *output = malloc(length * 8 / 5 + 1);   /* Shortest code is 5 bits */
+    size_t n = 0;
+    int    node = 0;
+
+    if (!output)
+        return NULL;
+
+    hpack_huffman_init();
+    for (size_t i = 0; i < length; i++)
+    {
+        for (int bit = 7; bit >= 0; bit--)
+        {
+            int child = HuffmanTree[node][(input[i] >> bit) & 1];
+            if (child == 0 || child == -257)    /* Invalid code or EOS */
+            {
+                free(output);
+                return NULL;
+            }
+            if (child < 0)
+            {
+                output[n++] = -child - 1;
+                node = 0;
+            }
+            else
+            {
+                node = child;
+            }
+        }
+    }
+
+    output[n] = '\0';
+    return output;
+}
+
+/**
+ * Decode HPACK integer with an N-bit prefix.
+ *
+ * @param   p           Pointer to current position (advanced on success).
+ * @param   end         End of input.
+ * @param   prefix      Number of prefix bits.
+ * @param   value       Pointer to store decoded value.
+ * @return  0 on success, -1 on truncated or oversized input.
+ **/
+static int hpack_get_integer(const uint8_t **p, const uint8_t *end, int prefix, uint64_t *value)
+{
+    uint64_t max = (1u << prefix) - 1;
+    uint64_t v;
+
+    if (*p >= end)
+        return -1;
+
+    v = *(*p)++ & max;
+    if (v < max)
+    {
+        *value = v;
+        return 0;
+    }
+
+    for (int shift = 0; *p < end && shift <= 28; shift += 7)
+    {
+        uint8_t byte = *(*p)++;
+        v += (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Decode HPACK string literal.
+ *
+ * @return  Newly allocated string, or NULL on error.
+ **/
+static char *hpack_get_string(const uint8_t **p, const uint8_t *end)
+{
+    bool huffman;
+    uint64_t length;
+
+    if (*p >= end)
+        return NULL;
+
+    huffman = **p & 0x80;
+    if (hpack_get_integer(p, end, 7, &length) < 0 || length > (uint64_t)(end - *p))
+        return NULL;
+
+    char *string = huffman ? hpack_huffman_decode(*p, length) : strndup((const char *)*p, length);
+    *p += length;
+    return string;
+}
+
+/**
+ * Encode HPACK integer with an N-bit prefix.
+ *
+ * @return  Number of octets written, or -1 if the buffer is too small.
+ **/
+static ssize_t hpack_put_integer(uint8_t *buffer, size_t size, uint8_t flags, int prefix, uint64_t value)
+{
+    uint64_t max = (1u << prefix) - 1;
+    size_t n = 0;
+
+    if (size < 1)
+        return -1;
+
+    if (value < max)
+    {
+        buffer[n++] = flags | value;
+        return n;
+    }
+
+    buffer[n++] = flags | max;
+    value -= max;
+    while (value >= 0x80)
+    {
+        if (n >= size)
+            return -1;
+        buffer[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n >= size)
+        return -1;
+    buffer[n++] = value;
+    return n;
+}
+
+/**
+ * Encode HPACK string literal (without Huffman coding).
+ *
+ * @return  Number of octets written, or -1 if the buffer is too small.
+ **/
+static ssize_t hpack_put_string(uint8_t *buffer, size_t size, const char *string)
+{
+    size_t length = strlen(string);
+    ssize_t n = hpack_put_integer(buffer, size, 0x00, 7, length);
+
+    if (n < 0 || n + length > size)
+        return -1;
+
+    memcpy(buffer + n, string, length);
+    return n + length;
+}
+
+/**
+ * Initialize dynamic table.
+ *
+ * @param   table       HpackTable structure.
+ * @param   max_size    Maximum size of table in octets.
+ **/
+void hpack_table_init(HpackTable *table, size_t max_size)
+{
+    memset(table, 0, sizeof(*table));
+    table->max_size = max_size;
+}
+
+/**
+ * Release dynamic table entries.
+ **/
+void hpack_table_free(HpackTable *table)
+{
+    for (size_t i = 0; i < table->count; i++)
+    {
+        free(table->entries[i].name);
+        free(table->entries[i].value);
+    }
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Evict oldest entries until table size fits within limit.
+ **/
+static void hpack_table_evict(HpackTable *table, size_t limit)
+{
+    size_t evicted = 0;
+
+    while (evicted < table->count && table->size > limit)
+    {
+        HpackEntry *entry = &table->entries[evicted++];
+        table->size -= strlen(entry->name) + strlen(entry->value) + ENTRY_OVERHEAD;
+        free(entry->name);
+        free(entry->value);
+    }
+
+    table->count -= evicted;
+    memmove(table->entries, table->entries + evicted, table->count * sizeof(HpackEntry));
+}
+
+/**
+ * Change maximum size of dynamic table, evicting entries as needed.
+ **/
+void hpack_table_resize(HpackTable *table, size_t max_size)
+{
+    table->max_size = max_size;
+    hpack_table_evict(table, max_size);
+}
+
+/**
+ * Insert entry into dynamic table (RFC 7541 Section 4.4).
+ *
+ * The name may be that of an entry about to be evicted, so it is copied
+ * before evicting.
+ **/
+static void hpack_table_add(HpackTable *table, const char *name, const char *value)
+{
+    size_t size = strlen(name) + strlen(value) + ENTRY_OVERHEAD;
+    char *name_copy = size <= table->max_size ? strdup(name) : NULL;
+    char *value_copy = size <= table->max_size ? strdup(value) : NULL;
+
+    /* An entry larger than the table simply empties it */
+    hpack_table_evict(table, size <= table->max_size ? table->max_size - size : 0);
+    if (size > table->max_size || !name_copy || !value_copy)
+        goto fail;
+
+    if (table->count == table->capacity)
+    {
+        size_t capacity = table->capacity ? table->capacity * 2 : 16;
+        HpackEntry *entries = realloc(table->entries, capacity * sizeof(HpackEntry));
+        if (!entries)
+            goto fail;
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+
+    table->entries[table->count].name = name_copy;
+    table->entries[table->count].value = value_copy;
+    table->count++;
+    table->size += size;
+    return;
+
+fail:
+    free(name_copy);
+    free(value_copy);
+}
+
+/**
+ * Look up entry by HPACK index (static entries first, then newest dynamic).
+ *
+ * @return  true if index is valid.
+ **/
+static bool hpack_table_get(HpackTable *table, uint64_t index, const char **name, const char **value)
+{
+    if (index == 0)
+        return false;
+
+    if (index <= STATIC_ENTRIES)
+    {
+        *name = StaticTable[index - 1].name;
+        *value = StaticTable[index - 1].value;
+        return true;
+    }
+
+    index -= STATIC_ENTRIES;
+    if (index > table->count)
+        return false;
+
+    *name = table->entries[table->count - index].name;
+    *value = table->entries[table->count - index].value;
+    return true;
+}
+
+/**
+ * Decode header block.
+ *
+ * @param   table       Decoder dynamic table.
+ * @param   block       Header block fragment(s), concatenated.
+ * @param   length      Length of header block.
+ * @param   emit        Function called for each decoded header field.
+ * @param   context     User data passed to emit.
+ * @return  0 on success, -1 on compression error.
+ **/
+int hpack_decode(HpackTable *table, const uint8_t *block, size_t length, HpackEmit emit, void *context)
+{
+    const uint8_t *p = block;
+    const uint8_t *end = block + length;
+
+    while (p < end)
+    {
+        const char *name;
+        const char *value;
+        uint64_t index;
+
+        if (*p & 0x80)
+        {
+            /* Indexed Header Field */
+            if (hpack_get_integer(&p, end, 7, &index) < 0 || !hpack_table_get(table, index, &name, &value))
+                return -1;
+            emit(context, name, value);
+        }
+        else if ((*p & 0xe0) == 0x20)
+        {
+            /* Dynamic Table Size Update (bounded by our advertised limit) */
+            if (hpack_get_integer(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE)
+                return -1;
+            hpack_table_resize(table, index);
+        }
+        else
+        {
+            /* Literal Header Field (with, without, or never indexing) */
+            bool incremental = *p & 0x40;
+            char *literal_name = NULL;
+            char *literal_value = NULL;
+
+            if (hpack_get_integer(&p, end, incremental ? 6 : 4, &index) < 0)
+                return -1;
+
+            if (index)
+            {
+                if (!hpack_table_get(table, index, &name, &value))
+                    return -1;
+            }
+            else
+            {
+                if (!(literal_name = hpack_get_string(&p, end)))
+                    return -1;
+                name = literal_name;
+            }
+
+            if (!(literal_value = hpack_get_string(&p, end)))
+            {
+                free(literal_name);
+                return -1;
+            }
+
+            emit(context, name, literal_value);
+            if (incremental)
+                hpack_table_add(table, name, literal_value);
+
+            free(literal_name);
+            free(literal_value);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Encode header field.
+ *
+ * @param   table       Encoder dynamic table.
+ * @param   buffer      Output buffer.
+ * @param   size        Size of output buffer.
+ * @param   name        Lowercase header name.
+ * @param   value       Header value.
+ * @param   index       Whether to add the field to the dynamic table.
+ * @return  Number of octets written, or -1 if the buffer is too small.
+ *
+ * Exact matches in either table are sent as a single index.  Otherwise, a
+ * literal is sent referencing a table name when possible.  Values that vary
+ * per response (dates, lengths) should not be indexed.
+ **/
+ssize_t hpack_encode(HpackTable *table, uint8_t *buffer, size_t size, const char *name, const char *value, bool index)
+{
+    uint64_t name_index = 0;
+    uint64_t total = STATIC_ENTRIES + table->count;
+
+    for (uint64_t i = 1; i <= total; i++)
+    {
+        const char *entry_name;
+        const char *entry_value;
+
+        hpack_table_get(table, i, &entry_name, &entry_value);
+        if (!streq(entry_name, name))
+            continue;
+        if (streq(entry_value, value))
+            return hpack_put_integer(buffer, size, 0x80, 7, i);
+        if (!name_index)
+            name_index = i;
+    }
+
+    ssize_t n = hpack_put_integer(buffer, size, index ? 0x40 : 0x00, index ? 6 : 4, name_index);
+    ssize_t m;
+
+    if (n < 0)
+        return -1;
+    if (!name_index)
+    {
+        if ((m = hpack_put_string(buffer + n, size - n, name)) < 0)
+            return -1;
+        n += m;
+    }
+    if ((m = hpack_put_string(buffer + n, size - n, value)) < 0)
+        return -1;
+
+    if (index)
+        hpack_table_add(table, name, value);
+    return n + m;
+}
+
+/**
+ * Encode Dynamic Table Size Update and apply it to the encoder table.
+ *
+ * @return  Number of octets written, or -1 if the buffer is too small.
+ **/
+ssize_t hpack_encode_table_size(HpackTable *table, uint8_t *buffer, size_t size, size_t max_size)
+{
+    hpack_table_resize(table, max_size);
+    return hpack_put_integer(buffer, size, 0x20, 5, max_size);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,1004 @@
+/* http2.c: HTTP/2 Cleartext (h2c) Connections */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define H2_FRAME_HEADER     9               /* Length of frame header */
+#define H2_FRAME_SIZE       16384           /* Our SETTINGS_MAX_FRAME_SIZE */
+#define H2_WINDOW_SIZE      65535           /* Default initial window size */
+#define H2_MAX_STREAMS      128             /* Our SETTINGS_MAX_CONCURRENT_STREAMS */
+#define H2_HEAD_MAX         16384           /* Largest buffered response head */
+
+static const char H2Preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/**
+ * Frame types (RFC 7540 Section 6)
+ */
+enum {
+    FRAME_DATA = 0,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION,
+};
+
+#define FLAG_END_STREAM     0x01
+#define FLAG_ACK            0x01
+#define FLAG_END_HEADERS    0x04
+#define FLAG_PADDED         0x08
+#define FLAG_PRIORITY       0x20
+
+/**
+ * Settings identifiers (RFC 7540 Section 6.5.2)
+ */
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 1,
+    SETTINGS_ENABLE_PUSH,
+    SETTINGS_MAX_CONCURRENT_STREAMS,
+    SETTINGS_INITIAL_WINDOW_SIZE,
+    SETTINGS_MAX_FRAME_SIZE,
+    SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+/**
+ * Error codes (RFC 7540 Section 7)
+ */
+enum {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+};
+
+/* Structures */
+
+typedef struct h2_connection H2Connection;
+typedef struct h2_stream     H2Stream;
+
+struct h2_stream {
+    Sink          sink;                 /*< Response sink (must be first) */
+    H2Connection *connection;           /*< Owning connection */
+    uint32_t      id;                   /*< Stream identifier */
+    int64_t       send_window;          /*< Stream flow-control window */
+    Request      *request;              /*< Request decoded from HEADERS */
+    bool          end_stream;           /*< Client finished sending */
+    bool          queued;               /*< On ready queue */
+    bool          reset;                /*< Stream was reset */
+    bool          headers_sent;         /*< Response HEADERS sent */
+    bool          end_sent;             /*< Response END_STREAM sent */
+    char         *head;                 /*< Buffered HTTP/1 response head */
+    size_t        head_length;          /*< Length of buffered head */
+    H2Stream     *next;                 /*< Next open stream */
+    H2Stream     *next_ready;           /*< Next stream on ready queue */
+};
+
+struct h2_connection {
+    Request      *conn;                 /*< Underlying client connection */
+    HpackTable    decoder;              /*< Request header table */
+    HpackTable    encoder;              /*< Response header table */
+    size_t        encoder_limit;        /*< Peer SETTINGS_HEADER_TABLE_SIZE */
+    uint32_t      max_frame_size;       /*< Peer SETTINGS_MAX_FRAME_SIZE */
+    int64_t       initial_window;       /*< Peer SETTINGS_INITIAL_WINDOW_SIZE */
+    int64_t       send_window;          /*< Connection flow-control window */
+    uint32_t      last_stream;          /*< Highest client stream identifier */
+    H2Stream     *streams;              /*< Open streams */
+    size_t        nstreams;             /*< Number of open streams */
+    H2Stream     *ready_head;           /*< Streams with complete requests */
+    H2Stream     *ready_tail;           /*< Tail of ready queue */
+    uint8_t      *block;                /*< Header block being assembled */
+    size_t        block_length;         /*< Length of header block */
+    uint32_t      block_stream;         /*< Stream of header block (0 if none) */
+    uint8_t       block_flags;          /*< Flags of initial HEADERS frame */
+    bool          goaway;               /*< Peer sent GOAWAY */
+    bool          closed;               /*< Connection failed or finished */
+    uint8_t       frame[H2_FRAME_SIZE]; /*< Frame payload buffer */
+};
+
+/* Internal Declarations */
+
+static int h2_read_frame(H2Connection *c);
+
+/* Frame Output */
+
+static void h2_put32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24; p[1] = value >> 16; p[2] = value >> 8; p[3] = value;
+}
+
+static uint32_t h2_get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Write frame to connection.
+ *
+ * @param   c           H2Connection structure.
+ * @param   type        Frame type.
+ * @param   flags       Frame flags.
+ * @param   stream      Stream identifier.
+ * @param   payload     Frame payload.
+ * @param   length      Length of payload.
+ * @return  0 on success, -1 on error (connection is marked closed).
+ **/
+static int h2_write_frame(H2Connection *c, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t length)
+{
+    uint8_t header[H2_FRAME_HEADER] = {length >> 16, length >> 8, length, type, flags};
+    struct iovec iov[2] = {
+        {header, sizeof(header)},
+        {(void *)payload, length},
+    };
+
+    h2_put32(header + 5, stream & 0x7fffffff);
+    if (c->closed || c->conn->sink->writev(c->conn, iov, length ? 2 : 1, false) < 0)
+    {
+        c->closed = true;
+        return -1;
+    }
+    return 0;
+}
+
+static void h2_rst_stream(H2Connection *c, uint32_t stream, uint32_t error)
+{
+    uint8_t payload[4];
+
+    h2_put32(payload, error);
+    h2_write_frame(c, FRAME_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+static void h2_window_update(H2Connection *c, uint32_t stream, uint32_t increment)
+{
+    uint8_t payload[4];
+
+    h2_put32(payload, increment);
+    h2_write_frame(c, FRAME_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+/**
+ * Send GOAWAY with error and stop processing the connection.
+ *
+ * @return  -1 so callers can return the result directly.
+ **/
+static int h2_goaway(H2Connection *c, uint32_t error)
+{
+    uint8_t payload[8];
+
+    log("HTTP/2 connection error %u", error);
+    h2_put32(payload, c->last_stream);
+    h2_put32(payload + 4, error);
+    h2_write_frame(c, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->closed = true;
+    return -1;
+}
+
+/* Streams */
+
+static H2Stream *h2_stream_find(H2Connection *c, uint32_t id)
+{
+    for (H2Stream *s = c->streams; s; s = s->next)
+        if (s->id == id)
+            return s;
+    return NULL;
+}
+
+static void h2_stream_ready(H2Connection *c, H2Stream *s)
+{
+    if (s->queued || s->reset)
+        return;
+
+    s->queued = true;
+    if (c->ready_tail)
+        c->ready_tail->next_ready = s;
+    else
+        c->ready_head = s;
+    c->ready_tail = s;
+}
+
+static void h2_stream_free(H2Connection *c, H2Stream *s)
+{
+    for (H2Stream **p = &c->streams; *p; p = &(*p)->next)
+    {
+        if (*p == s)
+        {
+            *p = s->next;
+            c->nstreams--;
+            break;
+        }
+    }
+
+    free_request(s->request);
+    free(s->head);
+    free(s);
+}
+
+static ssize_t h2_stream_writev(Request *r, struct iovec *iov, int iovcnt, bool more);
+
+/**
+ * Allocate stream and its Request.
+ *
+ * The Request shares the client address of the connection but has no socket
+ * of its own: handlers write to it through the stream sink.
+ **/
+static H2Stream *h2_stream_new(H2Connection *c, uint32_t id)
+{
+    H2Stream *s = calloc(1, sizeof(H2Stream));
+    Request  *r = calloc(1, sizeof(Request));
+
+    if (!s || !r || !(r->headers = calloc(1, sizeof(Header))))
+    {
+        free(s);
+        free(r);
+        return NULL;
+    }
+
+    r->fd = -1;
+    r->file_fd = -1;
+    r->addr = c->conn->addr;
+    r->addrlen = c->conn->addrlen;
+    r->sink = &s->sink;
+
+    s->sink.writev = h2_stream_writev;
+    s->connection = c;
+    s->id = id;
+    s->send_window = c->initial_window;
+    s->request = r;
+    s->next = c->streams;
+    c->streams = s;
+    c->nstreams++;
+    return s;
+}
+
+/**
+ * Store decoded request header field in stream request.
+ *
+ * Pseudo-headers fill in the method, URI, and query; :authority becomes the
+ * Host header.  Regular header names are converted to the canonical
+ * Title-Case used by HTTP/1 clients so handlers see the same names.
+ **/
+static void h2_emit(void *context, const char *name, const char *value)
+{
+    Request *r = context;
+
+    if (streq(name, ":method"))
+    {
+        free(r->method);
+        r->method = strdup(value);
+    }
+    else if (streq(name, ":path"))
+    {
+        const char *query = strchr(value, '?');
+        free(r->uri);
+        free(r->query);
+        r->uri = query ? strndup(value, query - value) : strdup(value);
+        r->query = strdup(query ? query + 1 : "");
+    }
+    else if (name[0] != ':')
+    {
+        Header *header = calloc(1, sizeof(Header));
+        if (!header)
+            return;
+
+        header->name = strdup(name);
+        header->data = strdup(value);
+        for (char *p = header->name; p && *p; p++)
+            if (p == header->name || p[-1] == '-')
+                *p = toupper(*p);
+        header->next = r->headers;
+        r->headers = header;
+    }
+
+    if (streq(name, ":authority"))
+        h2_emit(context, "host", value);
+}
+
+static void h2_discard(void *context, const char *name, const char *value)
+{
+}
+
+/**
+ * Handle complete header block.
+ *
+ * @return  0 on success, -1 on connection error.
+ *
+ * The block is always decoded, even for refused streams or trailers, so
+ * that the decoder table stays in sync with the client.
+ **/
+static int h2_headers(H2Connection *c, uint32_t id, uint8_t flags, const uint8_t *block, size_t length)
+{
+    H2Stream *s = h2_stream_find(c, id);
+
+    if (s)
+    {
+        /* Trailers: decode and ignore */
+        if (hpack_decode(&c->decoder, block, length, h2_discard, NULL) < 0)
+            return h2_goaway(c, H2_COMPRESSION_ERROR);
+        if (flags & FLAG_END_STREAM)
+        {
+            s->end_stream = true;
+            h2_stream_ready(c, s);
+        }
+        return 0;
+    }
+
+    if (!(id & 1) || id <= c->last_stream)
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+    c->last_stream = id;
+
+    if (c->nstreams >= H2_MAX_STREAMS || !(s = h2_stream_new(c, id)))
+    {
+        if (hpack_decode(&c->decoder, block, length, h2_discard, NULL) < 0)
+            return h2_goaway(c, H2_COMPRESSION_ERROR);
+        h2_rst_stream(c, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+
+    if (hpack_decode(&c->decoder, block, length, h2_emit, s->request) < 0)
+        return h2_goaway(c, H2_COMPRESSION_ERROR);
+
+    if (!s->request->method || !s->request->uri)
+    {
+        h2_rst_stream(c, id, H2_PROTOCOL_ERROR);
+        h2_stream_free(c, s);
+        return 0;
+    }
+
+    if (flags & FLAG_END_STREAM)
+    {
+        s->end_stream = true;
+        h2_stream_ready(c, s);
+    }
+    return 0;
+}
+
+/* Frame Input */
+
+/**
+ * Strip padding from frame payload.
+ *
+ * @return  0 on success, -1 if the padding is invalid.
+ **/
+static int h2_unpad(uint8_t flags, const uint8_t **payload, size_t *length)
+{
+    if (!(flags & FLAG_PADDED))
+        return 0;
+    if (*length < 1 || (*payload)[0] >= *length)
+        return -1;
+
+    *length -= (*payload)[0] + 1;
+    *payload += 1;
+    return 0;
+}
+
+/**
+ * Apply SETTINGS parameters from peer.
+ *
+ * @return  0 on success, -1 on connection error.
+ **/
+static int h2_settings(H2Connection *c, const uint8_t *p, size_t length)
+{
+    if (length % 6)
+        return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+
+    for (; length > 0; p += 6, length -= 6)
+    {
+        uint16_t id = (p[0] << 8) | p[1];
+        uint32_t value = h2_get32(p + 2);
+
+        switch (id)
+        {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            c->encoder_limit = value < HPACK_TABLE_SIZE ? value : HPACK_TABLE_SIZE;
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > 0x7fffffff)
+                return h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+            for (H2Stream *s = c->streams; s; s = s->next)
+                s->send_window += (int64_t)value - c->initial_window;
+            c->initial_window = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_FRAME_SIZE || value > 0xffffff)
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            c->max_frame_size = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Process one frame from peer.
+ *
+ * @return  0 on success, -1 on connection error.
+ **/
+static int h2_process_frame(H2Connection *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length)
+{
+    H2Stream *s;
+
+    /* Header blocks must be contiguous */
+    if (c->block_stream && (type != FRAME_CONTINUATION || id != c->block_stream))
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+    switch (type)
+    {
+    case FRAME_DATA:
+        if (id == 0 || h2_unpad(flags, &payload, &length) < 0)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+        /* Request bodies are not used by handlers: consume and replenish */
+        length += (flags & FLAG_PADDED) ? payload[-1] + 1 : 0;
+        if (length > 0)
+            h2_window_update(c, 0, length);
+        if ((s = h2_stream_find(c, id)) && !s->end_stream)
+        {
+            if (length > 0 && !(flags & FLAG_END_STREAM))
+                h2_window_update(c, id, length);
+            if (flags & FLAG_END_STREAM)
+            {
+                s->end_stream = true;
+                h2_stream_ready(c, s);
+            }
+        }
+        break;
+
+    case FRAME_HEADERS:
+        if (id == 0 || h2_unpad(flags, &payload, &length) < 0)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        if (flags & FLAG_PRIORITY)
+        {
+            if (length < 5)
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            payload += 5;
+            length -= 5;
+        }
+        if (flags & FLAG_END_HEADERS)
+            return h2_headers(c, id, flags, payload, length);
+
+        /* Wait for CONTINUATION frames */
+        if (!(c->block = malloc(length)))
+            return h2_goaway(c, H2_INTERNAL_ERROR);
+        memcpy(c->block, payload, length);
+        c->block_length = length;
+        c->block_stream = id;
+        c->block_flags = flags;
+        break;
+
+    case FRAME_CONTINUATION:
+        if (!c->block_stream || c->block_length + length > HPACK_BLOCK_MAX)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        else
+        {
+            uint8_t *block = realloc(c->block, c->block_length + length);
+            if (!block)
+                return h2_goaway(c, H2_INTERNAL_ERROR);
+            memcpy(block + c->block_length, payload, length);
+            c->block = block;
+            c->block_length += length;
+        }
+        if (flags & FLAG_END_HEADERS)
+        {
+            uint32_t stream = c->block_stream;
+            int result;
+
+            c->block_stream = 0;
+            result = h2_headers(c, stream, c->block_flags, c->block, c->block_length);
+            free(c->block);
+            c->block = NULL;
+            return result;
+        }
+        break;
+
+    case FRAME_PRIORITY:
+        break;
+
+    case FRAME_RST_STREAM:
+        if (id == 0 || length != 4)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        if ((s = h2_stream_find(c, id)))
+        {
+            debug("HTTP/2 stream %u reset by peer", id);
+            s->reset = true;
+            if (!s->queued)
+                h2_stream_free(c, s);
+        }
+        break;
+
+    case FRAME_SETTINGS:
+        if (id != 0)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        if (flags & FLAG_ACK)
+            break;
+        if (h2_settings(c, payload, length) < 0)
+            return -1;
+        return h2_write_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+
+    case FRAME_PING:
+        if (id != 0 || length != 8)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        if (!(flags & FLAG_ACK))
+            return h2_write_frame(c, FRAME_PING, FLAG_ACK, 0, payload, length);
+        break;
+
+    case FRAME_GOAWAY:
+        c->goaway = true;
+        break;
+
+    case FRAME_WINDOW_UPDATE:
+        if (length != 4)
+            return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        else
+        {
+            uint32_t increment = h2_get32(payload) & 0x7fffffff;
+            if (id == 0)
+            {
+                c->send_window += increment;
+                if (increment == 0 || c->send_window > 0x7fffffff)
+                    return h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+            }
+            else if ((s = h2_stream_find(c, id)))
+            {
+                s->send_window += increment;
+                if (increment == 0 || s->send_window > 0x7fffffff)
+                {
+                    h2_rst_stream(c, id, H2_FLOW_CONTROL_ERROR);
+                    s->reset = true;
+                }
+            }
+        }
+        break;
+
+    case FRAME_PUSH_PROMISE:
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+    default:
+        /* Unknown frame types must be ignored */
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * Read exactly length bytes from connection.
+ **/
+static int h2_read(H2Connection *c, void *buffer, size_t length)
+{
+    for (size_t total = 0; total < length; )
+    {
+        ssize_t n = request_read(c->conn, (char *)buffer + total, length - total);
+        if (n <= 0)
+        {
+            c->closed = true;
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/**
+ * Read and process one frame.
+ *
+ * @return  0 on success, -1 on error (connection is closed).
+ **/
+static int h2_read_frame(H2Connection *c)
+{
+    uint8_t header[H2_FRAME_HEADER];
+    uint32_t length;
+
+    if (c->closed || h2_read(c, header, sizeof(header)) < 0)
+        return -1;
+
+    length = (header[0] << 16) | (header[1] << 8) | header[2];
+    if (length > H2_FRAME_SIZE)
+        return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+
+    if (h2_read(c, c->frame, length) < 0)
+        return -1;
+
+    return h2_process_frame(c, header[3], header[4], h2_get32(header + 5) & 0x7fffffff, c->frame, length);
+}
+
+/* Response Sink */
+
+/**
+ * Send response head as HEADERS (and CONTINUATION) frames.
+ *
+ * @param   s           H2Stream structure.
+ * @param   head        HTTP/1 response head (status line and headers).
+ * @param   length      Length of head.
+ * @return  0 on success, -1 on error.
+ *
+ * Handlers (and CGI scripts) produce HTTP/1 heads, so the status line and
+ * header lines are translated here.  A CGI "Status:" header overrides the
+ * status, and hop-by-hop headers, which HTTP/2 forbids, are dropped.
+ **/
+static int h2_send_headers(H2Stream *s, char *head, size_t length)
+{
+    static const char *HopByHop[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "status", NULL};
+    H2Connection *c = s->connection;
+    size_t   size = length + 64;
+    uint8_t *block = malloc(size);
+    size_t   n = 0;
+    char     status[4] = "200";
+    ssize_t  m;
+
+    if (!block)
+        return -1;
+
+    if (c->encoder_limit != c->encoder.max_size)
+        n += hpack_encode_table_size(&c->encoder, block, size, c->encoder_limit);
+
+    /* First pass: status */
+    for (char *line = head; line < head + length; line = strchr(line, '\n') + 1)
+    {
+        if (!strncmp(line, "HTTP/", 5) && strchr(line, ' '))
+            strncpy(status, strchr(line, ' ') + 1, 3);
+        else if (!strncasecmp(line, "Status:", 7))
+            strncpy(status, skip_whitespace(line + 7), 3);
+    }
+
+    if ((m = hpack_encode(&c->encoder, block + n, size - n, ":status", status, false)) < 0)
+        goto fail;
+    n += m;
+
+    /* Second pass: regular headers (lines are split in place) */
+    for (char *line = head, *next; line < head + length; line = next)
+    {
+        char *end   = strchr(line, '\n');
+        char *colon = memchr(line, ':', end - line);
+        bool  skip  = false;
+
+        next = end + 1;
+        if (!colon || !strncmp(line, "HTTP/", 5))
+            continue;
+
+        *end = '\0';
+        if (end > line && end[-1] == '\r')
+            end[-1] = '\0';
+        *colon = '\0';
+        for (char *p = line; *p; p++)
+            *p = tolower(*p);
+
+        for (const char **h = HopByHop; *h && !skip; h++)
+            skip = streq(line, *h);
+
+        if (!skip)
+        {
+            bool index = !streq(line, "date") && !streq(line, "content-length");
+            if ((m = hpack_encode(&c->encoder, block + n, size - n, line, skip_whitespace(colon + 1), index)) < 0)
+                goto fail;
+            n += m;
+        }
+    }
+
+    /* Split block across HEADERS and CONTINUATION frames */
+    for (size_t offset = 0; offset < n || offset == 0; )
+    {
+        size_t  chunk = n - offset < c->max_frame_size ? n - offset : c->max_frame_size;
+        uint8_t type  = offset == 0 ? FRAME_HEADERS : FRAME_CONTINUATION;
+        uint8_t flags = offset + chunk == n ? FLAG_END_HEADERS : 0;
+
+        if (h2_write_frame(c, type, flags, s->id, block + offset, chunk) < 0)
+            goto fail;
+        offset += chunk;
+    }
+
+    free(block);
+    s->headers_sent = true;
+    return 0;
+
+fail:
+    free(block);
+    return -1;
+}
+
+/**
+ * Buffer response head until it is complete, then send it.
+ *
+ * @return  Number of bytes of data consumed as part of the head, or -1 on
+ * error.  Any remaining bytes belong to the body.
+ **/
+static ssize_t h2_stream_head(H2Stream *s, const char *data, size_t length)
+{
+    size_t old = s->head_length;
+    size_t take = length < H2_HEAD_MAX - old ? length : H2_HEAD_MAX - old;
+
+    if (!s->head && !(s->head = malloc(H2_HEAD_MAX + 1)))
+        return -1;
+
+    memcpy(s->head + old, data, take);
+    s->head_length += take;
+    s->head[s->head_length] = '\0';
+
+    char *crlf = strstr(s->head, "\r\n\r\n");
+    char *lf   = strstr(s->head, "\n\n");
+    size_t end;
+
+    if (crlf && (!lf || crlf < lf))
+        end = crlf + 4 - s->head;
+    else if (lf)
+        end = lf + 2 - s->head;
+    else if (s->head_length == H2_HEAD_MAX)
+        return -1;
+    else
+        return take;
+
+    if (h2_send_headers(s, s->head, end) < 0)
+        return -1;
+    return end - old;
+}
+
+/**
+ * Send response body as DATA frames under flow control.
+ *
+ * @return  0 on success, -1 on error or if the stream was reset.
+ *
+ * When either flow-control window is exhausted, frames are read from the
+ * connection (which may queue new streams) until the peer opens it again.
+ **/
+static int h2_stream_data(H2Stream *s, const char *data, size_t length, bool end)
+{
+    H2Connection *c = s->connection;
+
+    do
+    {
+        size_t chunk = length < c->max_frame_size ? length : c->max_frame_size;
+
+        while (chunk > 0 && (s->send_window <= 0 || c->send_window <= 0))
+        {
+            if (s->reset || h2_read_frame(c) < 0)
+                return -1;
+        }
+        if (s->reset)
+            return -1;
+
+        if ((int64_t)chunk > s->send_window)
+            chunk = s->send_window;
+        if ((int64_t)chunk > c->send_window)
+            chunk = c->send_window;
+
+        uint8_t flags = (end && chunk == length) ? FLAG_END_STREAM : 0;
+        if (h2_write_frame(c, FRAME_DATA, flags, s->id, data, chunk) < 0)
+            return -1;
+
+        s->send_window -= chunk;
+        c->send_window -= chunk;
+        s->end_sent = flags & FLAG_END_STREAM;
+        data += chunk;
+        length -= chunk;
+    } while (length > 0);
+
+    return 0;
+}
+
+/**
+ * Write response bytes to HTTP/2 stream (Sink interface).
+ **/
+static ssize_t h2_stream_writev(Request *r, struct iovec *iov, int iovcnt, bool more)
+{
+    H2Stream *s = (H2Stream *)r->sink;
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char *data = iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+
+        if (!s->headers_sent)
+        {
+            ssize_t consumed = h2_stream_head(s, data, length);
+            if (consumed < 0)
+                return -1;
+            data += consumed;
+            length -= consumed;
+        }
+
+        if (length > 0 && h2_stream_data(s, data, length, false) < 0)
+            return -1;
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/**
+ * Dispatch stream request and finish the stream.
+ **/
+static void h2_stream_run(H2Connection *c, H2Stream *s)
+{
+    if (s->reset)
+    {
+        h2_stream_free(c, s);
+        return;
+    }
+
+    debug("HTTP/2 stream %u: %s %s", s->id, s->request->method, s->request->uri);
+
+    dispatch_request(s->request);
+
+    if (!c->closed && !s->reset)
+    {
+        if (!s->headers_sent)
+            h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+        else if (!s->end_sent)
+            h2_stream_data(s, NULL, 0, true);
+    }
+    h2_stream_free(c, s);
+}
+
+/* Connection */
+
+/**
+ * Decode base64url string (as used by HTTP2-Settings).
+ *
+ * @return  Number of decoded bytes, or -1 on invalid input.
+ **/
+static ssize_t h2_base64url_decode(const char *input, uint8_t *output, size_t size)
+{
+    static const char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t bits = 0;
+    int nbits = 0;
+    size_t n = 0;
+
+    for (; *input && *input != '='; input++)
+    {
+        const char *p = strchr(Alphabet, *input);
+        if (!p || !*p)
+            return -1;
+        bits = (bits << 6) | (p - Alphabet);
+        nbits += 6;
+        if (nbits >= 8)
+        {
+            if (n >= size)
+                return -1;
+            nbits -= 8;
+            output[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/**
+ * Determine if request asks to upgrade to HTTP/2 cleartext.
+ *
+ * @param   r           HTTP Request structure (parsed).
+ * @return  true if Upgrade names h2c and HTTP2-Settings is present.
+ **/
+bool http2_upgrade_requested(Request *r)
+{
+    const char *upgrade = request_header(r, "Upgrade");
+
+    return upgrade && strcasestr(upgrade, "h2c") && request_header(r, "HTTP2-Settings") && streq(r->method, "GET");
+}
+
+/**
+ * Serve HTTP/2 connection.
+ *
+ * @param   r           HTTP Request structure of the client connection.
+ * @param   upgrade     Whether r is an HTTP/1.1 request upgrading to h2c
+ * (otherwise r is the prior-knowledge preface "PRI * HTTP/2.0").
+ * @return  Status of the connection (HTTP_STATUS_OK unless it failed early).
+ *
+ * Requests on all streams are decoded as frames arrive and queued.  Queued
+ * streams are dispatched to the usual handlers one at a time, with their
+ * output translated into HEADERS and DATA frames by the stream sink.  While
+ * a response waits for flow control, frames from the peer keep being
+ * processed, so new streams are accepted throughout.
+ **/
+Status http2_serve(Request *r, bool upgrade)
+{
+    static const char Switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    static const uint8_t Settings[] = {
+        0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS,
+    };
+    H2Connection *c = calloc(1, sizeof(H2Connection));
+    const char *preface;
+    char buffer[sizeof(H2Preface)];
+
+    if (!c)
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+
+    log("Handling HTTP/2 connection (%s)", upgrade ? "upgrade" : "prior knowledge");
+
+    c->conn = r;
+    c->max_frame_size = H2_FRAME_SIZE;
+    c->initial_window = H2_WINDOW_SIZE;
+    c->send_window = H2_WINDOW_SIZE;
+    c->encoder_limit = HPACK_TABLE_SIZE;
+    hpack_table_init(&c->decoder, HPACK_TABLE_SIZE);
+    hpack_table_init(&c->encoder, HPACK_TABLE_SIZE);
+
+    if (upgrade)
+    {
+        /* Apply client settings, switch protocols, and turn the original
+         * request into stream 1 */
+        uint8_t settings[H2_FRAME_SIZE];
+        ssize_t n = h2_base64url_decode(request_header(r, "HTTP2-Settings"), settings, sizeof(settings));
+        struct iovec iov = {(void *)Switching, sizeof(Switching) - 1};
+        H2Stream *s;
+
+        if (n < 0 || h2_settings(c, settings, n) < 0 || r->sink->writev(r, &iov, 1, false) < 0)
+            goto done;
+
+        if (!(s = h2_stream_new(c, 1)))
+            goto done;
+        free(s->request->headers);
+        s->request->method = r->method;
+        s->request->uri = r->uri;
+        s->request->query = r->query;
+        s->request->headers = r->headers;
+        r->method = r->uri = r->query = NULL;
+        r->headers = NULL;
+        s->end_stream = true;
+        c->last_stream = 1;
+        h2_stream_ready(c, s);
+
+        preface = H2Preface;
+    }
+    else
+    {
+        /* Request line and blank line of the preface were already parsed */
+        preface = H2Preface + strlen("PRI * HTTP/2.0\r\n\r\n");
+    }
+
+    if (h2_write_frame(c, FRAME_SETTINGS, 0, 0, Settings, sizeof(Settings)) < 0)
+        goto done;
+
+    if (h2_read(c, buffer, strlen(preface)) < 0 || memcmp(buffer, preface, strlen(preface)))
+    {
+        log("Invalid HTTP/2 connection preface");
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+        goto done;
+    }
+
+    /* Serve ready streams, otherwise read more frames */
+    while (!c->closed)
+    {
+        H2Stream *s = c->ready_head;
+        if (s)
+        {
+            c->ready_head = s->next_ready;
+            if (!c->ready_head)
+                c->ready_tail = NULL;
+            h2_stream_run(c, s);
+            continue;
+        }
+
+        if (c->goaway && !c->nstreams)
+            break;
+        h2_read_frame(c);
+    }
+
+    if (!c->closed)
+        h2_goaway(c, H2_NO_ERROR);
+
+done:
+    while (c->streams)
+        h2_stream_free(c, c->streams);
+    free(c->block);
+    hpack_table_free(&c->decoder);
+    hpack_table_free(&c->encoder);
+    free(c);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
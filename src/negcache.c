@@ -0,0 +1,320 @@
+/* negcache.c: Negative Lookup Cache */
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NEGCACHE_WAYS   4               /* Entries per bucket */
+#define NEGCACHE_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+/**
+ * Table shared by all processes.
+ *
+ * Each entry packs the high 32 bits of the key's hash with the generation
+ * in which it was found missing, so that it is read and written with single
+ * atomic operations.  Bumping the generation invalidates every entry.
+ */
+typedef struct {
+    uint32_t generation;                /*< Current generation */
+    uint32_t padding;
+    uint64_t entries[];                 /*< Buckets of NEGCACHE_WAYS entries */
+} NegativeTable;
+
+/**
+ * SipHash-2-4 state, fed a byte at a time.
+ */
+typedef struct {
+    uint64_t v[4];
+    uint64_t block;                     /*< Bytes not yet compressed */
+    uint64_t length;                    /*< Bytes fed */
+} NegativeHash;
+
+static NegativeTable *Table = NULL;     /* Shared table (NULL if disabled) */
+static uint64_t       HashKey[2];       /* Secret key of SipHash (chosen with the table) */
+static size_t         EntryMask = 0;    /* Number of entries - 1 */
+static int            Inotify = -1;     /* Watches on every directory of every root */
+static bool           Watching = false; /* Whether every directory is watched */
+
+/**
+ * Watch directory and every directory below it.
+ *
+ * @param   path        Buffer holding directory path (extended while recursing).
+ * @param   length      Length of path.
+ * @return  false if a watch could not be added.
+ *
+ * Symbolic links are not followed: a link into the root is covered by the
+ * watch on its target, and lookups never resolve a link out of the root.
+ **/
+static bool negcache_watch(char *path, size_t length)
+{
+    DIR *d;
+    struct dirent *e;
+    bool ok = true;
+
+    if (inotify_add_watch(Inotify, path, NEGCACHE_EVENTS | IN_DONT_FOLLOW) < 0)
+    {
+        log("Unable to watch %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    if (!(d = opendir(path)))
+        return true;                    /* Unreadable: lookups below it fail with EACCES */
+
+    while (ok && (e = readdir(d)))
+    {
+        bool directory = e->d_type == DT_DIR;
+
+        if (streq(e->d_name, ".") || streq(e->d_name, ".."))
+            continue;
+
+        if (e->d_type == DT_UNKNOWN)
+        {
+            struct stat s;
+            directory = fstatat(dirfd(d), e->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(s.st_mode);
+        }
+
+        if (directory && length + 1 + strlen(e->d_name) < PATH_MAX)
+        {
+            path[length] = '/';
+            strcpy(path + length + 1, e->d_name);
+            ok = negcache_watch(path, length + 1 + strlen(e->d_name));
+            path[length] = '\0';
+        }
+    }
+
+    closedir(d);
+    return ok;
+}
+
+/**
+ * Watch document root of virtual host.
+ **/
+static void negcache_watch_root(const VirtualHost *host)
+{
+    char path[PATH_MAX];
+
+    if (!Watching || strlen(host->root) >= sizeof(path))
+        return;
+
+    strcpy(path, host->root);
+    Watching = negcache_watch(path, strlen(path));
+}
+
+#define NEGCACHE_ROTATE(x, b)   (((x) << (b)) | ((x) >> (64 - (b))))
+
+/**
+ * Run SipHash rounds over state.
+ **/
+static void negcache_rounds(uint64_t *v, int rounds)
+{
+    while (rounds--)
+    {
+        v[0] += v[1]; v[1] = NEGCACHE_ROTATE(v[1], 13); v[1] ^= v[0]; v[0] = NEGCACHE_ROTATE(v[0], 32);
+        v[2] += v[3]; v[3] = NEGCACHE_ROTATE(v[3], 16); v[3] ^= v[2];
+        v[0] += v[3]; v[3] = NEGCACHE_ROTATE(v[3], 21); v[3] ^= v[0];
+        v[2] += v[1]; v[1] = NEGCACHE_ROTATE(v[1], 17); v[1] ^= v[2]; v[2] = NEGCACHE_ROTATE(v[2], 32);
+    }
+}
+
+/**
+ * Feed string to hash.
+ **/
+static void negcache_hash(NegativeHash *h, const char *s)
+{
+    for (; *s; s++)
+    {
+        h->block |= (uint64_t)(unsigned char)*s << (8 * (h->length++ % 8));
+        if (h->length % 8 == 0)
+        {
+            h->v[3] ^= h->block;
+            negcache_rounds(h->v, 2);
+            h->v[0] ^= h->block;
+            h->block = 0;
+        }
+    }
+}
+
+/**
+ * Set up negative cache (at startup and on reload).
+ *
+ * The table holds NegativeSlots entries (rounded up to a power of two) and is
+ * mapped once, shared with every process forked afterwards.  inotify watches
+ * are (re)added for every directory of every document root, and the
+ * generation is bumped, since roots may have moved.  If any directory cannot
+ * be watched (see fs.inotify.max_user_watches), the cache is disabled, as it
+ * could not be kept fresh.
+ *
+ * Keys are hashed with SipHash under a random key chosen with the table, so
+ * clients cannot craft a missing URI whose entry matches an existing file.
+ **/
+void negcache_init(void)
+{
+    size_t size = NEGCACHE_WAYS;
+
+    if (NegativeSlots <= 0)
+        return;
+
+    if (!Table)
+    {
+        while (size < (size_t)NegativeSlots)
+            size <<= 1;
+
+        Table = mmap(NULL, sizeof(NegativeTable) + size * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (Table == MAP_FAILED)
+        {
+            log("Unable to map negative cache: %s", strerror(errno));
+            Table = NULL;
+            return;
+        }
+        EntryMask = size - 1;
+
+        if (getrandom(HashKey, sizeof(HashKey), 0) != sizeof(HashKey))
+        {
+            log("Unable to seed negative cache: %s", strerror(errno));
+            munmap(Table, sizeof(NegativeTable) + size * sizeof(uint64_t));
+            Table = NULL;
+            return;
+        }
+    }
+
+    if (Inotify >= 0)
+        close(Inotify);
+    Inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    Watching = Inotify >= 0;
+    vhost_foreach(negcache_watch_root);
+    if (!Watching)
+        log("Negative cache disabled: unable to watch document roots");
+
+    __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Consume pending inotify events.
+ *
+ * Any event means something appeared in a document root, so the generation is
+ * bumped.  New directories (and queue overflows) get the roots rewatched
+ * first, so that nothing created in them goes unnoticed.
+ **/
+static void negcache_drain(void)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    bool rescan = false;
+    ssize_t n;
+
+    while ((n = read(Inotify, buffer, sizeof(buffer))) > 0)
+    {
+        const struct inotify_event *event;
+
+        changed = true;
+        for (char *p = buffer; p < buffer + n; p += sizeof(*event) + event->len)
+        {
+            event = (const struct inotify_event *)p;
+            rescan = rescan || (event->mask & (IN_ISDIR | IN_Q_OVERFLOW));
+        }
+    }
+
+    if (rescan)
+    {
+        vhost_foreach(negcache_watch_root);
+        if (!Watching)
+            log("Negative cache disabled: unable to watch new directory");
+    }
+    if (changed)
+        __atomic_add_fetch(&Table->generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Check whether URI is known to be missing.
+ *
+ * @param   host        Virtual host serving request.
+ * @param   uri         Request URI (without query).
+ * @param   key         Set to key of URI for negcache_insert.
+ * @return  true if the URI was found missing since the document root last
+ * changed.
+ *
+ * The raw URI is the key, so a hit costs a hash and the read(2) that checks
+ * for inotify events.  The generation is sampled before the caller looks the
+ * URI up, so that a file created in between invalidates the entry.
+ **/
+bool negcache_lookup(const VirtualHost *host, const char *uri, NegativeKey *key)
+{
+    NegativeHash h = {
+        .v = {
+            HashKey[0] ^ 0x736f6d6570736575ull, HashKey[1] ^ 0x646f72616e646f6dull,
+            HashKey[0] ^ 0x6c7967656e657261ull, HashKey[1] ^ 0x7465646279746573ull,
+        },
+    };
+    uint64_t hash;
+
+    key->hash = 0;
+    if (!Table || !Watching)
+        return false;
+
+    negcache_drain();
+    if (!Watching)
+        return false;
+
+    negcache_hash(&h, host->root);
+    negcache_hash(&h, "\n");
+    negcache_hash(&h, uri);
+    h.block |= h.length << 56;
+    h.v[3] ^= h.block;
+    negcache_rounds(h.v, 2);
+    h.v[0] ^= h.block;
+    h.v[2] ^= 0xff;
+    negcache_rounds(h.v, 4);
+    hash = h.v[0] ^ h.v[1] ^ h.v[2] ^ h.v[3];
+
+    key->hash = hash | 1;               /* Non-zero: key is valid */
+    key->generation = __atomic_load_n(&Table->generation, __ATOMIC_ACQUIRE);
+
+    uint64_t entry = (key->hash & ~0xFFFFFFFFull) | key->generation;
+    uint64_t *bucket = &Table->entries[key->hash & EntryMask & ~(uint64_t)(NEGCACHE_WAYS - 1)];
+    for (int way = 0; way < NEGCACHE_WAYS; way++)
+    {
+        if (__atomic_load_n(&bucket[way], __ATOMIC_RELAXED) == entry)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Remember that URI is missing.
+ *
+ * @param   key         Key filled by negcache_lookup (before the URI was looked up).
+ *
+ * A stale entry in the bucket is replaced if there is one, and otherwise
+ * one chosen by the hash.
+ **/
+void negcache_insert(const NegativeKey *key)
+{
+    if (!Table || !key->hash)
+        return;
+
+    uint64_t entry = (key->hash & ~0xFFFFFFFFull) | key->generation;
+    uint64_t *bucket = &Table->entries[key->hash & EntryMask & ~(uint64_t)(NEGCACHE_WAYS - 1)];
+    int victim = (key->hash >> 32) & (NEGCACHE_WAYS - 1);
+
+    for (int way = 0; way < NEGCACHE_WAYS; way++)
+    {
+        if ((uint32_t)__atomic_load_n(&bucket[way], __ATOMIC_RELAXED) != key->generation)
+        {
+            victim = way;
+            break;
+        }
+    }
+    __atomic_store_n(&bucket[victim], entry, __ATOMIC_RELAXED);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,860 @@
+/* profile.c: Sampling Profiler and Phase Counters */
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_UNIT        "cycles"
+#else
+#define PROFILE_UNIT        "ns"
+#endif
+
+#define PROFILE_PROCESSES   256         /* Most processes sampled at once */
+#define PROFILE_CPUS        1024        /* Most CPUs sampled on */
+#define PROFILE_PAGES       64          /* Data pages in each sample ring buffer */
+#define PROFILE_DEPTH       64          /* Deepest call chain kept */
+#define PROFILE_POLL        100         /* Milliseconds between draining ring buffers */
+#define PROFILE_SECONDS     60          /* Longest profile */
+
+/* Phase Counters */
+
+typedef struct {
+    uint64_t calls;                     /*< Times phase ran */
+    uint64_t total;                     /*< Cycles spent in phase */
+    uint64_t max;                       /*< Longest run of phase */
+    uint64_t padding[5];                /*< Keep phases on separate cache lines */
+} PhaseCounter;
+
+static const char *PhaseNames[PHASE_COUNT] = {
+    [PHASE_PARSE]    = "parse_request",
+    [PHASE_PATH]     = "determine_request_path",
+    [PHASE_MIMETYPE] = "determine_mimetype",
+    [PHASE_FILE]     = "handle_file_request",
+    [PHASE_BROWSE]   = "handle_browse_request",
+    [PHASE_CGI]      = "handle_cgi_request",
+    [PHASE_ARCHIVE]  = "handle_archive_request",
+    [PHASE_PROXY]    = "handle_proxy_request",
+};
+
+static PhaseCounter *Phases = NULL;     /* Counters shared by all processes */
+
+/* Samples */
+
+typedef struct {
+    uint32_t count;                     /*< Samples with this call chain */
+    uint32_t depth;                     /*< Frames in ips */
+    uint64_t ips[PROFILE_DEPTH];        /*< Call chain (innermost first) */
+} ProfileStack;
+
+typedef struct {
+    ProfileStack **slots;               /*< Open-addressed table of unique stacks */
+    size_t         size;                /*< Number of slots (a power of 2) */
+    size_t         used;                /*< Number of stacks */
+    uint64_t       samples;             /*< Samples recorded */
+    uint64_t       lost;                /*< Samples the kernel dropped */
+} ProfileSamples;
+
+typedef struct {
+    int      fd;                        /*< Event writing to ring buffer */
+    struct perf_event_mmap_page *meta;  /*< Ring buffer control page (NULL if none) */
+    char    *data;                      /*< Ring buffer */
+    size_t   size;                      /*< Size of ring buffer */
+} ProfileBuffer;
+
+typedef struct {
+    ProfileBuffer *buffers;             /*< Ring buffer of each CPU */
+    int            ncpus;
+    int           *events;              /*< Sampling events (one per process and CPU) */
+    size_t         nevents;
+    const char    *event;               /*< Name of event sampled */
+} ProfileSession;
+
+/* Symbols */
+
+typedef struct {
+    uint64_t    value;                  /*< Address of function (in file) */
+    uint64_t    size;                   /*< Size of function */
+    const char *name;                   /*< Name (in mapping) */
+} ProfileSymbol;
+
+typedef struct {
+    uint64_t       start;               /*< Start of executable mapping */
+    uint64_t       end;                 /*< End of mapping */
+    uint64_t       offset;              /*< File offset of mapping */
+    const char    *name;                /*< Base name of file */
+    const Elf64_Ehdr *elf;              /*< File contents (NULL if unreadable) */
+    size_t         length;              /*< Size of file contents */
+    ProfileSymbol *symbols;             /*< Functions sorted by address */
+    size_t         nsymbols;
+    char           path[PATH_MAX];      /*< File mapped */
+} ProfileMapping;
+
+/**
+ * Map phase counters into memory shared with future children.
+ **/
+void profile_init(void)
+{
+    if (Phases)
+        return;
+
+    Phases = mmap(NULL, PHASE_COUNT * sizeof(PhaseCounter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Phases == MAP_FAILED)
+    {
+        log("Unable to map phase counters: %s", strerror(errno));
+        Phases = NULL;
+    }
+}
+
+/**
+ * Start timing a phase.
+ *
+ * @return  Current cycle count, or 0 when profiling is disabled.
+ **/
+uint64_t profile_clock(void)
+{
+    if (!Profile || !Phases)
+        return 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc() | 1;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) | 1;
+#endif
+}
+
+/**
+ * Charge time since start to phase.
+ *
+ * @param   phase       Phase that ran.
+ * @param   start       Value of profile_clock when it started (0 does nothing).
+ *
+ * The time is elapsed (time stamp counter) cycles, so handler phases include
+ * time spent waiting on the client.
+ **/
+void profile_phase(Phase phase, uint64_t start)
+{
+    uint64_t elapsed, max;
+
+    if (!start || !Phases)
+        return;
+
+    elapsed = profile_clock() - start;
+    __atomic_add_fetch(&Phases[phase].calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Phases[phase].total, elapsed, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&Phases[phase].max, __ATOMIC_RELAXED);
+    while (elapsed > max && !__atomic_compare_exchange_n(&Phases[phase].max, &max, elapsed, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Return value of query parameter as a number (or fallback if absent).
+ **/
+static long profile_param(const char *query, const char *name, long fallback)
+{
+    size_t length = strlen(name);
+
+    for (const char *p = query; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL)
+    {
+        if (!strncmp(p, name, length) && p[length] == '=')
+            return strtol(p + length + 1, NULL, 10);
+    }
+    return fallback;
+}
+
+/**
+ * Read process group and start of text of process.
+ *
+ * @return  true if /proc/<pid>/stat could be read.
+ **/
+static bool profile_stat(pid_t pid, pid_t *pgrp, unsigned long *startcode)
+{
+    char path[64], buffer[1024];
+    char *p;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+    n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buffer[n] = '\0';
+
+    /* Fields after the command name: state (3), ppid, pgrp (5), ... startcode (26) */
+    if (!(p = strrchr(buffer, ')')))
+        return false;
+    p++;
+    for (int field = 3; field <= 26 && p; field++)
+    {
+        while (*p == ' ')
+            p++;
+        if (field == 5)
+            *pgrp = strtol(p, NULL, 10);
+        if (field == 26)
+        {
+            *startcode = strtoul(p, NULL, 10);
+            return true;
+        }
+        p = strchr(p, ' ');
+    }
+    return false;
+}
+
+/**
+ * Find processes of this server.
+ *
+ * @param   pids        Set to processes found.
+ * @param   max         Size of pids.
+ * @return  Number of processes found.
+ *
+ * These are the processes in our process group running the same image at
+ * the same address: the supervisor, workers, and forked children.  CGI
+ * scripts (another image) and servers of another generation (exec'd on
+ * upgrade, so loaded elsewhere) are left out, which also means our own
+ * memory map symbolizes every sample.
+ **/
+static size_t profile_targets(pid_t *pids, size_t max)
+{
+    pid_t pgrp = getpgrp(), group;
+    unsigned long text = 0, start;
+    size_t n = 0;
+    DIR *d;
+    struct dirent *e;
+
+    if (!profile_stat(getpid(), &group, &text) || !(d = opendir("/proc")))
+        return 0;
+
+    while (n < max && (e = readdir(d)))
+    {
+        pid_t pid = strtol(e->d_name, NULL, 10);
+        if (pid > 0 && profile_stat(pid, &group, &start) && group == pgrp && start == text)
+            pids[n++] = pid;
+    }
+    closedir(d);
+    return n;
+}
+
+/**
+ * Start sampling process on CPU.
+ *
+ * @param   session     Sampling session.
+ * @param   pid         Process to sample (and children it forks from now on).
+ * @param   cpu         CPU to sample it on.
+ * @param   frequency   Samples per second.
+ * @return  true on success.
+ *
+ * CPU cycles are sampled when the machine exposes them, and otherwise CPU
+ * time (as in virtual machines without a PMU).  Only user space is sampled,
+ * which perf_event_paranoid allows up to 2.  Events are inherited by
+ * children, but removed when they exec (Linux 5.13) so CGI scripts are not
+ * misattributed.
+ *
+ * The kernel only maps ring buffers of inherited events bound to a CPU, so
+ * there is an event per process and CPU.  The first event on each CPU gets
+ * the ring buffer, and the others write to it (PERF_EVENT_IOC_SET_OUTPUT).
+ **/
+static bool profile_open(ProfileSession *session, pid_t pid, int cpu, int frequency)
+{
+    static const struct { uint32_t type; uint64_t config; const char *name; } Events[] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK,  "cpu-clock"},
+    };
+    ProfileBuffer *buffer = &session->buffers[cpu];
+    struct perf_event_attr attr;
+    size_t page = getpagesize();
+    int fd = -1;
+
+    for (size_t i = 0; i < sizeof(Events) / sizeof(Events[0]) && fd < 0; i++)
+    {
+        /* Stick with the event that worked for the first process */
+        if (session->nevents > 0 && !streq(Events[i].name, session->event))
+            continue;
+
+        for (int remove_on_exec = 1; remove_on_exec >= 0 && fd < 0; remove_on_exec--)
+        {
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = Events[i].type;
+            attr.config = Events[i].config;
+            attr.sample_freq = frequency;
+            attr.freq = 1;
+            attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+            attr.sample_max_stack = PROFILE_DEPTH;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.exclude_callchain_kernel = 1;
+            attr.remove_on_exec = remove_on_exec;
+
+            fd = syscall(SYS_perf_event_open, &attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+            session->event = Events[i].name;
+        }
+    }
+    if (fd < 0)
+        return false;
+
+    if (buffer->meta)
+    {
+        if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, buffer->fd) < 0)
+        {
+            close(fd);
+            return false;
+        }
+    }
+    else
+    {
+        void *meta = mmap(NULL, (PROFILE_PAGES + 1) * page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (meta == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        buffer->fd = fd;
+        buffer->meta = meta;
+        buffer->data = (char *)meta + page;
+        buffer->size = PROFILE_PAGES * page;
+    }
+    session->events[session->nevents++] = fd;
+    return true;
+}
+
+/**
+ * Record call chain in sample table.
+ **/
+static void profile_record(ProfileSamples *samples, const uint64_t *ips, uint64_t nr)
+{
+    uint64_t chain[PROFILE_DEPTH];
+    uint32_t depth = 0;
+    uint64_t hash = 14695981039346656037ull;
+
+    /* Drop context markers (PERF_CONTEXT_USER and friends) */
+    for (uint64_t i = 0; i < nr && depth < PROFILE_DEPTH; i++)
+    {
+        if (ips[i] >= (uint64_t)PERF_CONTEXT_MAX)
+            continue;
+        chain[depth++] = ips[i];
+        hash = (hash ^ ips[i]) * 1099511628211ull;
+    }
+    if (depth == 0)
+        return;
+    samples->samples++;
+
+    /* Grow table at half full */
+    if (samples->used * 2 >= samples->size)
+    {
+        size_t size = samples->size ? samples->size * 2 : 1024;
+        ProfileStack **slots = calloc(size, sizeof(ProfileStack *));
+        if (!slots)
+            return;
+        for (size_t i = 0; i < samples->size; i++)
+        {
+            ProfileStack *stack = samples->slots[i];
+            if (!stack)
+                continue;
+            uint64_t h = 14695981039346656037ull;
+            for (uint32_t j = 0; j < stack->depth; j++)
+                h = (h ^ stack->ips[j]) * 1099511628211ull;
+            size_t slot = h & (size - 1);
+            while (slots[slot])
+                slot = (slot + 1) & (size - 1);
+            slots[slot] = stack;
+        }
+        free(samples->slots);
+        samples->slots = slots;
+        samples->size = size;
+    }
+
+    size_t slot = hash & (samples->size - 1);
+    for (ProfileStack *stack; (stack = samples->slots[slot]); slot = (slot + 1) & (samples->size - 1))
+    {
+        if (stack->depth == depth && !memcmp(stack->ips, chain, depth * sizeof(uint64_t)))
+        {
+            stack->count++;
+            return;
+        }
+    }
+
+    ProfileStack *stack = malloc(sizeof(ProfileStack));
+    if (!stack)
+        return;
+    stack->count = 1;
+    stack->depth = depth;
+    memcpy(stack->ips, chain, depth * sizeof(uint64_t));
+    samples->slots[slot] = stack;
+    samples->used++;
+}
+
+/**
+ * Consume samples in ring buffer.
+ **/
+static void profile_drain(ProfileBuffer *s, ProfileSamples *samples)
+{
+    uint64_t head = __atomic_load_n(&s->meta->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = s->meta->data_tail;
+    union {
+        struct perf_event_header header;
+        uint64_t words[(sizeof(struct perf_event_header) + 16 + 8 * (PERF_MAX_STACK_DEPTH + 8)) / 8];
+    } record;
+
+    while (tail + sizeof(struct perf_event_header) <= head)
+    {
+        /* Copy record out (it may wrap around the end of the buffer) */
+        size_t at = tail % s->size;
+        size_t first;
+        const struct perf_event_header *header = (const void *)(s->data + at);
+        size_t size = header->size;
+
+        if (at + sizeof(*header) > s->size)
+        {
+            memcpy(&record, s->data + at, s->size - at);
+            memcpy((char *)&record + (s->size - at), s->data, sizeof(*header) - (s->size - at));
+            size = record.header.size;
+        }
+        if (size < sizeof(*header) || tail + size > head)
+            break;
+
+        if (size <= sizeof(record))
+        {
+            first = s->size - at < size ? s->size - at : size;
+            memcpy(&record, s->data + at, first);
+            memcpy((char *)&record + first, s->data, size - first);
+
+            if (record.header.type == PERF_RECORD_SAMPLE)
+            {
+                /* u32 pid, tid; u64 nr; u64 ips[nr] */
+                uint64_t nr = record.words[2];
+                if (24 + nr * 8 <= size)
+                    profile_record(samples, &record.words[3], nr);
+            }
+            else if (record.header.type == PERF_RECORD_LOST)
+            {
+                samples->lost += record.words[2];
+            }
+        }
+        tail += size;
+    }
+
+    __atomic_store_n(&s->meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Compare symbols by address.
+ **/
+static int profile_compare_symbols(const void *a, const void *b)
+{
+    const ProfileSymbol *x = a, *y = b;
+    return x->value < y->value ? -1 : x->value > y->value;
+}
+
+/**
+ * Load function symbols of mapped ELF file.
+ *
+ * The full symbol table is used if the file has one, and otherwise the
+ * dynamic symbols (as in stripped shared libraries).
+ **/
+static void profile_symbols(ProfileMapping *m)
+{
+    struct stat st;
+    const Elf64_Shdr *sections, *table = NULL;
+    int fd;
+
+    if ((fd = open(m->path, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr) ||
+        (m->elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        m->elf = NULL;
+        close(fd);
+        return;
+    }
+    close(fd);
+    m->length = st.st_size;
+
+    if (memcmp(m->elf->e_ident, ELFMAG, SELFMAG) || m->elf->e_ident[EI_CLASS] != ELFCLASS64 ||
+        m->elf->e_shoff + (uint64_t)m->elf->e_shnum * sizeof(Elf64_Shdr) > m->length)
+        return;
+
+    sections = (const Elf64_Shdr *)((const char *)m->elf + m->elf->e_shoff);
+    for (int i = 0; i < m->elf->e_shnum; i++)
+    {
+        if (sections[i].sh_type == SHT_SYMTAB || (sections[i].sh_type == SHT_DYNSYM && !table))
+            table = &sections[i];
+    }
+    if (!table || table->sh_link >= m->elf->e_shnum ||
+        table->sh_offset + table->sh_size > m->length || sections[table->sh_link].sh_offset + sections[table->sh_link].sh_size > m->length)
+        return;
+
+    const Elf64_Sym *symbols = (const Elf64_Sym *)((const char *)m->elf + table->sh_offset);
+    const char *strings = (const char *)m->elf + sections[table->sh_link].sh_offset;
+    size_t count = table->sh_size / sizeof(Elf64_Sym);
+
+    if (!(m->symbols = calloc(count, sizeof(ProfileSymbol))))
+        return;
+    for (size_t i = 0; i < count; i++)
+    {
+        int type = ELF64_ST_TYPE(symbols[i].st_info);
+        if ((type == STT_FUNC || type == STT_GNU_IFUNC) && symbols[i].st_value &&
+            symbols[i].st_name < sections[table->sh_link].sh_size)
+        {
+            m->symbols[m->nsymbols++] = (ProfileSymbol){symbols[i].st_value, symbols[i].st_size, strings + symbols[i].st_name};
+        }
+    }
+    qsort(m->symbols, m->nsymbols, sizeof(ProfileSymbol), profile_compare_symbols);
+}
+
+/**
+ * Read executable mappings of this process.
+ *
+ * @param   count       Set to number of mappings.
+ * @return  Mappings (symbols are loaded when first needed), or NULL.
+ **/
+static ProfileMapping *profile_mappings(size_t *count)
+{
+    ProfileMapping *mappings = NULL, *m;
+    char line[PATH_MAX + 128], permissions[8], path[PATH_MAX];
+    unsigned long start, end, offset;
+    FILE *fs = fopen("/proc/self/maps", "re");
+
+    *count = 0;
+    if (!fs)
+        return NULL;
+
+    while (fgets(line, sizeof(line), fs))
+    {
+        path[0] = '\0';
+        if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %4095s", &start, &end, permissions, &offset, path) < 4 ||
+            permissions[2] != 'x' || path[0] != '/')
+            continue;
+        if (!(m = realloc(mappings, (*count + 1) * sizeof(ProfileMapping))))
+            break;
+        mappings = m;
+        m = &mappings[(*count)++];
+        memset(m, 0, sizeof(*m));
+        m->start = start;
+        m->end = end;
+        m->offset = offset;
+        strcpy(m->path, path);
+    }
+    fclose(fs);
+
+    /* Point names at the mappings' own paths (the array has moved) */
+    for (size_t i = 0; i < *count; i++)
+        mappings[i].name = strrchr(mappings[i].path, '/') + 1;
+    return mappings;
+}
+
+/**
+ * Write name of function containing address to buffer.
+ *
+ * @return  Length of name (truncated to fit).
+ **/
+static size_t profile_symbolize_name(ProfileMapping *mappings, size_t count, uint64_t address, char *buffer, size_t size)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        ProfileMapping *m = &mappings[i];
+        if (address < m->start || address >= m->end)
+            continue;
+
+        /* Translate file offset to address in file */
+        if (!m->elf && !m->symbols)
+            profile_symbols(m);
+        if (m->elf && m->symbols && m->elf->e_phoff + (uint64_t)m->elf->e_phnum * sizeof(Elf64_Phdr) <= m->length)
+        {
+            const Elf64_Phdr *segments = (const Elf64_Phdr *)((const char *)m->elf + m->elf->e_phoff);
+            uint64_t offset = address - m->start + m->offset;
+            for (int j = 0; j < m->elf->e_phnum; j++)
+            {
+                if (segments[j].p_type != PT_LOAD || offset < segments[j].p_offset || offset >= segments[j].p_offset + segments[j].p_filesz)
+                    continue;
+
+                uint64_t value = offset - segments[j].p_offset + segments[j].p_vaddr;
+                size_t lo = 0, hi = m->nsymbols;
+                while (lo < hi)
+                {
+                    size_t mid = (lo + hi) / 2;
+                    if (m->symbols[mid].value <= value)
+                        lo = mid + 1;
+                    else
+                        hi = mid;
+                }
+                if (lo > 0 && (m->symbols[lo - 1].size == 0 || value < m->symbols[lo - 1].value + m->symbols[lo - 1].size))
+                    return snprintf(buffer, size, "%s", m->symbols[lo - 1].name);
+                break;
+            }
+        }
+        return snprintf(buffer, size, "[%s]", m->name);
+    }
+    return snprintf(buffer, size, "[unknown]");
+}
+
+static size_t profile_symbolize(ProfileMapping *mappings, size_t count, uint64_t address, char *buffer, size_t size)
+{
+    size_t n = profile_symbolize_name(mappings, count, address, buffer, size);
+    return n < size ? n : size - 1;
+}
+
+/**
+ * Compare folded stack lines by text.
+ **/
+static int profile_compare_lines(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Sleep between draining ring buffers (yielding in a coroutine).
+ **/
+static void profile_sleep(int milliseconds)
+{
+    if (coroutine_self())
+        coroutine_wait(-1, 0, now_ms() + milliseconds);
+    else
+        poll(NULL, 0, milliseconds);
+}
+
+/**
+ * Sample server and write folded stacks.
+ **/
+static Status profile_samples(Request *r)
+{
+    pid_t pids[PROFILE_PROCESSES];
+    ProfileSession session = {0};
+    ProfileSamples samples = {0};
+    size_t nprocesses = 0, nmappings = 0, nlines = 0;
+    long seconds = profile_param(r->query, "seconds", 5);
+    long frequency = profile_param(r->query, "frequency", 99);
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    char header[128];
+    Response response;
+
+    if (seconds < 1 || seconds > PROFILE_SECONDS || frequency < 1 || frequency > 10000)
+        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+
+    /* Sampling waits for seconds: only a coroutine or a forked child can
+     * wait without holding up the clients of this process */
+    if (!coroutine_self() && !forking_child())
+    {
+        log("Unable to profile: single mode would stop serving while sampling");
+        return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+    }
+
+    session.ncpus = ncpus < 1 ? 1 : ncpus > PROFILE_CPUS ? PROFILE_CPUS : ncpus;
+    session.buffers = calloc(session.ncpus, sizeof(ProfileBuffer));
+    session.events = calloc((size_t)session.ncpus * PROFILE_PROCESSES, sizeof(int));
+    session.event = "none";
+    if (!session.buffers || !session.events)
+    {
+        free(session.buffers);
+        free(session.events);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Sample every process of the server on every CPU (offline ones fail) */
+    size_t npids = profile_targets(pids, PROFILE_PROCESSES);
+    for (size_t i = 0; i < npids; i++)
+    {
+        bool sampled = false;
+        for (int cpu = 0; cpu < session.ncpus; cpu++)
+            sampled |= profile_open(&session, pids[i], cpu, frequency);
+        if (sampled)
+            nprocesses++;
+        else
+            debug("Unable to sample process %d: %s", pids[i], strerror(errno));
+    }
+    if (nprocesses == 0)
+    {
+        log("Unable to sample server: %s", strerror(errno));
+        free(session.buffers);
+        free(session.events);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    log("Profiling %zu processes for %ld seconds at %ld Hz (%s)", nprocesses, seconds, frequency, session.event);
+    for (size_t i = 0; i < session.nevents; i++)
+        ioctl(session.events[i], PERF_EVENT_IOC_ENABLE, 0);
+    for (uint64_t end = now_ms() + seconds * 1000; now_ms() < end; )
+    {
+        profile_sleep(PROFILE_POLL);
+        for (int cpu = 0; cpu < session.ncpus; cpu++)
+            if (session.buffers[cpu].meta)
+                profile_drain(&session.buffers[cpu], &samples);
+    }
+    for (size_t i = 0; i < session.nevents; i++)
+        ioctl(session.events[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (int cpu = 0; cpu < session.ncpus; cpu++)
+    {
+        if (!session.buffers[cpu].meta)
+            continue;
+        profile_drain(&session.buffers[cpu], &samples);
+        munmap(session.buffers[cpu].meta, session.buffers[cpu].size + getpagesize());
+    }
+    for (size_t i = 0; i < session.nevents; i++)
+        close(session.events[i]);
+    free(session.buffers);
+    free(session.events);
+
+    /* Fold each stack into "comm;outermost;...;innermost count" */
+    ProfileMapping *mappings = profile_mappings(&nmappings);
+    char **lines = calloc(samples.used + 1, sizeof(char *));
+    for (size_t i = 0; lines && i < samples.size; i++)
+    {
+        ProfileStack *stack = samples.slots[i];
+        char line[PROFILE_DEPTH * 128], *p = line;
+        if (!stack)
+            continue;
+
+        p += snprintf(p, 64, "spidey");
+        for (uint32_t j = stack->depth; j-- > 0; )
+        {
+            *p++ = ';';
+            /* Return addresses point past the call: look up the call itself */
+            p += profile_symbolize(mappings, nmappings, stack->ips[j] - (j > 0), p, 120);
+        }
+        snprintf(p, 24, " %u", stack->count);
+        lines[nlines++] = strdup(line);
+        free(stack);
+    }
+    free(samples.slots);
+    for (size_t i = 0; i < nmappings; i++)
+    {
+        free(mappings[i].symbols);
+        if (mappings[i].elf)
+            munmap((void *)mappings[i].elf, mappings[i].length);
+    }
+    free(mappings);
+
+    /* Stacks differing only in addresses fold into the same line: merge them */
+    if (lines)
+        qsort(lines, nlines, sizeof(char *), profile_compare_lines);
+
+    response_init(&response, HTTP_STATUS_OK);
+    response_content_type(&response, "text/plain");
+    response_header(&response, header, snprintf(header, sizeof(header),
+                    "X-Profile: event=%s processes=%zu samples=%lu lost=%lu\r\n",
+                    session.event, nprocesses, (unsigned long)samples.samples, (unsigned long)samples.lost));
+    response_body(&response, NULL, 0);
+    bool failed = response_send(r, &response, true) < 0;
+
+    for (size_t i = 0; i < nlines; )
+    {
+        char *count = strrchr(lines[i], ' ');
+        size_t stem = count - lines[i];
+        unsigned long total = 0;
+        size_t j = i;
+
+        for (; j < nlines && !strncmp(lines[j], lines[i], stem + 1) && !strchr(lines[j] + stem + 1, ' '); j++)
+            total += strtoul(lines[j] + stem + 1, NULL, 10);
+
+        char out[32];
+        int n = snprintf(out, sizeof(out), " %lu\n", total);
+        if (!failed && (response_write(r, lines[i], stem) < 0 || response_write(r, out, n) < 0))
+            failed = true;
+        for (; i < j; i++)
+            free(lines[i]);
+    }
+    free(lines);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Write phase counters.
+ **/
+static Status profile_phases(Request *r)
+{
+    char body[2048];
+    size_t length = 0;
+    Response response;
+
+    length += snprintf(body + length, sizeof(body) - length, "%-24s %12s %16s %12s %12s\n",
+                       "phase", "calls", "total_" PROFILE_UNIT, "mean", "max");
+    for (int i = 0; i < PHASE_COUNT && Phases; i++)
+    {
+        uint64_t calls = __atomic_load_n(&Phases[i].calls, __ATOMIC_RELAXED);
+        uint64_t total = __atomic_load_n(&Phases[i].total, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&Phases[i].max, __ATOMIC_RELAXED);
+        length += snprintf(body + length, sizeof(body) - length, "%-24s %12lu %16lu %12lu %12lu\n",
+                           PhaseNames[i], (unsigned long)calls, (unsigned long)total,
+                           (unsigned long)(calls ? total / calls : 0), (unsigned long)max);
+    }
+
+    if (profile_param(r->query, "reset", 0) && Phases)
+        memset(Phases, 0, PHASE_COUNT * sizeof(PhaseCounter));
+
+    response_init(&response, HTTP_STATUS_OK);
+    response_content_type(&response, "text/plain");
+    response_content_length(&response, length);
+    response_body(&response, body, length);
+    response_send(r, &response, false);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Return whether client is on this machine (loopback address).
+ **/
+static bool profile_admin(const Request *r)
+{
+    if (r->addr.ss_family == AF_INET)
+        return (ntohl(((const struct sockaddr_in *)&r->addr)->sin_addr.s_addr) >> 24) == 127;
+
+    if (r->addr.ss_family == AF_INET6)
+    {
+        const struct in6_addr *a = &((const struct sockaddr_in6 *)&r->addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return false;
+}
+
+/**
+ * Handle request for profiler endpoint.
+ *
+ * @param   r           HTTP Request structure (URI under PROFILE_PREFIX).
+ * @return  Status of the HTTP request.
+ *
+ * Only clients on loopback addresses are served; others get 404, as if the
+ * endpoint did not exist.
+ *
+ * - PROFILE_PREFIX "profile?seconds=5&frequency=99" samples every process of
+ *   the server and returns folded stacks (one "frame;frame;... count" line
+ *   per stack, outermost frame first), as flamegraph.pl reads them.  It is
+ *   refused (503) in single mode, where waiting would stop the server.
+ * - PROFILE_PREFIX "phases" returns the phase counters ("?reset=1" clears
+ *   them after reporting).
+ **/
+Status handle_profile_request(Request *r)
+{
+    const char *name = r->uri + sizeof(PROFILE_PREFIX) - 1;
+
+    if (!profile_admin(r))
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+
+    if (streq(name, "profile"))
+        return profile_samples(r);
+    if (streq(name, "phases"))
+        return profile_phases(r);
+    return handle_error(r, HTTP_STATUS_NOT_FOUND);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,675 @@
+/* proxy.c: Reverse Proxy Handler */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PROXY_ROUTES        16          /* Maximum number of -P routes */
+#define PROXY_UPSTREAMS     8           /* Maximum upstreams per route */
+#define PROXY_POOL_MAX      64          /* Maximum idle connections per upstream */
+#define PROXY_RETRY_DELAY   5000        /* Milliseconds a failed upstream is skipped */
+
+/**
+ * Balancing state shared by all processes (mapped before forking)
+ */
+typedef struct {
+    size_t   active[PROXY_UPSTREAMS];   /*< In-flight requests per upstream */
+    uint64_t down_until[PROXY_UPSTREAMS]; /*< Skip upstream until this time */
+    size_t   next;                      /*< Rotates ties between upstreams */
+} ProxyShared;
+
+typedef struct {
+    char     name[NI_MAXHOST + NI_MAXSERV]; /*< host:port as configured */
+    struct sockaddr_storage addr;       /*< Resolved address */
+    socklen_t addrlen;                  /*< Length of address */
+    int      idle[PROXY_POOL_MAX];      /*< Pooled keep-alive connections */
+    size_t   nidle;                     /*< Number of pooled connections */
+} Upstream;
+
+struct proxy_route {
+    char        *prefix;                /*< URI prefix */
+    size_t       length;                /*< Length of prefix */
+    Upstream     upstreams[PROXY_UPSTREAMS]; /*< Configured upstreams */
+    size_t       nupstreams;            /*< Number of upstreams */
+    ProxyShared *shared;                /*< Shared balancing state */
+};
+
+/**
+ * Connection to upstream for one proxied request
+ */
+typedef struct {
+    ProxyRoute *route;                  /*< Route being served */
+    size_t      index;                  /*< Index of upstream in route */
+    int         fd;                     /*< Upstream socket */
+    bool        reused;                 /*< Whether fd came from the pool */
+    char        buffer[BUFSIZ];         /*< Buffered upstream input */
+    size_t      start;                  /*< Offset of unread input */
+    size_t      end;                    /*< Offset past buffered input */
+} ProxyConnection;
+
+static ProxyRoute Routes[PROXY_ROUTES];
+static size_t     NRoutes = 0;
+
+/* Hop-by-hop headers are never forwarded in either direction */
+static const char *HopByHop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", NULL,
+};
+
+static bool proxy_hop_by_hop(const char *name, size_t length)
+{
+    for (const char **h = HopByHop; *h; h++)
+    {
+        if (strlen(*h) == length && !strncasecmp(*h, name, length))
+            return true;
+    }
+    return false;
+}
+
+/* Configuration */
+
+/**
+ * Resolve "host:port" (or "[v6address]:port") into upstream.
+ **/
+static bool proxy_resolve(Upstream *u, const char *spec)
+{
+    char host[NI_MAXHOST];
+    const char *port = strrchr(spec, ':');
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *results;
+    size_t length;
+    int status;
+
+    if (!port || port == spec || (length = port - spec) >= sizeof(host))
+        return false;
+
+    if (spec[0] == '[' && port[-1] == ']')
+    {
+        memcpy(host, spec + 1, length - 2);
+        host[length - 2] = '\0';
+    }
+    else
+    {
+        memcpy(host, spec, length);
+        host[length] = '\0';
+    }
+
+    if ((status = getaddrinfo(host, port + 1, &hints, &results)) != 0)
+    {
+        log("Unable to resolve upstream %s: %s", spec, gai_strerror(status));
+        return false;
+    }
+
+    memcpy(&u->addr, results->ai_addr, results->ai_addrlen);
+    u->addrlen = results->ai_addrlen;
+    snprintf(u->name, sizeof(u->name), "%s", spec);
+    freeaddrinfo(results);
+    return true;
+}
+
+/**
+ * Add proxy route.
+ *
+ * @param   spec        String of the form prefix=host:port[,host:port...].
+ * @return  true if the route was parsed and its upstreams resolved.
+ *
+ * This must be called before the server forks, so that every process shares
+ * the same balancing state.
+ **/
+bool proxy_add_route(const char *spec)
+{
+    const char *equal = strchr(spec, '=');
+    ProxyRoute *route = &Routes[NRoutes];
+    char *upstreams;
+    char *saveptr;
+
+    if (!equal || equal == spec || spec[0] != '/' || NRoutes >= PROXY_ROUTES)
+        return false;
+
+    route->shared = mmap(NULL, sizeof(ProxyShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (route->shared == MAP_FAILED)
+        return false;
+
+    route->prefix = strndup(spec, equal - spec);
+    route->length = equal - spec;
+    route->nupstreams = 0;
+    upstreams = strdup(equal + 1);
+
+    for (char *u = strtok_r(upstreams, ",", &saveptr); u; u = strtok_r(NULL, ",", &saveptr))
+    {
+        if (route->nupstreams >= PROXY_UPSTREAMS || !proxy_resolve(&route->upstreams[route->nupstreams], u))
+        {
+            free(upstreams);
+            return false;
+        }
+        route->nupstreams++;
+    }
+
+    free(upstreams);
+    if (route->nupstreams == 0)
+        return false;
+
+    /* Strip trailing slash so "/api/" and "/api" match the same URIs */
+    if (route->length > 1 && route->prefix[route->length - 1] == '/')
+        route->prefix[--route->length] = '\0';
+
+    NRoutes++;
+    return true;
+}
+
+/**
+ * Find proxy route for URI.
+ *
+ * @param   uri         Request URI (without query).
+ * @return  Route with the longest prefix matching uri, or NULL.
+ *
+ * A prefix only matches at a path segment boundary, so "/api" matches "/api"
+ * and "/api/users" but not "/apix".
+ **/
+ProxyRoute *proxy_route(const char *uri)
+{
+    ProxyRoute *best = NULL;
+
+    for (size_t i = 0; i < NRoutes; i++)
+    {
+        ProxyRoute *route = &Routes[i];
+
+        if (strncmp(uri, route->prefix, route->length) ||
+            (route->length > 1 && uri[route->length] != '\0' && uri[route->length] != '/'))
+            continue;
+        if (!best || route->length > best->length)
+            best = route;
+    }
+    return best;
+}
+
+/* Upstream Connections */
+
+/**
+ * Choose upstream with the fewest in-flight requests.
+ *
+ * Upstreams that recently failed are skipped unless every upstream has.  Ties
+ * are broken by rotating the starting point.
+ **/
+static size_t proxy_select(ProxyRoute *route, uint64_t now)
+{
+    ProxyShared *shared = route->shared;
+    size_t start = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED);
+    size_t best = route->nupstreams;
+
+    for (int pass = 0; pass < 2 && best == route->nupstreams; pass++)
+    {
+        for (size_t n = 0; n < route->nupstreams; n++)
+        {
+            size_t i = (start + n) % route->nupstreams;
+            if (pass == 0 && __atomic_load_n(&shared->down_until[i], __ATOMIC_RELAXED) > now)
+                continue;
+            if (best == route->nupstreams ||
+                __atomic_load_n(&shared->active[i], __ATOMIC_RELAXED) < __atomic_load_n(&shared->active[best], __ATOMIC_RELAXED))
+                best = i;
+        }
+    }
+    return best;
+}
+
+/**
+ * Wait for upstream socket readiness.
+ *
+ * @return  0 when ready, -1 on error or after ProxyTimeout seconds.
+ *
+ * In a coroutine (event mode), other clients are served while waiting.
+ **/
+static int proxy_wait(int fd, short events)
+{
+    struct pollfd pfd = {.fd = fd, .events = events};
+    int n;
+
+    if (coroutine_self())
+        n = coroutine_wait(fd, events, now_ms() + ProxyTimeout * 1000ULL);
+    else
+        while ((n = poll(&pfd, 1, ProxyTimeout * 1000)) < 0 && errno == EINTR)
+            ;
+    if (n == 0)
+        errno = ETIMEDOUT;
+    return n > 0 ? 0 : -1;
+}
+
+/**
+ * Open connection to upstream, preferring a pooled keep-alive connection.
+ *
+ * @return  0 on success, -1 if a new connection could not be established.
+ *
+ * Pooled connections that the upstream has since closed (or that have stray
+ * data pending) are discarded before a fresh connection is made.
+ **/
+static int proxy_connect(ProxyConnection *c)
+{
+    Upstream *u = &c->route->upstreams[c->index];
+    int error = 0;
+    socklen_t length = sizeof(error);
+    int on = 1;
+    char byte;
+
+    c->start = c->end = 0;
+    while (u->nidle > 0)
+    {
+        c->fd = u->idle[--u->nidle];
+        if (recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            c->reused = true;
+            return 0;
+        }
+        close(c->fd);
+    }
+
+    c->reused = false;
+    c->fd = socket(u->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+        return -1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(c->fd, (struct sockaddr *)&u->addr, u->addrlen) < 0)
+    {
+        if (errno != EINPROGRESS || proxy_wait(c->fd, POLLOUT) < 0 ||
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error)
+        {
+            if (error)
+                errno = error;
+            log("Unable to connect to upstream %s: %s", u->name, strerror(errno));
+            close(c->fd);
+            c->fd = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Return connection to pool (if reusable) or close it.
+ **/
+static void proxy_release(ProxyConnection *c, bool reusable)
+{
+    Upstream *u = &c->route->upstreams[c->index];
+    size_t limit = ProxyPoolSize < PROXY_POOL_MAX ? ProxyPoolSize : PROXY_POOL_MAX;
+
+    if (c->fd < 0)
+        return;
+    if (reusable && c->start == c->end && u->nidle < limit)
+        u->idle[u->nidle++] = c->fd;
+    else
+        close(c->fd);
+    c->fd = -1;
+}
+
+/**
+ * Write all of buffer to upstream.
+ **/
+static int proxy_send(ProxyConnection *c, const void *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = send(c->fd, buffer, length, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && proxy_wait(c->fd, POLLOUT) == 0))
+                continue;
+            return -1;
+        }
+        buffer = (const char *)buffer + n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Read more upstream input into connection buffer.
+ *
+ * @return  Number of bytes read, 0 on end-of-file, -1 on error or timeout.
+ **/
+static ssize_t proxy_fill(ProxyConnection *c)
+{
+    if (c->start == c->end)
+        c->start = c->end = 0;
+
+    while (true)
+    {
+        ssize_t n = recv(c->fd, c->buffer + c->end, sizeof(c->buffer) - c->end, 0);
+        if (n >= 0)
+        {
+            c->end += n;
+            return n;
+        }
+        if (errno == EINTR)
+            continue;
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || proxy_wait(c->fd, POLLIN) < 0)
+            return -1;
+    }
+}
+
+/**
+ * Read line (up to and including newline) from upstream.
+ **/
+static char *proxy_gets(ProxyConnection *c, char *buffer, size_t size)
+{
+    size_t length = 0;
+
+    while (length + 1 < size)
+    {
+        if (c->start == c->end && proxy_fill(c) <= 0)
+            return NULL;
+
+        buffer[length++] = c->buffer[c->start++];
+        if (buffer[length - 1] == '\n')
+            break;
+    }
+    buffer[length] = '\0';
+    return buffer;
+}
+
+/**
+ * Copy length bytes (or until end-of-file if length is SIZE_MAX) of upstream
+ * body to client.
+ *
+ * @return  0 on success, -1 on error (or premature end-of-file).
+ **/
+static int proxy_copy(ProxyConnection *c, Request *r, size_t length)
+{
+    while (length > 0)
+    {
+        if (c->start == c->end)
+        {
+            ssize_t n = proxy_fill(c);
+            if (n == 0 && length == SIZE_MAX)
+                return 0;
+            if (n <= 0)
+                return -1;
+        }
+
+        size_t n = c->end - c->start < length ? c->end - c->start : length;
+        if (response_write(r, c->buffer + c->start, n) < 0)
+            return -1;
+        c->start += n;
+        if (length != SIZE_MAX)
+            length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Copy chunked upstream body to client, removing the chunk framing.
+ *
+ * @return  0 on success, -1 on error.
+ *
+ * The client connection is closed after the response, which delimits the
+ * body for HTTP/1 clients; the HTTP/2 layer ends the stream instead.
+ **/
+static int proxy_copy_chunked(ProxyConnection *c, Request *r)
+{
+    char line[BUFSIZ];
+    char *end;
+
+    while (true)
+    {
+        if (!proxy_gets(c, line, sizeof(line)))
+            return -1;
+
+        size_t size = strtoul(line, &end, 16);
+        if (end == line)
+            return -1;
+        if (size == 0)
+            break;
+        if (proxy_copy(c, r, size) < 0 || !proxy_gets(c, line, sizeof(line)))
+            return -1;
+    }
+
+    /* Discard trailers */
+    do
+    {
+        if (!proxy_gets(c, line, sizeof(line)))
+            return -1;
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    return 0;
+}
+
+/* Handler */
+
+/**
+ * Format request head to send upstream.
+ *
+ * @return  Newly allocated head (length stored in *length), or NULL.
+ **/
+static char *proxy_request_head(Request *r, ProxyRoute *route, size_t index, size_t *length)
+{
+    const char *forwarded = request_header(r, "X-Forwarded-For");
+    bool host = false;
+    char *head = NULL;
+    FILE *stream = open_memstream(&head, length);
+
+    if (!stream)
+        return NULL;
+
+    fprintf(stream, "%s %s%s%s HTTP/1.1\r\n", r->method, r->uri, *r->query ? "?" : "", r->query);
+    for (Header *h = r->headers; h && h->name; h = h->next)
+    {
+        if (proxy_hop_by_hop(h->name, strlen(h->name)) || !strcasecmp(h->name, "X-Forwarded-For") ||
+            !strcasecmp(h->name, "X-Forwarded-Proto") || !strcasecmp(h->name, "Expect"))
+            continue;
+        host = host || !strcasecmp(h->name, "Host");
+        fprintf(stream, "%s: %s\r\n", h->name, h->data);
+    }
+    if (!host)
+        fprintf(stream, "Host: %s\r\n", route->upstreams[index].name);
+    fprintf(stream, "X-Forwarded-For: %s%s%s\r\n", forwarded ? forwarded : "", forwarded ? ", " : "", request_host(r));
+    fprintf(stream, "X-Forwarded-Proto: %s\r\n", r->tls ? "https" : "http");
+    fprintf(stream, "Connection: keep-alive\r\n\r\n");
+
+    if (fclose(stream) != 0)
+    {
+        free(head);
+        return NULL;
+    }
+    return head;
+}
+
+/**
+ * Send request head and body upstream and read the response head.
+ *
+ * @param   c           ProxyConnection structure (connected).
+ * @param   r           HTTP Request structure.
+ * @param   head        Request head.
+ * @param   length      Length of head.
+ * @param   body        Length of request body.
+ * @param   status      Buffer for response status line.
+ * @param   sent_body   Set once any body bytes have been consumed from client.
+ * @return  0 on success, -1 on error.
+ *
+ * The request body is streamed from the client in BUFSIZ chunks.  Interim
+ * (1xx) responses are skipped.
+ **/
+static int proxy_exchange(ProxyConnection *c, Request *r, const char *head, size_t length,
+                          size_t body, char *status, size_t size, bool *sent_body)
+{
+    char buffer[BUFSIZ];
+
+    if (proxy_send(c, head, length) < 0)
+        return -1;
+
+    while (body > 0)
+    {
+        ssize_t n = request_read(r, buffer, body < sizeof(buffer) ? body : sizeof(buffer));
+        *sent_body = true;
+        if (n <= 0 || proxy_send(c, buffer, n) < 0)
+            return -1;
+        body -= n;
+    }
+
+    do
+    {
+        if (!proxy_gets(c, status, size) || strncmp(status, "HTTP/1.", 7) || strlen(status) < 12)
+            return -1;
+        if (status[9] != '1')
+            break;
+
+        /* Skip interim response headers */
+        do
+        {
+            if (!proxy_gets(c, buffer, sizeof(buffer)))
+                return -1;
+        } while (strcmp(buffer, "\r\n") && strcmp(buffer, "\n"));
+    } while (true);
+    return 0;
+}
+
+/**
+ * Handle reverse proxy request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   route       ProxyRoute matching request URI.
+ * @return  Status of the proxied request.
+ *
+ * The request is forwarded over a pooled keep-alive connection to the route's
+ * least loaded upstream, and the response is streamed back as it arrives.  A
+ * pooled connection that turns out to be stale is retried on a fresh one,
+ * provided no request body had been consumed yet.  Failed upstreams are
+ * skipped for a few seconds.
+ *
+ * If no upstream produces a response head, then handle error with
+ * HTTP_STATUS_BAD_GATEWAY.
+ **/
+Status handle_proxy_request(Request *r, ProxyRoute *route)
+{
+    ProxyConnection c = {.route = route, .fd = -1};
+    const char *value;
+    char status[BUFSIZ];
+    char line[BUFSIZ];
+    size_t body = 0;
+    bool sent_body = false;
+    bool exchanged = false;
+    char *head = NULL;
+    size_t length;
+
+    log("Handling proxy request (in)");
+
+    /* Request bodies must be delimited by Content-Length */
+    if (request_header(r, "Transfer-Encoding"))
+        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    if ((value = request_header(r, "Content-Length")))
+        body = strtoull(value, NULL, 10);
+
+    /* Try upstreams until one answers (a stale pooled connection costs one retry) */
+    for (size_t attempt = 0; attempt <= route->nupstreams && !exchanged && !sent_body; attempt++)
+    {
+        uint64_t now = now_ms();
+
+        c.index = proxy_select(route, now);
+        if (proxy_connect(&c) < 0)
+        {
+            __atomic_store_n(&route->shared->down_until[c.index], now + PROXY_RETRY_DELAY, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        free(head);
+        if (!(head = proxy_request_head(r, route, c.index, &length)))
+            break;
+
+        __atomic_fetch_add(&route->shared->active[c.index], 1, __ATOMIC_RELAXED);
+        exchanged = proxy_exchange(&c, r, head, length, body, status, sizeof(status), &sent_body) == 0;
+        if (!exchanged)
+        {
+            debug("Upstream %s failed%s: %s", route->upstreams[c.index].name,
+                  c.reused ? " (pooled)" : "", strerror(errno));
+            __atomic_fetch_sub(&route->shared->active[c.index], 1, __ATOMIC_RELAXED);
+            if (!c.reused)
+                __atomic_store_n(&route->shared->down_until[c.index], now + PROXY_RETRY_DELAY, __ATOMIC_RELAXED);
+            proxy_release(&c, false);
+        }
+    }
+    free(head);
+    head = NULL;
+
+    if (!exchanged)
+        return handle_error(r, HTTP_STATUS_BAD_GATEWAY);
+
+    /* Relay status line and end-to-end headers; note body framing */
+    bool   keepalive = status[7] == '1';
+    bool   chunked = false;
+    size_t content_length = SIZE_MAX;
+    int    code = atoi(status + 9);
+    Status result = HTTP_STATUS_OK;
+    FILE  *stream = open_memstream(&head, &length);
+
+    socket_cork(r->fd, true);
+    if (!stream)
+        goto fail;
+
+    fprintf(stream, "HTTP/1.0 %s", status + 9);
+    while (proxy_gets(&c, line, sizeof(line)) && strcmp(line, "\r\n") && strcmp(line, "\n"))
+    {
+        char *colon = strchr(line, ':');
+        if (!colon)
+            continue;
+
+        value = skip_whitespace(colon + 1);
+        if (!strncasecmp(line, "Content-Length:", 15))
+            content_length = strtoull(value, NULL, 10);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+            chunked = strcasestr(value, "chunked") != NULL;
+        else if (!strncasecmp(line, "Connection:", 11))
+            keepalive = strcasestr(value, "close") ? false : (strcasestr(value, "keep-alive") ? true : keepalive);
+
+        if (!proxy_hop_by_hop(line, colon - line))
+            fputs(line, stream);
+    }
+    fputs("Connection: close\r\n\r\n", stream);
+    fclose(stream);
+
+    if (response_write(r, head, length) < 0)
+    {
+        free(head);
+        goto fail;
+    }
+    free(head);
+
+    /* Relay body */
+    if (streq(r->method, "HEAD") || code == 204 || code == 304)
+        ;
+    else if (chunked)
+    {
+        if (proxy_copy_chunked(&c, r) < 0)
+            goto fail;
+    }
+    else if (content_length != SIZE_MAX)
+    {
+        if (proxy_copy(&c, r, content_length) < 0)
+            goto fail;
+    }
+    else
+    {
+        keepalive = false;
+        if (proxy_copy(&c, r, SIZE_MAX) < 0)
+            goto fail;
+    }
+
+    proxy_release(&c, keepalive);
+    goto done;
+
+fail:
+    proxy_release(&c, false);
+    result = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+
+done:
+    __atomic_fetch_sub(&route->shared->active[c.index], 1, __ATOMIC_RELAXED);
+    socket_cork(r->fd, false);
+    return result;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
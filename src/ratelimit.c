@@ -0,0 +1,285 @@
+/* ratelimit.c: Per-Client Rate Limiting */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+#define LIMIT_PROBES    8               /* Slots probed per lookup */
+#define LIMIT_TOKEN     1000            /* Milli-tokens per request */
+
+/**
+ * Client slot in shared table.
+ *
+ * The bucket records the deficit (milli-tokens spent and not yet refilled)
+ * in its high 32 bits and the time of the last update (low 32 bits of
+ * now_ms) in its low 32 bits, so that it can be updated with a single
+ * compare-and-swap.  An all-zero bucket is full, which makes a freshly
+ * claimed (or reclaimed) slot valid before anything is written to it.
+ */
+struct limit_slot {
+    uint64_t key;                       /*< Hash of client address (0 if unused) */
+    uint64_t bucket;                    /*< Deficit and last update time */
+    uint32_t connections;               /*< Open connections from client */
+    uint32_t padding;
+};
+
+static LimitSlot *Slots = NULL;         /* Table shared by all processes */
+static size_t     SlotMask = 0;         /* Number of slots - 1 */
+
+/**
+ * Map rate limit table into memory shared with future children.
+ *
+ * Nothing is mapped when no limit is configured.  The table has RateSlots
+ * entries (rounded up to a power of two) and never grows: when a client
+ * cannot claim a slot, it shares one with another client.  Once mapped, the
+ * table is kept (and its size fixed) across reloads.
+ **/
+void ratelimit_init(void)
+{
+    size_t size = 1;
+
+    if (Slots || (RateLimit <= 0 && ClientConnections <= 0))
+        return;
+
+    while (size < (size_t)(RateSlots > 0 ? RateSlots : 1))
+        size <<= 1;
+
+    Slots = mmap(NULL, size * sizeof(LimitSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Slots == MAP_FAILED)
+    {
+        fatal("Unable to map rate limit table: %s", strerror(errno));
+    }
+    SlotMask = size - 1;
+}
+
+/**
+ * Hash client address into a non-zero key.
+ *
+ * IPv4-mapped IPv6 addresses hash like the IPv4 address they contain.
+ **/
+static uint64_t ratelimit_key(const struct sockaddr_storage *addr)
+{
+    uint64_t hi = 0, lo = 0;
+
+    if (addr->ss_family == AF_INET)
+    {
+        lo = 0xffff00000000ull | ntohl(((struct sockaddr_in *)addr)->sin_addr.s_addr);
+    }
+    else if (addr->ss_family == AF_INET6)
+    {
+        const uint8_t *a = ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+        memcpy(&hi, a, 8);
+        memcpy(&lo, a + 8, 8);
+        if (IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)addr)->sin6_addr))
+        {
+            hi = 0;
+            lo = 0xffff00000000ull | ((uint64_t)a[12] << 24 | a[13] << 16 | a[14] << 8 | a[15]);
+        }
+    }
+
+    /* splitmix64 finalizer */
+    uint64_t key = hi * 0x9e3779b97f4a7c15ull ^ lo;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return key ? key : 1;
+}
+
+/**
+ * Return deficit of bucket after refilling it up to now.
+ **/
+static uint64_t ratelimit_deficit(uint64_t bucket, uint32_t now)
+{
+    uint64_t deficit = bucket >> 32;
+    uint64_t refill = (uint64_t)(uint32_t)(now - (uint32_t)bucket) * (RateLimit > 0 ? RateLimit : 0);
+
+    return deficit > refill ? deficit - refill : 0;
+}
+
+/**
+ * Find (or claim) slot for client.
+ *
+ * @return  Slot for client; never NULL.
+ *
+ * Probes are bounded by LIMIT_PROBES.  If no probed slot belongs to the
+ * client or is free, an idle slot (full bucket, no connections) is taken
+ * over; failing that, the client shares its home slot.
+ **/
+static LimitSlot *ratelimit_slot(uint64_t key, uint32_t now)
+{
+    size_t home = key & SlotMask;
+
+    for (size_t i = 0; i < LIMIT_PROBES; i++)
+    {
+        LimitSlot *slot = &Slots[(home + i) & SlotMask];
+        uint64_t   owner = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+        if (owner == key)
+            return slot;
+        if (owner == 0)
+        {
+            if (__atomic_compare_exchange_n(&slot->key, &owner, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || owner == key)
+                return slot;
+        }
+    }
+
+    for (size_t i = 0; i < LIMIT_PROBES; i++)
+    {
+        LimitSlot *slot = &Slots[(home + i) & SlotMask];
+        uint64_t   owner = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->connections, __ATOMIC_ACQUIRE) == 0 &&
+            ratelimit_deficit(__atomic_load_n(&slot->bucket, __ATOMIC_ACQUIRE), now) == 0 &&
+            __atomic_compare_exchange_n(&slot->key, &owner, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&slot->bucket, 0, __ATOMIC_RELEASE);
+            return slot;
+        }
+    }
+
+    return &Slots[home];
+}
+
+/**
+ * Take one request token from bucket.
+ *
+ * @param   slot        Client slot.
+ * @param   now         Current time (low 32 bits of now_ms).
+ * @param   consume     Whether to take the token or only check for it.
+ * @return  true if a token is (or was) available.
+ **/
+static bool ratelimit_take(LimitSlot *slot, uint32_t now, bool consume)
+{
+    uint64_t burst = (uint64_t)(RateBurst > RateLimit ? RateBurst : RateLimit) * LIMIT_TOKEN;
+    uint64_t bucket = __atomic_load_n(&slot->bucket, __ATOMIC_ACQUIRE);
+
+    while (true)
+    {
+        uint64_t deficit = ratelimit_deficit(bucket, now);
+
+        if (deficit + LIMIT_TOKEN > burst)
+            return false;
+        if (!consume)
+            return true;
+        if (__atomic_compare_exchange_n(&slot->bucket, &bucket, ((deficit + LIMIT_TOKEN) << 32) | now,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
+    }
+}
+
+/**
+ * Admit newly accepted connection.
+ *
+ * @param   r           Request structure (just accepted).
+ * @return  HTTP_STATUS_OK if admitted, HTTP_STATUS_SERVICE_UNAVAILABLE if the
+ * client already has ClientConnections open, or HTTP_STATUS_TOO_MANY_REQUESTS
+ * if its bucket is empty.
+ *
+ * This runs on the accept path (in the parent, in forking mode), so a client
+ * over its limits is turned away without a fork.  It only checks for a token;
+ * tokens are spent per request by ratelimit_request.  An admitted connection
+ * is counted until ratelimit_release.
+ **/
+Status ratelimit_accept(Request *r)
+{
+    uint32_t now = now_ms();
+    LimitSlot *slot;
+
+    if (!Slots)
+        return HTTP_STATUS_OK;
+
+    slot = ratelimit_slot(ratelimit_key(&r->addr), now);
+    if (RateLimit > 0 && !ratelimit_take(slot, now, false))
+        return HTTP_STATUS_TOO_MANY_REQUESTS;
+
+    if (ClientConnections > 0)
+    {
+        if (__atomic_add_fetch(&slot->connections, 1, __ATOMIC_ACQ_REL) > (uint32_t)ClientConnections)
+        {
+            __atomic_sub_fetch(&slot->connections, 1, __ATOMIC_ACQ_REL);
+            return HTTP_STATUS_SERVICE_UNAVAILABLE;
+        }
+        r->limit = slot;
+    }
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Charge request to client.
+ *
+ * @param   r           Request structure (HTTP/1 request or HTTP/2 stream).
+ * @return  HTTP_STATUS_OK, or HTTP_STATUS_TOO_MANY_REQUESTS if the client's
+ * bucket is empty.
+ **/
+Status ratelimit_request(Request *r)
+{
+    uint32_t now = now_ms();
+
+    if (!Slots || RateLimit <= 0)
+        return HTTP_STATUS_OK;
+
+    if (!ratelimit_take(ratelimit_slot(ratelimit_key(&r->addr), now), now, true))
+        return HTTP_STATUS_TOO_MANY_REQUESTS;
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Release connection counted by ratelimit_accept.
+ **/
+void ratelimit_release(Request *r)
+{
+    if (r->limit)
+    {
+        __atomic_sub_fetch(&r->limit->connections, 1, __ATOMIC_ACQ_REL);
+        r->limit = NULL;
+    }
+}
+
+/**
+ * Forget connection counted by ratelimit_accept without releasing it.
+ *
+ * This is used when another process (a forked child) takes over the
+ * connection and will release it.
+ **/
+void ratelimit_disown(Request *r)
+{
+    r->limit = NULL;
+}
+
+/**
+ * Turn away connection rejected by ratelimit_accept.
+ *
+ * @param   r           Request structure.
+ * @param   status      HTTP status to report.
+ *
+ * The response is sent with a single non-blocking write, so a client that
+ * is not reading cannot stall the accept loop.  TLS clients (whose
+ * handshake has not happened yet) are simply disconnected.
+ **/
+void ratelimit_reject(Request *r, Status status)
+{
+    static const char RejectBody[] = "Too many requests or connections from this address.\n";
+    Response response;
+    struct msghdr msg = {0};
+
+    if (tls_enabled())
+        return;
+
+    response_init(&response, status);
+    if (status == HTTP_STATUS_TOO_MANY_REQUESTS)
+        response_header(&response, "Retry-After: 1\r\n", 16);
+    response_content_type(&response, "text/plain");
+    response_content_length(&response, sizeof(RejectBody) - 1);
+    response_body(&response, RejectBody, sizeof(RejectBody) - 1);
+
+    msg.msg_iov = response.iov;
+    msg.msg_iovlen = response.iovcnt;
+    if (sendmsg(r->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        debug("Unable to send %s: %s", http_status_string(status), strerror(errno));
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
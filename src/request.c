@@ -4,78 +4,239 @@
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
+static void request_expired(Timer *timer);
 
 /**
  * Accept request from server socket.
  *
- * @param   sfd         Server socket file descriptor.
- * @return  Newly allocated Request structure.
+ * @param   sfd         Server socket file descriptor (non-blocking).
+ * @return  Newly allocated Request structure (or NULL with errno set).
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  1. Accepts a client connection from the server socket.
+ *  2. Allocates a request struct initialized to 0.
+ *  3. Initializes the headers list in the request struct.
+ *  4. Stores the client address (formatted lazily by request_host).
+ *  5. Returns the request struct.
+ *
+ * The client socket is non-blocking; reads and writes wait for readiness
+ * with request_wait so that connection deadlines can be enforced.
+ *
+ * If no client is pending, NULL is returned with errno set to EAGAIN.
  *
  * The returned request struct must be deallocated using free_request.
  **/
 Request *accept_request(int sfd)
 {
     Request *r;
-    struct sockaddr raddr;
-    socklen_t rlen;
-    rlen = sizeof(struct sockaddr);
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
+    int fd;
+    int saved;
+
+    /* Accept a client */
+    fd = accept4(sfd, (struct sockaddr *)&raddr, &rlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
 
     /* Allocate request struct (zeroed) */
     r = calloc(1, sizeof(Request));
     if (!(r))
     {
+        saved = errno;
         debug("Allocating request failed: %s", strerror(errno));
+        close(fd);
+        errno = saved;
+        return NULL;
     }
 
+    r->fd = fd;
+    r->sink = &SocketSink;
+    r->file_fd = -1;
+    r->addr = raddr;
+    r->addrlen = rlen;
+    r->timer.callback = request_expired;
+    r->timer.data = r;
+
     r->headers = calloc(1, sizeof(Header));
     if(!r->headers){
       debug("Can't allocate headers: %s", strerror(errno));
+      goto fail;
     }
 
-    /* Accept a client */
-    r->fd = accept(sfd, &raddr, &rlen);
-    if (r->fd < 0)
+    control_hold(r);
+    debug("Accepted request from %s:%s", request_host(r), request_port(r));
+    return r;
+
+fail:
+    /* Deallocate request struct */
+    saved = errno;
+    free_request(r);
+    errno = saved;
+    return NULL;
+}
+
+/**
+ * Accept batch of requests from server socket.
+ *
+ * @param   sfd         Server socket file descriptor (non-blocking).
+ * @param   requests    Array to store accepted Request structures.
+ * @param   n           Maximum number of requests to accept.
+ * @return  Number of requests accepted.
+ *
+ * This waits until at least one client is pending and then drains the
+ * listen backlog, up to n clients, without blocking again.  Callers apply
+ * backpressure by limiting n to the number of connections they can take.
+ *
+ * If the wait is interrupted by a signal, this returns early (possibly with
+ * 0 requests) so the caller can react.
+ **/
+size_t accept_requests(int sfd, Request **requests, size_t n)
+{
+    struct pollfd pfd = {.fd = sfd, .events = POLLIN};
+
+    while (true)
     {
-        debug("Unable to accept client: %s", strerror(errno));
-        goto fail;
+        size_t count = accept_pending(sfd, requests, n);
+        if (count > 0 || n == 0)
+            return count;
+
+        switch (errno)
+        {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            /* Backlog empty: wait for the next client */
+            if (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+                return 0;
+            break;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            /* Out of resources: back off briefly rather than spin */
+            poll(NULL, 0, 10);
+            return 0;
+        default:
+            return 0;
+        }
     }
+}
+
+/**
+ * Accept pending requests from server socket without waiting.
+ *
+ * @param   sfd         Server socket file descriptor (non-blocking).
+ * @param   requests    Array to store accepted Request structures.
+ * @param   n           Maximum number of requests to accept.
+ * @return  Number of requests accepted (errno says why it stopped short).
+ *
+ * Clients over their rate limits are turned away here.
+ **/
+size_t accept_pending(int sfd, Request **requests, size_t n)
+{
+    size_t count = 0;
 
-    /* Lookup client information */
-    int status = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
-    if (status < 0)
+    while (count < n)
     {
-        debug("Failed to getnameinfo: %s", gai_strerror(errno));
-        goto fail;
+        Request *r = accept_request(sfd);
+        if (r)
+        {
+            Status status = ratelimit_accept(r);
+            if (status != HTTP_STATUS_OK)
+            {
+                debug("Rejecting %s: %s", request_host(r), http_status_string(status));
+                ratelimit_reject(r, status);
+                free_request(r);
+                continue;
+            }
+            requests[count++] = r;
+            continue;
+        }
+
+        switch (errno)
+        {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        case EINTR:
+            return count;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            log("Unable to accept client: %s", strerror(errno));
+            return count;
+        default:
+            /* Client went away before accept (ECONNABORTED, etc.) */
+            debug("Unable to accept client: %s", strerror(errno));
+            break;
+        }
     }
-    /* Open socket stream */
-    r->stream = fdopen(r->fd, "w+");
-    if (!r->stream)
+
+    return count;
+}
+
+/**
+ * Return client host address of request.
+ *
+ * @param   r           Request structure.
+ * @return  Numeric host string of client.
+ *
+ * The address is formatted on first use, since most requests never need it.
+ * IPv4-mapped IPv6 addresses are reported in plain IPv4 form.
+ **/
+const char *request_host(Request *r)
+{
+    if (!r->host[0])
     {
-        debug("Unable to fdopen: %s", strerror(errno));
-        goto fail;
-    }
+        struct sockaddr_storage addr = r->addr;
+        socklen_t addrlen = r->addrlen;
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
 
-    log("Accepted request from %s:%s", r->host, r->port);
-    return r;
+        if (addr.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+        {
+            struct sockaddr_in in = {.sin_family = AF_INET, .sin_port = in6->sin6_port};
+            memcpy(&in.sin_addr, &in6->sin6_addr.s6_addr[12], sizeof(in.sin_addr));
+            memcpy(&addr, &in, sizeof(in));
+            addrlen = sizeof(in);
+        }
 
-fail:
-    /* Deallocate request struct */
-    free_request(r);
-    return NULL;
+        int status = getnameinfo((struct sockaddr *)&addr, addrlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
+        if (status != 0)
+        {
+            debug("Failed to getnameinfo: %s", gai_strerror(status));
+            strcpy(r->host, "unknown");
+            strcpy(r->port, "0");
+        }
+    }
+    return r->host;
+}
+
+/**
+ * Return client port number of request.
+ *
+ * @param   r           Request structure.
+ * @return  Numeric port string of client.
+ **/
+const char *request_port(Request *r)
+{
+    request_host(r);
+    return r->port;
 }
 
 /**
@@ -85,7 +246,8 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Cancels any deadline, releases resources replaced by reloads since it
+ *     was accepted (see control_retire), and closes the request socket.
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
@@ -97,12 +259,17 @@ void free_request(Request *r)
         return;
     }
 
-    /* Close socket or fd */
-    if (r->stream)
-        fclose(r->stream);
-    else if (r->fd)
+    /* Cancel deadline, end TLS session, release rate limit, and close socket */
+    timer_cancel(&Timers, &r->timer);
+    tls_close(r);
+    ratelimit_release(r);
+    control_release(r);
+    if (r->fd >= 0)
         close(r->fd);
 
+    if (r->file_fd >= 0)
+        close(r->file_fd);
+
     /* Free allocated strings */
     free(r->method);
     free(r->uri);
@@ -133,9 +300,15 @@ void free_request(Request *r)
  *
  * This function first parses the request method, any query, and then the
  * headers, returning 0 on success, and -1 on error.
+ *
+ * The idle deadline runs until the first byte arrives, after which the whole
+ * request head must arrive within the header deadline.  If either expires,
+ * request->timed_out is set and -1 is returned.
  **/
 int parse_request(Request *r)
 {
+    request_deadline(r, DEADLINE_IDLE);
+
     /* Parse HTTP Request Method */
     if (parse_request_method(r))
     {
@@ -149,6 +322,7 @@ int parse_request(Request *r)
         return -1;
     }
 
+    request_deadline(r, DEADLINE_NONE);
     return 0;
 }
 
@@ -177,7 +351,7 @@ int parse_request_method(Request *r)
     char *query;
 
     /* Read line from socket */
-    if (!fgets(buffer, BUFSIZ, r->stream))
+    if (!request_gets(r, buffer, BUFSIZ))
     {
         debug("Unable to read from socket: %s", strerror(errno));
         return -1;
@@ -254,9 +428,11 @@ int parse_request_headers(Request *r)
 
     /* Parse headers from socket */
 
-    while (fgets(buffer, BUFSIZ, r->stream) && strlen(buffer) > 2)
+    while (request_gets(r, buffer, BUFSIZ) && strlen(buffer) > 2)
     {
         chomp(buffer);
+        if (buffer[strlen(buffer) - 1] == '\r')
+            chomp(buffer);
         data = strchr(buffer, ':');
         debug("data: %s\n", data);
         if (!data)
@@ -278,7 +454,7 @@ int parse_request_headers(Request *r)
         curr->next = r->headers;
         r->headers = curr;
     }
-    if (!r->headers)
+    if (!r->headers || r->timed_out)
         return -1;
 
 #ifndef NDEBUG
@@ -290,4 +466,212 @@ int parse_request_headers(Request *r)
     return 0;
 }
 
+/**
+ * Look up request header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name (case-insensitive).
+ * @return  Header data, or NULL if the header is not present.
+ **/
+const char *request_header(Request *r, const char *name)
+{
+    for (Header *header = r->headers; header && header->name; header = header->next)
+    {
+        if (!strcasecmp(header->name, name))
+            return header->data;
+    }
+    return NULL;
+}
+
+/**
+ * Mark request as timed out when its deadline timer fires.
+ **/
+static void request_expired(Timer *timer)
+{
+    Request *r = timer->data;
+
+    log("Request deadline %d expired", r->deadline);
+    r->timed_out = true;
+}
+
+/**
+ * Set current deadline of request.
+ *
+ * @param   r           Request structure.
+ * @param   deadline    Deadline to arm (DEADLINE_NONE cancels).
+ *
+ * The deadline is measured from now using the corresponding timeout tunable;
+ * a timeout of 0 disables it.  Arming a deadline clears any previous expiry.
+ **/
+void request_deadline(Request *r, Deadline deadline)
+{
+    static const int *Timeouts[] = {
+        [DEADLINE_IDLE]   = &IdleTimeout,
+        [DEADLINE_HEADER] = &HeaderTimeout,
+        [DEADLINE_BODY]   = &BodyTimeout,
+        [DEADLINE_WRITE]  = &WriteTimeout,
+    };
+
+    r->deadline = deadline;
+    r->timed_out = false;
+
+    if (deadline == DEADLINE_NONE || *Timeouts[deadline] <= 0)
+        timer_cancel(&Timers, &r->timer);
+    else
+        timer_add(&Timers, &r->timer, now_ms() + *Timeouts[deadline] * 1000ULL);
+}
+
+/**
+ * Wait for request socket to become ready.
+ *
+ * @param   r           Request structure.
+ * @param   events      poll(2) events to wait for (POLLIN or POLLOUT).
+ * @return  0 when ready, -1 on error (errno is ETIMEDOUT if the deadline
+ * expired).
+ *
+ * While waiting, this drives the process timer wheel, so any expired timers
+ * (not just this request's) have their callbacks run.  In a coroutine (event
+ * mode), the scheduler drives it instead, and the coroutine yields until the
+ * socket is ready or the deadline expires.
+ **/
+int request_wait(Request *r, short events)
+{
+    struct pollfd pfd = {.fd = r->fd, .events = events};
+
+    while (coroutine_self() && !r->timed_out)
+    {
+        int n = coroutine_wait(r->fd, events, r->timer.next ? r->timer.expires : 0);
+
+        if (n > 0)
+            return 0;
+        if (n < 0)
+            return -1;
+    }
+
+    while (!r->timed_out)
+    {
+        int n = poll(&pfd, 1, timer_timeout(&Timers, now_ms()));
+        timer_advance(&Timers, now_ms());
+
+        if (n > 0)
+            return 0;
+        if (n < 0 && errno != EINTR)
+            return -1;
+    }
+
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/**
+ * Receive data from client socket (decrypting if the connection uses TLS).
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to store data.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read, 0 on end-of-file, -1 on error or timeout.
+ **/
+static ssize_t request_recv(Request *r, void *buffer, size_t size)
+{
+    if (r->tls)
+        return tls_recv(r, buffer, size);
+
+    while (true)
+    {
+        ssize_t n = recv(r->fd, buffer, size, 0);
+        if (n >= 0)
+            return n;
+        if (errno == EINTR)
+            continue;
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || request_wait(r, POLLIN) < 0)
+            return -1;
+    }
+}
+
+/**
+ * Read more client input into request buffer.
+ *
+ * @param   r           Request structure.
+ * @return  Number of bytes read, 0 on end-of-file, -1 on error.
+ *
+ * Receiving the first byte while idle starts the header deadline.
+ **/
+static ssize_t request_fill(Request *r)
+{
+    ssize_t n;
+
+    if (r->input_start == r->input_end)
+        r->input_start = r->input_end = 0;
+
+    n = request_recv(r, r->input + r->input_end, sizeof(r->input) - r->input_end);
+    if (n > 0)
+    {
+        if (r->deadline == DEADLINE_IDLE)
+            request_deadline(r, DEADLINE_HEADER);
+        r->input_end += n;
+    }
+    return n;
+}
+
+/**
+ * Read line from client.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to store line (including newline).
+ * @param   size        Size of buffer.
+ * @return  buffer on success, or NULL on end-of-file, error, or timeout.
+ *
+ * Like fgets(3), this reads at most size - 1 bytes and stops after a newline.
+ **/
+char *request_gets(Request *r, char *buffer, size_t size)
+{
+    size_t length = 0;
+
+    while (length + 1 < size)
+    {
+        if (r->input_start == r->input_end && request_fill(r) <= 0)
+            break;
+
+        buffer[length++] = r->input[r->input_start++];
+        if (buffer[length - 1] == '\n')
+            break;
+    }
+
+    if (length == 0)
+        return NULL;
+
+    buffer[length] = '\0';
+    return buffer;
+}
+
+/**
+ * Read request body data from client.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to store data.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read, 0 on end-of-file, -1 on error or timeout.
+ *
+ * Buffered input left over from parsing is returned first.  Each call arms
+ * the body deadline, which therefore bounds inactivity rather than the total
+ * transfer time.
+ **/
+ssize_t request_read(Request *r, void *buffer, size_t size)
+{
+    request_deadline(r, DEADLINE_BODY);
+
+    if (r->input_start == r->input_end)
+    {
+        r->input_start = r->input_end = 0;
+        return request_recv(r, buffer, size);
+    }
+
+    size_t n = r->input_end - r->input_start;
+    if (n > size)
+        n = size;
+    memcpy(buffer, r->input + r->input_start, n);
+    r->input_start += n;
+    return n;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
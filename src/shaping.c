@@ -0,0 +1,117 @@
+/* shaping.c: Egress Bandwidth Shaping */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+static uint64_t *TotalTat = NULL;       /* Shared theoretical arrival time of TotalRate (microseconds) */
+
+/**
+ * Return monotonic time in microseconds (comparable across processes).
+ **/
+static uint64_t shaping_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Map the global egress bucket into memory shared with future children.
+ *
+ * The bucket is mapped whether or not TotalRate is set, so that enabling it
+ * on reload applies across every worker and child.
+ **/
+void shaping_init(void)
+{
+    if (TotalTat)
+        return;
+
+    TotalTat = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (TotalTat == MAP_FAILED)
+    {
+        log("Unable to map egress bucket: %s", strerror(errno));
+        TotalTat = NULL;
+    }
+}
+
+/**
+ * Charge bytes to a bucket (GCRA).
+ *
+ * @param   tat         Theoretical arrival time of bucket (microseconds).
+ * @param   rate        Rate of bucket (bytes per second).
+ * @param   bytes       Bytes to charge.
+ * @param   now         Current time (microseconds).
+ * @return  Time until the bytes conform to the rate (microseconds).
+ *
+ * The bucket is a theoretical arrival time: when the bytes sent so far would
+ * have finished at rate.  One SendSlice may be sent ahead of it.  Shared
+ * buckets are updated with compare-and-swap.
+ **/
+static uint64_t shaping_charge(uint64_t *tat, int rate, size_t bytes, uint64_t now)
+{
+    uint64_t cost = (uint64_t)bytes * 1000000 / rate;
+    uint64_t burst = (uint64_t)(SendSlice > 0 ? SendSlice : bytes) * 1000000 / rate;
+    uint64_t current = __atomic_load_n(tat, __ATOMIC_ACQUIRE);
+    uint64_t next;
+
+    do
+    {
+        next = (current > now ? current : now) + cost;
+    } while (!__atomic_compare_exchange_n(tat, &current, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return next > now + burst ? next - now - burst : 0;
+}
+
+/**
+ * Wait for the next slice of a response body.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   sent        Bytes of the body already sent with this call.
+ * @param   remaining   Bytes of the body left to send.
+ * @return  Bytes to send now (at most SendSlice, if set).
+ *
+ * Bodies are sent in slices of SendSlice bytes.  Each slice is charged to
+ * the connection's bucket (SendRate) and to the bucket shared by every
+ * process (TotalRate), and this waits until both allow it.  In a coroutine,
+ * waiting (or, without a limit, each slice after the first) lets the other
+ * clients of the loop run, so bulk downloads cannot starve small requests.
+ **/
+size_t shaping_slice(Request *r, size_t sent, size_t remaining)
+{
+    size_t   slice = SendSlice > 0 && (size_t)SendSlice < remaining ? (size_t)SendSlice : remaining;
+    uint64_t now = shaping_now();
+    uint64_t wait = 0;
+
+    if (SendRate > 0)
+        wait = shaping_charge(&r->shaped, SendRate, slice, now);
+    if (TotalRate > 0 && TotalTat)
+    {
+        uint64_t total = shaping_charge(TotalTat, TotalRate, slice, now);
+        wait = total > wait ? total : wait;
+    }
+
+    if (wait == 0)
+    {
+        if (sent > 0)
+            coroutine_yield();
+    }
+    else if (coroutine_self())
+    {
+        coroutine_wait(-1, 0, now_ms() + (wait + 999) / 1000);
+    }
+    else
+    {
+        struct timespec delay = {.tv_sec = wait / 1000000, .tv_nsec = wait % 1000000 * 1000};
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+            ;
+    }
+    return slice;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -12,26 +12,29 @@
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Each wakeup drains a batch of pending clients from the backlog, which are
+ * then handled in order.
  **/
 int single_server(int sfd)
 {
-    Request *request;
-    /* Accept and handle HTTP request */
-    while (true)
+    Request *requests[ACCEPT_BATCH];
+    size_t batch = MaxConnections < ACCEPT_BATCH ? MaxConnections : ACCEPT_BATCH;
+
+    /* Accept and handle HTTP requests (until told to drain) */
+    while (control_poll(sfd))
     {
-        /* Accept request */
-        request = accept_request(sfd);
-        if (!request)
-        {
-            log("Unable to accept request: %s", strerror(errno));
-            continue;
-        }
+        /* Accept requests */
+        size_t n = accept_requests(sfd, requests, batch > 0 ? batch : 1);
 
-        /* Handle request */
-        handle_request(request);
+        for (size_t i = 0; i < n; i++)
+        {
+            /* Handle request */
+            handle_request(requests[i]);
 
-        /* Free request */
-        free_request(request);
+            /* Free request */
+            free_request(requests[i]);
+        }
     }
 
     /* Close server socket */
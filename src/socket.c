@@ -7,19 +7,131 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+static bool Inherited = false;          /* Whether listening socket came from a previous server */
+
+/**
+ * Return whether workers get their own listening sockets (see socket_clone).
+ **/
+static bool socket_sharded(void)
+{
+    return AcceptShard && Workers != 1;
+}
+
+/**
+ * Apply socket tuning options to listening socket.
+ *
+ * @param   fd          Server socket file descriptor.
+ * @param   family      Address family of socket.
+ *
+ * Failures are logged but not fatal, since every option is an optimization.
+ * Options such as TCP_NODELAY are inherited by accepted sockets on Linux, so
+ * they are set once here rather than on every accept.
+ **/
+static void socket_tune(int fd, int family)
+{
+    int on = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+        debug("Unable to set SO_REUSEADDR: %s", strerror(errno));
+
+    if (socket_sharded() && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        debug("Unable to set SO_REUSEPORT: %s", strerror(errno));
+
+    if (family == AF_INET6)
+    {
+        int v6only = !DualStack;
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0)
+            debug("Unable to set IPV6_V6ONLY: %s", strerror(errno));
+    }
+
+    if (TcpNoDelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        debug("Unable to set TCP_NODELAY: %s", strerror(errno));
+
+    if (DeferAccept > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &DeferAccept, sizeof(DeferAccept)) < 0)
+        debug("Unable to set TCP_DEFER_ACCEPT: %s", strerror(errno));
+
+    if (FastOpenQueue > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &FastOpenQueue, sizeof(FastOpenQueue)) < 0)
+        debug("Unable to set TCP_FASTOPEN: %s", strerror(errno));
+}
+
+/**
+ * Take over listening socket passed by a previous server.
+ *
+ * @return  Inherited socket file descriptor, or -1 if none was passed.
+ *
+ * The socket is passed as SOCKET_INHERIT_FD and announced with LISTEN_FDS
+ * and LISTEN_PID (the convention of systemd socket activation, which thus
+ * works too).  The variables are removed so that CGI scripts do not see them.
+ **/
+static int socket_inherit(void)
+{
+    const char *fds = getenv("LISTEN_FDS");
+    const char *pid = getenv("LISTEN_PID");
+    int fd = SOCKET_INHERIT_FD;
+    int type;
+    socklen_t length = sizeof(type);
+
+    if (!fds || !pid || atoi(fds) < 1 || atoi(pid) != getpid())
+        return -1;
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0 || type != SOCK_STREAM)
+    {
+        log("Ignoring inherited descriptor %d: not a stream socket", fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (listen(fd, ListenBacklog) < 0)
+    {
+        log("Unable to listen on inherited socket: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Let workers' sockets join it (a no-op if it already has a group) */
+    int on = 1;
+    if (socket_sharded() && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        debug("Unable to set SO_REUSEPORT: %s", strerror(errno));
+
+    Inherited = true;
+    return fd;
+}
+
 /**
  * Allocate socket, bind it, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
  * @return  Allocated server socket file descriptor.
+ *
+ * The socket is non-blocking so that accept_requests can drain the backlog.
+ *
+ * With DualStack enabled, IPv6 addresses are tried first so that a single
+ * socket accepts both IPv6 and IPv4 (mapped) clients, and IPv4 is used if
+ * the host has no IPv6 support.  Without it, an IPv6-only socket would turn
+ * IPv4 clients away, so IPv4 is tried first (and IPv6 used only if the host
+ * has no IPv4 support).
+ *
+ * A socket inherited from a previous server (see control_upgrade) is used as
+ * is instead, so that clients in its backlog are not lost.
  **/
 int socket_listen(const char *port)
 {
+    int inherited = socket_inherit();
+    if (inherited >= 0)
+    {
+        log("Inherited listening socket %d", inherited);
+        return inherited;
+    }
+
     /* Lookup server address information */
     struct addrinfo hints = {
         .ai_family = AF_UNSPEC,     /* Return IPv4 and IPv6 choices */
@@ -34,32 +146,41 @@ int socket_listen(const char *port)
         return -1;
     }
 
-    /* For each server entry, allocate socket and try to connect */
+    /* For each server entry (in order of Families), allocate socket and try to bind */
+    const int Families[] = {DualStack ? AF_INET6 : AF_INET, DualStack ? AF_INET : AF_INET6};
     int server_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && server_fd < 0; p = p->ai_next)
+    for (size_t f = 0; f < sizeof(Families) / sizeof(Families[0]) && server_fd < 0; f++)
     {
-        /* Allocate socket */
-        if ((server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+        for (struct addrinfo *p = results; p != NULL && server_fd < 0; p = p->ai_next)
         {
-            fprintf(stderr, "Allocating socket failed: %s\n", strerror(errno));
-            continue;
-        }
+            if (p->ai_family != Families[f])
+                continue;
 
-        /* Bind socket */
-        if (bind(server_fd, p->ai_addr, p->ai_addrlen) < 0)
-        {
-            fprintf(stderr, "Binding failed: %s\n", strerror(errno));
-            close(server_fd);
-            server_fd = -1;
-            continue;
-        }
-        /* Listen to socket */
-        if (listen(server_fd, SOMAXCONN) < 0)
-        {
-            fprintf(stderr, "Listening failed: %s\n", strerror(errno));
-            close(server_fd);
-            server_fd = -1;
-            continue;
+            /* Allocate socket */
+            if ((server_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol)) < 0)
+            {
+                fprintf(stderr, "Allocating socket failed: %s\n", strerror(errno));
+                continue;
+            }
+
+            socket_tune(server_fd, p->ai_family);
+
+            /* Bind socket */
+            if (bind(server_fd, p->ai_addr, p->ai_addrlen) < 0)
+            {
+                fprintf(stderr, "Binding failed: %s\n", strerror(errno));
+                close(server_fd);
+                server_fd = -1;
+                continue;
+            }
+            /* Listen to socket */
+            if (listen(server_fd, ListenBacklog) < 0)
+            {
+                fprintf(stderr, "Listening failed: %s\n", strerror(errno));
+                close(server_fd);
+                server_fd = -1;
+                continue;
+            }
         }
     }
 
@@ -67,4 +188,62 @@ int socket_listen(const char *port)
     return server_fd;
 }
 
+/**
+ * Allocate another listening socket on the address of the server socket.
+ *
+ * @param   sfd         Server socket file descriptor (with SO_REUSEPORT).
+ * @return  New socket file descriptor, or -1 on failure.
+ *
+ * The sockets form an SO_REUSEPORT group: each has its own accept queue,
+ * and the kernel spreads new connections across them.
+ **/
+int socket_clone(int sfd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd;
+
+    if (getsockname(sfd, (struct sockaddr *)&addr, &addrlen) < 0 ||
+        (fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        log("Allocating socket failed: %s", strerror(errno));
+        return -1;
+    }
+
+    socket_tune(fd, addr.ss_family);
+    if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0 || listen(fd, ListenBacklog) < 0)
+    {
+        log("Unable to share listening address: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Return whether the server socket was inherited (see socket_listen).
+ **/
+bool socket_inherited(void)
+{
+    return Inherited;
+}
+
+/**
+ * Cork or uncork client socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   cork        Whether to hold partial frames (true) or flush (false).
+ *
+ * While corked, the kernel only sends full segments, so headers and the
+ * start of the body share packets.  Uncorking flushes whatever remains.  This
+ * is a no-op unless TcpCork is enabled.
+ **/
+void socket_cork(int fd, bool cork)
+{
+    int value = cork;
+
+    if (TcpCork && fd >= 0 && setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) < 0)
+        debug("Unable to set TCP_CORK: %s", strerror(errno));
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,467 @@
+/* spidey-bench: Replay Request Trace against Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BENCH_BUFFER    65536           /* Bytes read from a response at a time */
+#define BENCH_TICK      100             /* Milliseconds between samples of the server */
+#define BENCH_TIMEOUT   10000           /* Milliseconds before a request fails */
+
+typedef struct {
+    char   *request;                    /*< Request to send */
+    size_t  length;                     /*< Length of request */
+    int     status;                     /*< Expected status (0 for any below 400) */
+} TraceEntry;
+
+typedef struct {
+    int       fd;                       /*< Socket (-1 if idle) */
+    size_t    entry;                    /*< Trace entry being replayed */
+    size_t    sent;                     /*< Bytes of request sent */
+    uint64_t  start;                    /*< When connecting began (microseconds) */
+    char      head[16];                 /*< Start of status line */
+    size_t    headlen;
+} BenchConnection;
+
+typedef struct {
+    uint64_t  cpu;                      /*< Clock ticks used by server processes */
+    uint64_t  rss;                      /*< Resident bytes of server processes */
+} ServerUsage;
+
+static TraceEntry      *Trace = NULL;
+static size_t           NTrace = 0;
+static size_t           Cursor = 0;     /* Next trace entry to replay */
+static struct addrinfo *Address = NULL;
+
+static uint32_t        *Latencies = NULL;   /* Latency of each request (microseconds) */
+static size_t           NLatencies = 0;
+static size_t           Capacity = 0;
+static uint64_t         Errors = 0;
+static uint64_t         Bytes = 0;
+
+/**
+ * Display usage message and exit with specified status code.
+ **/
+static void usage(const char *progname, int status)
+{
+    fprintf(stderr, "Usage: %s [options] host:port trace\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -H            Print CSV header line first\n");
+    fprintf(stderr, "    -c clients    Concurrent connections (10)\n");
+    fprintf(stderr, "    -d seconds    Duration of measurement (10)\n");
+    fprintf(stderr, "    -w seconds    Warm-up before measurement (1)\n");
+    fprintf(stderr, "    -p pid        Server process to measure CPU and RSS of (with descendants)\n");
+    fprintf(stderr, "Trace lines are \"METHOD URI [STATUS]\" ('#' starts a comment).\n");
+    exit(status);
+}
+
+/**
+ * Return monotonic time in microseconds.
+ **/
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Load request trace.
+ *
+ * @param   path        Path to trace file.
+ * @param   host        Value of Host header.
+ *
+ * Each line is a request method, a URI, and optionally the status the
+ * server should respond with.  Requests are replayed in order, wrapping
+ * around at the end.
+ **/
+static void bench_load(const char *path, const char *host)
+{
+    char line[BUFSIZ], method[16], uri[BUFSIZ];
+    FILE *fs = fopen(path, "re");
+    int status;
+
+    if (!fs)
+    {
+        fatal("Unable to open trace %s: %s", path, strerror(errno));
+    }
+
+    while (fgets(line, sizeof(line), fs))
+    {
+        status = 0;
+        if (line[0] == '#' || sscanf(line, "%15s %8191s %d", method, uri, &status) < 2)
+            continue;
+        if (!(Trace = realloc(Trace, (NTrace + 1) * sizeof(TraceEntry))))
+        {
+            fatal("Unable to allocate trace: %s", strerror(errno));
+        }
+        TraceEntry *e = &Trace[NTrace++];
+        e->status = status;
+        e->length = asprintf(&e->request, "%s %s HTTP/1.0\r\nHost: %s\r\n\r\n", method, uri, host);
+    }
+    fclose(fs);
+
+    if (NTrace == 0)
+    {
+        fatal("Trace %s has no requests", path);
+    }
+}
+
+/**
+ * Add up CPU time and resident memory of process and its descendants.
+ *
+ * @param   root        Process at top of tree.
+ * @return  Usage of tree (zero if root is gone).
+ *
+ * CPU time includes children that have exited and been waited for (as
+ * forked handlers are), so the difference between two calls covers every
+ * process that ran in between.
+ **/
+static ServerUsage bench_usage(pid_t root)
+{
+    static pid_t pids[4096], parents[4096];
+    static uint64_t cpus[4096], rsses[4096];
+    ServerUsage usage = {0, 0};
+    size_t n = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    struct dirent *e;
+    DIR *d;
+
+    if (root <= 0 || !(d = opendir("/proc")))
+        return usage;
+
+    /* Read parent, CPU time (fields 14-17) and RSS (field 24) of every process */
+    while (n < sizeof(pids) / sizeof(pids[0]) && (e = readdir(d)))
+    {
+        char path[64], buffer[1024], *p;
+        unsigned long utime, stime, rss;
+        long cutime, cstime;
+        int ppid, fd;
+        ssize_t length;
+
+        pid_t pid = strtol(e->d_name, NULL, 10);
+        if (pid <= 0)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            continue;
+        length = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        if (length <= 0 || !(p = strrchr((buffer[length] = '\0', buffer), ')')))
+            continue;
+        if (sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld %*d %*d %*d %*d %*u %*u %lu",
+                   &ppid, &utime, &stime, &cutime, &cstime, &rss) != 6)
+            continue;
+        pids[n] = pid;
+        parents[n] = ppid;
+        cpus[n] = utime + stime + cutime + cstime;
+        rsses[n] = rss * page;
+        n++;
+    }
+    closedir(d);
+
+    /* Walk down from root: each pass adds the children of processes added */
+    bool added[4096] = {false};
+    for (bool grew = true; grew; )
+    {
+        grew = false;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (added[i])
+                continue;
+            bool member = pids[i] == root;
+            for (size_t j = 0; j < n && !member; j++)
+                member = added[j] && pids[j] == parents[i];
+            if (member)
+            {
+                added[i] = grew = true;
+                usage.cpu += cpus[i];
+                usage.rss += rsses[i];
+            }
+        }
+    }
+    return usage;
+}
+
+/**
+ * Record result of request.
+ *
+ * @param   c           Connection that finished.
+ * @param   failed      Whether the request failed outright.
+ * @param   measuring   Whether the request counts towards the results.
+ **/
+static void bench_finish(BenchConnection *c, bool failed, bool measuring)
+{
+    const TraceEntry *e = &Trace[c->entry];
+    int status = 0;
+
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    if (!measuring)
+        return;
+
+    c->head[c->headlen < sizeof(c->head) ? c->headlen : sizeof(c->head) - 1] = '\0';
+    if (!failed && sscanf(c->head, "HTTP/%*d.%*d %d", &status) != 1)
+        failed = true;
+    if (failed || (e->status ? status != e->status : status >= 400))
+    {
+        Errors++;
+        return;
+    }
+
+    if (NLatencies == Capacity)
+    {
+        Capacity = Capacity ? Capacity * 2 : 65536;
+        if (!(Latencies = realloc(Latencies, Capacity * sizeof(uint32_t))))
+        {
+            fatal("Unable to allocate latencies: %s", strerror(errno));
+        }
+    }
+    uint64_t latency = bench_now() - c->start;
+    Latencies[NLatencies++] = latency > UINT32_MAX ? UINT32_MAX : latency;
+}
+
+/**
+ * Start next request of trace on connection.
+ *
+ * @return  true if the connection was started.
+ **/
+static bool bench_start(int epfd, BenchConnection *c)
+{
+    struct epoll_event event = {.events = EPOLLOUT | EPOLLIN, .data.ptr = c};
+    int one = 1;
+
+    c->entry = Cursor++ % NTrace;
+    c->sent = 0;
+    c->headlen = 0;
+    c->start = bench_now();
+
+    c->fd = socket(Address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+        return false;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if ((connect(c->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &event) < 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Make progress on connection.
+ *
+ * @return  true if the request is done (or failed).
+ **/
+static bool bench_progress(BenchConnection *c, uint32_t events, int epfd)
+{
+    static char buffer[BENCH_BUFFER];
+    const TraceEntry *e = &Trace[c->entry];
+    ssize_t n;
+
+    if (events & EPOLLERR)
+        return true;
+
+    /* Send request once connected */
+    while (c->sent < e->length)
+    {
+        n = write(c->fd, e->request + c->sent, e->length - c->sent);
+        if (n < 0)
+            return errno != EAGAIN && errno != EINTR;
+        c->sent += n;
+        if (c->sent == e->length)
+        {
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = c};
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &event);
+        }
+    }
+
+    /* Read response until the server closes the connection */
+    while ((n = read(c->fd, buffer, sizeof(buffer))) > 0)
+    {
+        size_t copy = sizeof(c->head) - 1 - c->headlen < (size_t)n ? sizeof(c->head) - 1 - c->headlen : (size_t)n;
+        memcpy(c->head + c->headlen, buffer, copy);
+        c->headlen += copy;
+        Bytes += n;
+    }
+    return n == 0 || (errno != EAGAIN && errno != EINTR);
+}
+
+/**
+ * Compare latencies.
+ **/
+static int bench_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Return latency at percentile in milliseconds.
+ **/
+static double bench_percentile(double percentile)
+{
+    if (NLatencies == 0)
+        return 0;
+    size_t index = percentile * NLatencies / 100;
+    return Latencies[index < NLatencies ? index : NLatencies - 1] / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct epoll_event events[256];
+    BenchConnection *connections;
+    ServerUsage before, after, peak = {0, 0};
+    long clients = 10, duration = 10, warmup = 1;
+    pid_t server = 0;
+    bool header = false;
+    int argind = 1, status, epfd;
+
+    /* Parse command line options */
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-')
+    {
+        char *arg = argv[argind++];
+        switch (arg[1])
+        {
+        case 'h':
+            usage(argv[0], EXIT_SUCCESS);
+            break;
+        case 'H':
+            header = true;
+            break;
+        case 'c':
+            if (argind >= argc)
+                usage(argv[0], EXIT_FAILURE);
+            clients = strtol(argv[argind++], NULL, 10);
+            break;
+        case 'd':
+            if (argind >= argc)
+                usage(argv[0], EXIT_FAILURE);
+            duration = strtol(argv[argind++], NULL, 10);
+            break;
+        case 'w':
+            if (argind >= argc)
+                usage(argv[0], EXIT_FAILURE);
+            warmup = strtol(argv[argind++], NULL, 10);
+            break;
+        case 'p':
+            if (argind >= argc)
+                usage(argv[0], EXIT_FAILURE);
+            server = strtol(argv[argind++], NULL, 10);
+            break;
+        default:
+            usage(argv[0], EXIT_FAILURE);
+            break;
+        }
+    }
+    if (argc - argind != 2 || clients < 1 || duration < 1 || warmup < 0)
+        usage(argv[0], EXIT_FAILURE);
+
+    /* Resolve server address */
+    char *host = strdup(argv[argind]), *port = strrchr(host, ':');
+    if (!port)
+        usage(argv[0], EXIT_FAILURE);
+    *port++ = '\0';
+    if ((status = getaddrinfo(host, port, &hints, &Address)) != 0)
+    {
+        fatal("Unable to look up %s: %s", argv[argind], gai_strerror(status));
+    }
+    bench_load(argv[argind + 1], argv[argind]);
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || !(connections = calloc(clients, sizeof(BenchConnection))))
+    {
+        fatal("Unable to set up connections: %s", strerror(errno));
+    }
+
+    /* Keep every connection busy: warm up, then measure */
+    uint64_t begin = bench_now(), start = begin + warmup * 1000000, end = start + duration * 1000000;
+    uint64_t tick = start, now;
+    bool measuring = warmup == 0;
+    if (measuring)
+        before = bench_usage(server);
+    for (long i = 0; i < clients; i++)
+    {
+        connections[i].fd = -1;
+        if (!bench_start(epfd, &connections[i]))
+            Errors += measuring;
+    }
+
+    while ((now = bench_now()) < end)
+    {
+        if (!measuring && now >= start)
+        {
+            measuring = true;
+            NLatencies = Errors = Bytes = 0;
+            before = bench_usage(server);
+        }
+        if (measuring && now >= tick)
+        {
+            ServerUsage usage = bench_usage(server);
+            peak.rss = usage.rss > peak.rss ? usage.rss : peak.rss;
+            tick = now + BENCH_TICK * 1000;
+        }
+
+        int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), BENCH_TICK);
+        for (int i = 0; i < n; i++)
+        {
+            BenchConnection *c = events[i].data.ptr;
+            if (c->fd >= 0 && bench_progress(c, events[i].events, epfd))
+            {
+                bench_finish(c, false, measuring);
+                if (!bench_start(epfd, c))
+                    Errors += measuring;
+            }
+        }
+
+        /* Fail requests that take too long, and restart idle connections */
+        for (long i = 0; i < clients; i++)
+        {
+            BenchConnection *c = &connections[i];
+            if (c->fd >= 0 && now > c->start + BENCH_TIMEOUT * 1000)
+                bench_finish(c, true, measuring);
+            if (c->fd < 0 && !bench_start(epfd, c))
+                Errors += measuring;
+        }
+    }
+    after = bench_usage(server);
+    double elapsed = (bench_now() - start) / 1e6;
+
+    /* Report one line of results */
+    qsort(Latencies, NLatencies, sizeof(uint32_t), bench_compare);
+    if (header)
+        printf("clients,requests,errors,seconds,rps,mib_s,p50_ms,p99_ms,cpu_pct,rss_mib\n");
+    printf("%ld,%zu,%lu,%.2f,%.1f,%.1f,%.3f,%.3f,%.1f,%.1f\n",
+           clients, NLatencies, (unsigned long)Errors, elapsed,
+           NLatencies / elapsed, Bytes / elapsed / 1048576.0,
+           bench_percentile(50), bench_percentile(99),
+           server ? (after.cpu - before.cpu) * 100.0 / sysconf(_SC_CLK_TCK) / elapsed : 0.0,
+           peak.rss / 1048576.0);
+
+    for (long i = 0; i < clients; i++)
+        if (connections[i].fd >= 0)
+            close(connections[i].fd);
+    free(connections);
+    free(Latencies);
+    freeaddrinfo(Address);
+    free(host);
+    return Errors && !NLatencies ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,407 @@
+/* spidey-pack: Pack Document Root into Archive */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define PACK_GZIP_MIN   256             /* Smallest file worth compressing */
+
+static const char *MimeTypes = "/etc/mime.types";
+static const char *FallbackMimeType = "text/plain";
+static bool        Compress = false;
+
+static FILE         *Output = NULL;     /* Archive being written */
+static uint64_t      Offset = 0;        /* Bytes written to Output */
+static FILE         *Strings = NULL;    /* Strings region (appended last) */
+static char         *StringsBuffer = NULL;
+static size_t        StringsLength = 0;
+static ArchiveEntry *Entries = NULL;    /* Entries (string offsets relative to Strings) */
+static size_t        NEntries = 0;
+static size_t        Capacity = 0;
+
+/**
+ * Display usage message and exit with specified status code.
+ **/
+static void usage(const char *progname, int status)
+{
+    fprintf(stderr, "Usage: %s [options] root archive\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -z            Add gzip variants of files that compress\n");
+    exit(status);
+}
+
+/**
+ * Append data to archive.
+ *
+ * @return  Offset of data in archive.
+ **/
+static uint64_t pack_write(const void *data, size_t length)
+{
+    uint64_t offset = Offset;
+
+    if (length && fwrite(data, 1, length, Output) != length)
+    {
+        fatal("Unable to write archive: %s", strerror(errno));
+    }
+    Offset += length;
+    return offset;
+}
+
+/**
+ * Append NUL-terminated string to strings region.
+ *
+ * @return  Offset of string relative to strings region.
+ **/
+static uint64_t pack_string(const char *data, size_t length)
+{
+    uint64_t offset = ftello(Strings);
+
+    fwrite(data, 1, length, Strings);
+    fputc('\0', Strings);
+    return offset;
+}
+
+/**
+ * Write body of variant and format its entity tag and header block.
+ *
+ * @param   v           Variant to fill in.
+ * @param   mimetype    Mimetype of file.
+ * @param   body        Contents of variant.
+ * @param   length      Length of contents.
+ * @param   hash        Hash of original file contents.
+ * @param   gzip        Whether this is the gzip variant.
+ * @param   vary        Whether the file has a gzip variant (Vary: Accept-Encoding).
+ **/
+static void pack_variant(ArchiveVariant *v, const char *mimetype, const void *body, size_t length,
+                         uint64_t hash, bool gzip, bool vary)
+{
+    char etag[64];
+    char *head = NULL;
+    int n;
+
+    n = snprintf(etag, sizeof(etag), "\"%zx-%016llx%s\"", length, (unsigned long long)hash, gzip ? "-gz" : "");
+    v->etag = pack_string(etag, n);
+    v->etag_length = n;
+
+    n = asprintf(&head, "Content-Type: %s\r\nContent-Length: %zu\r\n%sETag: %s\r\n%s",
+                 mimetype, length, gzip ? "Content-Encoding: gzip\r\n" : "", etag,
+                 vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (n < 0)
+    {
+        fatal("Unable to format headers: %s", strerror(errno));
+    }
+    v->head = pack_string(head, n);
+    v->head_length = n;
+    free(head);
+
+    v->body = pack_write(body, length);
+    v->length = length;
+}
+
+/**
+ * Compress contents with gzip.
+ *
+ * @return  Allocated compressed contents, or NULL if they do not shrink by at
+ * least a tenth.
+ **/
+static void *pack_gzip(const void *data, size_t length, size_t *compressed)
+{
+    z_stream z = {0};
+    void *buffer;
+
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    *compressed = deflateBound(&z, length);
+    if (!(buffer = malloc(*compressed)))
+    {
+        deflateEnd(&z);
+        return NULL;
+    }
+
+    z.next_in = (Bytef *)data;
+    z.avail_in = length;
+    z.next_out = buffer;
+    z.avail_out = *compressed;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out > length - length / 10)
+    {
+        deflateEnd(&z);
+        free(buffer);
+        return NULL;
+    }
+
+    *compressed = z.total_out;
+    deflateEnd(&z);
+    return buffer;
+}
+
+/**
+ * Add file to archive.
+ *
+ * @param   fd          Open file descriptor of file.
+ * @param   relative    Path relative to root.
+ **/
+static void pack_file(int fd, const char *relative)
+{
+    ArchiveEntry *e;
+    struct stat s;
+    char *data = NULL;
+    void *gzip = NULL;
+    size_t length = 0;
+    size_t compressed = 0;
+    uint64_t hash = 14695981039346656037ull;
+    char *mimetype;
+
+    if (fstat(fd, &s) < 0 || !(data = malloc(s.st_size ? s.st_size : 1)))
+    {
+        fatal("Unable to read %s: %s", relative, strerror(errno));
+    }
+
+    while (length < (size_t)s.st_size)
+    {
+        ssize_t n = read(fd, data + length, s.st_size - length);
+        if (n <= 0)
+        {
+            fatal("Unable to read %s: %s", relative, n < 0 ? strerror(errno) : "truncated");
+        }
+        length += n;
+    }
+
+    /* Entity tag: length and FNV-1a hash of contents */
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+
+    if (Compress && length >= PACK_GZIP_MIN)
+        gzip = pack_gzip(data, length, &compressed);
+
+    if (NEntries == Capacity)
+    {
+        Capacity = Capacity ? 2 * Capacity : 256;
+        if (!(Entries = realloc(Entries, Capacity * sizeof(ArchiveEntry))))
+        {
+            fatal("Unable to allocate entries: %s", strerror(errno));
+        }
+    }
+
+    e = &Entries[NEntries++];
+    memset(e, 0, sizeof(*e));
+    e->path = pack_string(relative, strlen(relative));
+    e->path_length = strlen(relative);
+    e->hash = hash_string(relative);
+
+    mimetype = determine_mimetype(relative, FallbackMimeType);
+    pack_variant(&e->identity, mimetype, data, length, hash, false, gzip != NULL);
+    if (gzip)
+        pack_variant(&e->gzip, mimetype, gzip, compressed, hash, true, true);
+
+    debug("Packed %s (%s, %zu bytes%s)", relative, mimetype, length, gzip ? ", gzip" : "");
+    free(mimetype);
+    free(gzip);
+    free(data);
+}
+
+/**
+ * Add directory to archive, recursively and in sorted order.
+ *
+ * @param   dirfd       Directory file descriptor.
+ * @param   prefix      Path of directory relative to root ("" for root).
+ *
+ * Executable files (CGI scripts) and anything that is not a regular file or
+ * directory (symbolic links included) are left out; the server finds them in
+ * its root directory instead.
+ **/
+static void pack_directory(int dirfd, const char *prefix)
+{
+    struct dirent **names;
+    int n = scandirat(dirfd, ".", &names, NULL, alphasort);
+
+    if (n < 0)
+    {
+        fatal("Unable to scan %s: %s", *prefix ? prefix : ".", strerror(errno));
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        const char *name = names[i]->d_name;
+        char *relative = NULL;
+        struct stat s;
+        int fd;
+
+        if (streq(name, ".") || streq(name, "..") ||
+            asprintf(&relative, "%s%s%s", prefix, *prefix ? "/" : "", name) < 0)
+        {
+            free(names[i]);
+            continue;
+        }
+
+        if (fstatat(dirfd, name, &s, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+            log("Skipping %s: %s", relative, strerror(errno));
+        }
+        else if (S_ISDIR(s.st_mode) && (fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0)
+        {
+            pack_directory(fd, relative);
+            close(fd);
+        }
+        else if (S_ISREG(s.st_mode) && !(s.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) &&
+                 (fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) >= 0)
+        {
+            pack_file(fd, relative);
+            close(fd);
+        }
+        else
+        {
+            log("Skipping %s: not a regular, non-executable file", relative);
+        }
+
+        free(relative);
+        free(names[i]);
+    }
+    free(names);
+}
+
+/**
+ * Build index, entries, and strings, then write the header.
+ **/
+static void pack_finish(void)
+{
+    static const char Padding[8] = {0};
+    ArchiveHeader header = {.count = NEntries, .slots = 16};
+    uint32_t *index;
+    uint64_t strings;
+
+    while (header.slots < 2 * NEntries)
+        header.slots <<= 1;
+
+    if (!(index = calloc(header.slots, sizeof(uint32_t))))
+    {
+        fatal("Unable to allocate index: %s", strerror(errno));
+    }
+
+    for (size_t i = 0; i < NEntries; i++)
+    {
+        uint32_t slot = Entries[i].hash & (header.slots - 1);
+        while (index[slot])
+            slot = (slot + 1) & (header.slots - 1);
+        index[slot] = i + 1;
+    }
+
+    /* Index and entries follow the bodies (8-byte aligned) */
+    pack_write(Padding, (8 - Offset % 8) % 8);
+    header.index = pack_write(index, header.slots * sizeof(uint32_t));
+    header.entries = Offset;
+    strings = header.entries + NEntries * sizeof(ArchiveEntry);
+
+    for (size_t i = 0; i < NEntries; i++)
+    {
+        ArchiveEntry *e = &Entries[i];
+        ArchiveVariant *variants[] = {&e->identity, &e->gzip};
+
+        e->path += strings;
+        for (size_t v = 0; v < 2; v++)
+        {
+            if (variants[v]->head_length)
+            {
+                variants[v]->head += strings;
+                variants[v]->etag += strings;
+            }
+        }
+    }
+    pack_write(Entries, NEntries * sizeof(ArchiveEntry));
+
+    fclose(Strings);
+    pack_write(StringsBuffer, StringsLength);
+
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.size = Offset;
+    if (fseeko(Output, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, Output) != 1)
+    {
+        fatal("Unable to write archive header: %s", strerror(errno));
+    }
+    free(index);
+}
+
+/**
+ * Pack root directory into archive for spidey -A.
+ **/
+int main(int argc, char *argv[])
+{
+    ArchiveHeader placeholder = {{0}};
+    char *temporary = NULL;
+    int argind = 1;
+    int rootfd;
+
+    /* Parse command line options */
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-')
+    {
+        char *arg = argv[argind++];
+        switch (arg[1])
+        {
+        case 'h':
+            usage(argv[0], EXIT_SUCCESS);
+            break;
+        case 'm':
+            if (argind >= argc)
+                usage(argv[0], EXIT_FAILURE);
+            MimeTypes = argv[argind++];
+            break;
+        case 'M':
+            if (argind >= argc)
+                usage(argv[0], EXIT_FAILURE);
+            FallbackMimeType = argv[argind++];
+            break;
+        case 'z':
+            Compress = true;
+            break;
+        default:
+            usage(argv[0], EXIT_FAILURE);
+            break;
+        }
+    }
+    if (argc - argind != 2)
+        usage(argv[0], EXIT_FAILURE);
+
+    mimetypes_load(MimeTypes);
+
+    rootfd = open(argv[argind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd < 0)
+    {
+        fatal("Unable to open root directory %s: %s", argv[argind], strerror(errno));
+    }
+
+    /* Write to temporary file and rename, so servers never map a partial archive */
+    if (asprintf(&temporary, "%s.tmp", argv[argind + 1]) < 0 || !(Output = fopen(temporary, "w")) ||
+        !(Strings = open_memstream(&StringsBuffer, &StringsLength)))
+    {
+        fatal("Unable to create %s: %s", temporary ? temporary : argv[argind + 1], strerror(errno));
+    }
+
+    pack_write(&placeholder, sizeof(placeholder));
+    pack_directory(rootfd, "");
+    pack_finish();
+    close(rootfd);
+
+    if (fflush(Output) || fsync(fileno(Output)) < 0 || fclose(Output) || rename(temporary, argv[argind + 1]) < 0)
+    {
+        unlink(temporary);
+        fatal("Unable to write %s: %s", argv[argind + 1], strerror(errno));
+    }
+
+    log("Packed %zu files into %s (%llu bytes)", NEntries, argv[argind + 1], (unsigned long long)Offset);
+    free(temporary);
+    free(StringsBuffer);
+    free(Entries);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 
 /* Global Variables */
@@ -13,6 +14,97 @@ char *Port = "9898";
 char *MimeTypesPath = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath = "www";
+int   RootFd = -1;
+char *CertificatePath = NULL;
+char *KeyPath = NULL;
+char *ConfigPath = NULL;
+char *ArchivePath = NULL;
+
+static char *RootOption = NULL;         /* Root directory as configured */
+
+/* Tunables */
+int ListenBacklog = 4096;
+int DualStack     = 1;
+int DeferAccept   = 5;
+int FastOpenQueue = 256;
+int TcpNoDelay    = 1;
+int TcpCork       = 1;
+int MaxConnections = 1024;
+int IdleTimeout    = 5;
+int HeaderTimeout  = 10;
+int BodyTimeout    = 30;
+int WriteTimeout   = 30;
+int KernelTls      = 1;
+int ProxyTimeout   = 30;
+int ProxyPoolSize  = 16;
+int RateLimit      = 0;
+int RateBurst      = 0;
+int ClientConnections = 0;
+int RateSlots      = 16384;
+int BrowseSort     = 4096;
+int CgiCacheTtl    = 0;
+int CgiCacheMax    = 1048576;
+int CgiCacheSlots  = 1024;
+int NegativeSlots  = 16384;
+int LargeFileSize  = 268435456;
+int ReadaheadSize  = 2097152;
+int DropBehind     = 1;
+int DirectIo       = 0;
+int SendRate       = 0;
+int TotalRate      = 0;
+int SendSlice      = 262144;
+int Profile        = 0;
+int Workers        = 1;
+int CpuAffinity    = 0;
+int AcceptShard    = 1;
+int CoroutineStack = 262144;
+
+/**
+ * Named tunables that may be set with -o name=value
+ */
+typedef struct {
+	const char *name;                   /**< Name of tunable */
+	int        *value;                  /**< Pointer to tunable variable */
+} Tunable;
+
+static Tunable Tunables[] = {
+	{"backlog",          &ListenBacklog},
+	{"dual_stack",       &DualStack},
+	{"defer_accept",     &DeferAccept},
+	{"fastopen",         &FastOpenQueue},
+	{"nodelay",          &TcpNoDelay},
+	{"cork",             &TcpCork},
+	{"max_connections",  &MaxConnections},
+	{"idle_timeout",     &IdleTimeout},
+	{"header_timeout",   &HeaderTimeout},
+	{"body_timeout",     &BodyTimeout},
+	{"write_timeout",    &WriteTimeout},
+	{"ktls",             &KernelTls},
+	{"proxy_timeout",    &ProxyTimeout},
+	{"proxy_pool",       &ProxyPoolSize},
+	{"rate_limit",       &RateLimit},
+	{"rate_burst",       &RateBurst},
+	{"client_connections", &ClientConnections},
+	{"rate_slots",       &RateSlots},
+	{"browse_sort",      &BrowseSort},
+	{"cgi_cache",        &CgiCacheTtl},
+	{"cgi_cache_max",    &CgiCacheMax},
+	{"cgi_cache_slots",  &CgiCacheSlots},
+	{"negative_cache",   &NegativeSlots},
+	{"large_file",       &LargeFileSize},
+	{"readahead",        &ReadaheadSize},
+	{"drop_behind",      &DropBehind},
+	{"direct_io",        &DirectIo},
+	{"send_rate",        &SendRate},
+	{"total_rate",       &TotalRate},
+	{"send_slice",       &SendSlice},
+	{"profile",          &Profile},
+	{"workers",          &Workers},
+	{"cpu_affinity",     &CpuAffinity},
+	{"accept_shard",     &AcceptShard},
+	{"coroutine_stack",  &CoroutineStack},
+	{NULL,               NULL},
+};
 
 /**
  * Display usage message and exit with specified status code.
@@ -22,17 +114,121 @@ char *RootPath = "www";
  */
 void usage(const char *progname, int status)
 {
-	fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+	fprintf(stderr, "Usage: %s [hcfmMproACKPV]\n", progname);
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "    -h            Display help message\n");
-	fprintf(stderr, "    -c mode       Single or Forking mode\n");
+	fprintf(stderr, "    -c mode       Single, Forking, or Event mode\n");
+	fprintf(stderr, "    -f path       File of name=value tunables (reread on SIGHUP)\n");
 	fprintf(stderr, "    -m path       Path to mimetypes file\n");
 	fprintf(stderr, "    -M mimetype   Default mimetype\n");
 	fprintf(stderr, "    -p port       Port to listen on\n");
 	fprintf(stderr, "    -r path       Root directory\n");
+	fprintf(stderr, "    -A path       Archive built by spidey-pack (served before root directory)\n");
+	fprintf(stderr, "    -C path       TLS certificate chain (serve HTTPS)\n");
+	fprintf(stderr, "    -K path       TLS private key (defaults to certificate)\n");
+	fprintf(stderr, "    -P route      Proxy prefix=host:port[,host:port...] (repeatable)\n");
+	fprintf(stderr, "    -V vhost      Virtual host name=root[,mime=type][,cgi=0|1][,browse=0|1] (repeatable)\n");
+	fprintf(stderr, "    -o name=value Set tunable:\n");
+	for (Tunable *t = Tunables; t->name; t++)
+	{
+		fprintf(stderr, "                      %-16s (%d)\n", t->name, *t->value);
+	}
 	exit(status);
 }
 
+/**
+ * Set named tunable.
+ *
+ * @param   option      String of the form name=value.
+ * @return  true if the tunable exists and the value is an integer.
+ */
+bool set_tunable(const char *option)
+{
+	const char *equal = strchr(option, '=');
+	char *end;
+
+	if (!equal)
+	{
+		return false;
+	}
+
+	for (Tunable *t = Tunables; t->name; t++)
+	{
+		if (strlen(t->name) == (size_t)(equal - option) && !strncmp(t->name, option, equal - option))
+		{
+			long value = strtol(equal + 1, &end, 10);
+			if (end == equal + 1 || *end)
+			{
+				return false;
+			}
+			*t->value = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Load tunables from file.
+ *
+ * @param   path        Path to file of name=value lines ('#' starts a comment).
+ * @return  true if every line set a tunable.
+ *
+ * Either every tunable in the file is applied or, if any line is invalid,
+ * none is.
+ */
+bool load_config(const char *path)
+{
+	int saved[sizeof(Tunables) / sizeof(Tunables[0])];
+	char buffer[BUFSIZ];
+	size_t line = 0;
+	bool valid = true;
+	FILE *fs = fopen(path, "r");
+
+	if (!fs)
+	{
+		log("Unable to open tunables file %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	for (size_t i = 0; Tunables[i].name; i++)
+	{
+		saved[i] = *Tunables[i].value;
+	}
+
+	while (valid && fgets(buffer, sizeof(buffer), fs))
+	{
+		size_t length = 0;
+
+		/* Strip comment and whitespace */
+		line++;
+		for (char *c = buffer; *c && *c != '#'; c++)
+		{
+			if (!strchr(WHITESPACE "\r", *c))
+			{
+				buffer[length++] = *c;
+			}
+		}
+		buffer[length] = '\0';
+
+		if (length > 0 && !set_tunable(buffer))
+		{
+			log("Invalid tunable on line %zu of %s: %s", line, path, buffer);
+			valid = false;
+		}
+	}
+	fclose(fs);
+
+	if (!valid)
+	{
+		for (size_t i = 0; Tunables[i].name; i++)
+		{
+			*Tunables[i].value = saved[i];
+		}
+	}
+	return valid;
+}
+
 /**
  * Parse command-line options.
  *
@@ -41,8 +237,10 @@ void usage(const char *progname, int status)
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, MimeTypesPath, DefaultMimeType, Port, RootPath,
+ * ArchivePath, CertificatePath, KeyPath, proxy routes, virtual hosts, and any
+ * tunables if specified.  Tunables from a -f file and from -o are applied in
+ * the order given.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode)
 {
@@ -61,6 +259,10 @@ bool parse_options(int argc, char *argv[], ServerMode *mode)
 			{
 				*mode = FORKING;
 			}
+			else if (streq(argv[argind], "event"))
+			{
+				*mode = EVENT;
+			}
 			else
 			{
 				return false;
@@ -70,6 +272,12 @@ bool parse_options(int argc, char *argv[], ServerMode *mode)
 		case 'h':
 			usage(argv[0], EXIT_SUCCESS);
 			break;
+		case 'f':
+			if (argind >= argc || !load_config(ConfigPath = argv[argind++]))
+			{
+				return false;
+			}
+			break;
 		case 'm':
 			MimeTypesPath = argv[argind++];
 			break;
@@ -82,6 +290,33 @@ bool parse_options(int argc, char *argv[], ServerMode *mode)
 		case 'r':
 			RootPath = argv[argind++];
 			break;
+		case 'A':
+			ArchivePath = argv[argind++];
+			break;
+		case 'C':
+			CertificatePath = argv[argind++];
+			break;
+		case 'K':
+			KeyPath = argv[argind++];
+			break;
+		case 'P':
+			if (argind >= argc || !proxy_add_route(argv[argind++]))
+			{
+				return false;
+			}
+			break;
+		case 'V':
+			if (argind >= argc || !vhost_add(argv[argind++]))
+			{
+				return false;
+			}
+			break;
+		case 'o':
+			if (argind >= argc || !set_tunable(argv[argind++]))
+			{
+				return false;
+			}
+			break;
 		default:
 			return false;
 			break;
@@ -90,6 +325,81 @@ bool parse_options(int argc, char *argv[], ServerMode *mode)
 	return true;
 }
 
+/**
+ * Open root directory, replacing RootPath and RootFd.
+ *
+ * @param   path        Root directory as configured.
+ * @return  true on success (on failure, RootPath and RootFd are unchanged).
+ */
+static bool open_root(const char *path)
+{
+	char *root = realpath(path, NULL);
+	int   fd;
+
+	if (!root)
+	{
+		log("Unable to resolve root directory %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		log("Unable to open root directory %s: %s", root, strerror(errno));
+		free(root);
+		return false;
+	}
+
+	if (RootFd >= 0)
+	{
+		control_retire(RootPath, 0, RootFd);
+	}
+	RootPath = root;
+	RootFd = fd;
+	return true;
+}
+
+/**
+ * Reload configuration (on SIGHUP).
+ *
+ * This rereads the tunables file, the mimetypes file, the TLS certificate and
+ * the packed archive, and reopens the document roots, so roots that are symbolic links follow
+ * their new targets.  Anything that fails to load keeps its previous value.
+ * The listening socket is untouched, and in forking mode requests already
+ * being handled finish with the configuration they started with.  In event
+ * mode, the replaced archive and roots stay open until the connections using
+ * them are freed (see control_retire).
+ */
+void server_reload(void)
+{
+	if (ConfigPath)
+	{
+		load_config(ConfigPath);
+	}
+
+	mimetypes_load(MimeTypesPath);
+
+	if (CertificatePath && tls_init(CertificatePath, KeyPath ? KeyPath : CertificatePath) < 0)
+	{
+		log("Keeping previous TLS certificate");
+	}
+
+	if (ArchivePath)
+	{
+		archive_open(ArchivePath);
+	}
+
+	open_root(RootOption);
+	vhost_reload();
+	vhost_build();
+
+	ratelimit_init();
+	shaping_init();
+	profile_init();
+	cgicache_init();
+	negcache_init();
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
@@ -104,7 +414,10 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	/* Listen to server socket */
+	/* Handle reload (SIGHUP), upgrade (SIGUSR2), and drain (SIGQUIT) */
+	control_init(argv);
+
+	/* Listen to server socket (or take it over from the server we replace) */
 	int server_socket = socket_listen(Port);
 	if (server_socket < 0)
 	{
@@ -113,32 +426,76 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	/* Determine real RootPath */
-	RootPath = realpath(RootPath, NULL);
+	/* Load TLS certificate and key (the listener then serves HTTPS) */
+	if (CertificatePath && tls_init(CertificatePath, KeyPath ? KeyPath : CertificatePath) < 0)
+	{
+		fatal("Unable to load TLS certificate %s", CertificatePath);
+	}
+
+	/* Load mimetypes (unknown extensions get the default mimetype on failure) */
+	mimetypes_load(MimeTypesPath);
+
+	/* Determine real RootPath and open it for relative lookups */
+	RootOption = RootPath;
+	if (!open_root(RootOption))
+	{
+		fatal("Unable to open root directory %s", RootOption);
+	}
+
+	/* Map packed archive (served in front of the root directory) */
+	if (ArchivePath && !archive_open(ArchivePath))
+	{
+		fatal("Unable to load archive %s", ArchivePath);
+	}
 
-	log("Listening on port %s", Port);
+	/* Build virtual host table (the root directory is the default host) */
+	vhost_build();
+
+	/* Share rate limits, the egress bucket, phase counters, cached CGI
+	 * responses and missing URIs with every process forked from here on */
+	ratelimit_init();
+	shaping_init();
+	profile_init();
+	cgicache_init();
+	negcache_init();
+
+	log("Listening on port %s (%s)", Port, CertificatePath ? "https" : "http");
 	debug("RootPath        = %s", RootPath);
 	debug("MimeTypesPath   = %s", MimeTypesPath);
 	debug("DefaultMimeType = %s", DefaultMimeType);
-	debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+	debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" : "Event");
+	debug("Workers         = %d", Workers);
 
 	int status;
 
-	// Start either forking or single HTTP server */
+	timer_wheel_init(&Timers, now_ms());
+
+	/* Note the CPUs we may run on (workers are pinned to them) */
+	workers_init();
+
+	/* If this server replaces another, the old one may now drain */
+	control_ready();
+
+	// Start either forking or single HTTP server (in each worker) */
 	if (mode == SINGLE)
 	{
-		status = single_server(server_socket);
+		status = workers_server(server_socket, single_server);
 	}
 	else if (mode == FORKING)
 	{
-		status = forking_server(server_socket);
+		status = workers_server(server_socket, forking_server);
+	}
+	else if (mode == EVENT)
+	{
+		status = workers_server(server_socket, event_server);
 	}
 	else
 	{
 		debug("Warning: ConcurrencyMode not specified. Defaulting to a single HTTP server.");
-		status = single_server(server_socket);
+		status = workers_server(server_socket, single_server);
 	}
 
+	close(RootFd);
 	free(RootPath);
 	return status;
 }
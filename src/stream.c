@@ -0,0 +1,192 @@
+/* stream.c: Large File Streaming */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define STREAM_ALIGN    4096            /* Buffer and offset alignment for O_DIRECT */
+#define STREAM_QUEUED   (64 << 20)      /* Sent bytes that may still be queued on sockets */
+#define STREAM_POLL     1               /* Milliseconds between checks for readahead in a coroutine */
+#define STREAM_PATIENCE 100             /* Checks before a coroutine reads anyway */
+
+/**
+ * Return bytes of file to send per step (the readahead window).
+ **/
+static size_t stream_window(void)
+{
+    size_t window = ReadaheadSize > STREAM_ALIGN ? (size_t)ReadaheadSize : STREAM_ALIGN;
+
+    return window / STREAM_ALIGN * STREAM_ALIGN;
+}
+
+/**
+ * Return whether the byte of file at offset is in the page cache.
+ **/
+static bool stream_cached(int fd, off_t offset)
+{
+    char byte;
+    struct iovec iov = {&byte, 1};
+
+    return preadv2(fd, &iov, 1, offset, RWF_NOWAIT) == 1;
+}
+
+/**
+ * Drop windows of file this request read in, up to window last.
+ *
+ * @param   fd          File descriptor.
+ * @param   base        Offset of window 0.
+ * @param   window      Size of window.
+ * @param   owned       Bit (i % 64) set if window i was read in by this request.
+ * @param   last        Window after the last to drop.
+ * @param   depth       Number of windows before last to drop.
+ **/
+static void stream_drop(int fd, off_t base, size_t window, uint64_t owned, off_t last, off_t depth)
+{
+    for (off_t i = last > depth ? last - depth : 0; i < last; i++)
+        if (owned & (1ull << (i % 64)))
+            posix_fadvise(fd, base + i * (off_t)window, window, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * Send file with O_DIRECT reads, bypassing the page cache.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          File descriptor (O_DIRECT already set).
+ * @param   offset      Offset in file of first byte to send.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes written or -1 on error.
+ *
+ * Reads start at aligned offsets into an aligned buffer; the bytes before
+ * offset in the first block are skipped.  Each buffer goes out in slices
+ * paced by shaping_slice, as response_sendfile sends.
+ **/
+static ssize_t stream_direct(Request *r, int fd, off_t offset, size_t length)
+{
+    size_t window = stream_window();
+    char *buffer = aligned_alloc(STREAM_ALIGN, window);
+    size_t total = 0;
+
+    if (!buffer)
+        return -1;
+
+    while (total < length)
+    {
+        off_t  aligned = offset & ~(off_t)(STREAM_ALIGN - 1);
+        size_t skip = offset - aligned;
+        ssize_t n = pread(fd, buffer, window, aligned);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= (ssize_t)skip)         /* Error, or file truncated underneath us */
+        {
+            debug("pread (O_DIRECT) failed: %s", n < 0 ? strerror(errno) : "end of file");
+            break;
+        }
+
+        size_t chunk = (size_t)n - skip < length - total ? (size_t)n - skip : length - total;
+        for (size_t done = 0; done < chunk; )
+        {
+            size_t slice = shaping_slice(r, total, chunk - done);
+            if (response_write(r, buffer + skip + done, slice) < 0)
+                goto finish;
+            done  += slice;
+            total += slice;
+        }
+        offset += chunk;
+    }
+
+finish:
+    free(buffer);
+    return total == length ? (ssize_t)total : -1;
+}
+
+/**
+ * Send remainder of a large file as response body.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          File descriptor to read from.
+ * @param   offset      Offset in file of first byte to send.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes written or -1 on error.
+ *
+ * Streaming a file much larger than the page cache would otherwise evict
+ * the small, hot files everything else is served from.  Instead:
+ *
+ * - The file is read sequentially (POSIX_FADV_SEQUENTIAL), and the next
+ *   ReadaheadSize bytes are read ahead (readahead) while the current ones
+ *   are sent, so the socket does not wait on the disk.  In a coroutine, the
+ *   loop serves other clients while a window is still being read (for up to
+ *   STREAM_PATIENCE polls), rather than blocking in sendfile.
+ * - With DropBehind, windows sent earlier are dropped from the page cache
+ *   (POSIX_FADV_DONTNEED).  The kernel keeps pages that sendfile left queued
+ *   on a socket (until acknowledged, or until a local client reads them), so
+ *   each of the last STREAM_QUEUED bytes is dropped again on every step.
+ *   Only windows this request read in are dropped: a window already cached
+ *   when it is read ahead is in use elsewhere, and is left alone.
+ * - With DirectIo, the file is read with O_DIRECT into an aligned buffer and
+ *   never enters the page cache, at the cost of copying it through user
+ *   space.  File systems without O_DIRECT (tmpfs) use the page cache.
+ **/
+ssize_t stream_file(Request *r, int fd, off_t offset, size_t length)
+{
+    size_t window = stream_window();
+    off_t  end = offset + length;
+    off_t  base = offset;               /* Offset of window 0 */
+    off_t  ahead = 0;                   /* Windows read ahead */
+    off_t  sent = 0;                    /* Windows sent */
+    off_t  depth = STREAM_QUEUED / window + 1;
+    uint64_t owned = 0;                 /* Windows read in by this request (see stream_drop) */
+    int    flags;
+
+    if (DirectIo && (flags = fcntl(fd, F_GETFL)) >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0)
+    {
+        debug("Streaming %zu bytes with O_DIRECT", length);
+        return stream_direct(r, fd, offset, length);
+    }
+
+    if (depth > 61)                     /* Keep the two windows read ahead in owned too */
+        depth = 61;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (offset < end)
+    {
+        size_t chunk = (size_t)(end - offset) < window ? (size_t)(end - offset) : window;
+
+        /* Keep one window read ahead of the one being sent (checking the
+         * last byte of each, beyond the kernel's own readahead) */
+        for (; ahead <= sent + 1 && base + ahead * (off_t)window < end; ahead++)
+        {
+            off_t start = base + ahead * (off_t)window;
+            off_t next = start + (off_t)window < end ? start + (off_t)window : end;
+            if (DropBehind && !stream_cached(fd, next - 1))
+                owned |= 1ull << (ahead % 64);
+            else
+                owned &= ~(1ull << (ahead % 64));
+            readahead(fd, start, next - start);
+        }
+
+        for (int i = 0; coroutine_self() && i < STREAM_PATIENCE && !stream_cached(fd, offset + chunk - 1); i++)
+            coroutine_wait(-1, 0, now_ms() + STREAM_POLL);
+
+        if (response_sendfile(r, fd, offset, chunk) < 0)
+            return -1;
+        offset += chunk;
+        sent++;
+
+        /* Drop windows before the one just sent */
+        if (DropBehind)
+            stream_drop(fd, base, window, owned, sent - 1, depth);
+    }
+
+    /* Drop the rest (what is still queued on the socket stays cached) */
+    if (DropBehind)
+        stream_drop(fd, base, window, owned, sent, depth);
+    return length;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
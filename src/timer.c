@@ -0,0 +1,234 @@
+/* timer.c: Hierarchical Timer Wheel */
+
+#include "spidey.h"
+
+#include <limits.h>
+#include <time.h>
+
+/* Process-wide timer wheel driven by whichever concurrency mode is running */
+TimerWheel Timers;
+
+#define TIMER_BITS      6
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+#define TIMER_SPAN(l)   (1ULL << (TIMER_BITS * ((l) + 1)))
+
+/**
+ * Return current monotonic time in milliseconds.
+ **/
+uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize timer wheel.
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   now         Current time in milliseconds.
+ **/
+void timer_wheel_init(TimerWheel *wheel, uint64_t now)
+{
+    for (int level = 0; level < TIMER_LEVELS; level++)
+    {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            Timer *head = &wheel->slots[level][slot];
+            head->next = head->prev = head;
+        }
+    }
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+/**
+ * Link timer into the slot matching its expiration.
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   timer       Timer to link.
+ *
+ * Level l holds timers expiring within 64^(l+1) ticks, indexed by the
+ * corresponding 6 bits of the expiration time.  Timers beyond the last level
+ * are parked there and re-cascaded until they come within range.  A timer
+ * expiring on the current tick (while cascading) lands in the level 0 slot
+ * about to be run.
+ **/
+static void timer_link(TimerWheel *wheel, Timer *timer)
+{
+    uint64_t expires = timer->expires;
+    int level = 0;
+
+    if (expires < wheel->now)
+        expires = wheel->now;
+    if (expires - wheel->now >= TIMER_SPAN(TIMER_LEVELS - 1))
+        expires = wheel->now + TIMER_SPAN(TIMER_LEVELS - 1) - 1;
+
+    while (expires - wheel->now >= TIMER_SPAN(level))
+        level++;
+
+    Timer *head = &wheel->slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/**
+ * Unlink timer from its slot.
+ **/
+static void timer_unlink(Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/**
+ * Schedule timer.
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   timer       Timer with callback set (rescheduled if pending).
+ * @param   expires     Absolute expiration time in milliseconds.
+ **/
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t expires)
+{
+    timer_cancel(wheel, timer);
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    timer_link(wheel, timer);
+    wheel->count++;
+}
+
+/**
+ * Cancel timer if it is pending.
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   timer       Timer to cancel.
+ **/
+void timer_cancel(TimerWheel *wheel, Timer *timer)
+{
+    if (timer->next)
+    {
+        timer_unlink(timer);
+        wheel->count--;
+    }
+}
+
+/**
+ * Move every timer in a higher level slot down to the level it now belongs.
+ **/
+static void timer_cascade(TimerWheel *wheel, int level, int slot)
+{
+    Timer *head = &wheel->slots[level][slot];
+
+    while (head->next != head)
+    {
+        Timer *timer = head->next;
+        timer_unlink(timer);
+        timer_link(wheel, timer);
+    }
+}
+
+/**
+ * Return first tick after the wheel's time at which a slot has timers to run
+ * or cascade (or UINT64_MAX if there is none).
+ *
+ * Level l is visited once every 64^l ticks, so each level's occupied slots
+ * are scanned in the order they come round.
+ **/
+static uint64_t timer_next(TimerWheel *wheel)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < TIMER_LEVELS; level++)
+    {
+        uint64_t position = wheel->now >> (TIMER_BITS * level);
+
+        for (uint64_t step = 1; step <= TIMER_SLOTS; step++)
+        {
+            Timer *head = &wheel->slots[level][(position + step) & TIMER_MASK];
+            if (head->next != head)
+            {
+                uint64_t tick = (position + step) << (TIMER_BITS * level);
+                if (tick < next)
+                    next = tick;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+/**
+ * Advance timer wheel and run callbacks of expired timers.
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   now         Current time in milliseconds.
+ * @return  Number of timers that fired.
+ *
+ * Runs of ticks with nothing to run or cascade are skipped, so advancing a
+ * wheel that sat idle (e.g. the one a forked child inherits) costs the same
+ * however long ago it was last advanced.
+ **/
+size_t timer_advance(TimerWheel *wheel, uint64_t now)
+{
+    size_t fired = 0;
+
+    while (wheel->now < now)
+    {
+        /* Jump to the present, or to just before the next tick with work */
+        uint64_t next = wheel->count ? timer_next(wheel) : UINT64_MAX;
+        if (next > now)
+        {
+            wheel->now = now;
+            break;
+        }
+
+        uint64_t tick = wheel->now = next;
+
+        /* Cascade higher levels whenever a lower level wraps around */
+        for (int level = 1; level < TIMER_LEVELS; level++)
+        {
+            if (tick & (TIMER_SPAN(level - 1) - 1))
+                break;
+            timer_cascade(wheel, level, (tick >> (TIMER_BITS * level)) & TIMER_MASK);
+        }
+
+        Timer *head = &wheel->slots[0][tick & TIMER_MASK];
+        while (head->next != head)
+        {
+            Timer *timer = head->next;
+            timer_unlink(timer);
+            wheel->count--;
+            fired++;
+            timer->callback(timer);
+        }
+    }
+
+    return fired;
+}
+
+/**
+ * Return milliseconds until the wheel next needs to be advanced.
+ *
+ * @param   wheel       TimerWheel structure.
+ * @param   now         Current time in milliseconds.
+ * @return  Timeout suitable for poll(2), or -1 if no timers are pending.
+ *
+ * This may return early (at a cascade boundary) but never late.
+ **/
+int timer_timeout(TimerWheel *wheel, uint64_t now)
+{
+    uint64_t next;
+
+    if (wheel->count == 0)
+        return -1;
+
+    next = timer_next(wheel);
+    if (next <= now)
+        return 0;
+    return next - now < INT_MAX ? (int)(next - now) : INT_MAX;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,301 @@
+/* tls.c: TLS Termination */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <poll.h>
+#include <signal.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define TLS_SESSION_CACHE   1024        /* Server-side session cache entries */
+#define TLS_RECORD_SIZE     16384       /* Largest TLS plaintext record */
+
+static SSL_CTX *TlsContext = NULL;
+
+/**
+ * Log and clear OpenSSL error queue.
+ **/
+static void tls_log_errors(const char *what)
+{
+    unsigned long error;
+
+    while ((error = ERR_get_error()))
+    {
+        log("%s: %s", what, ERR_error_string(error, NULL));
+    }
+}
+
+/**
+ * Absorb SIGPIPE from OpenSSL socket writes, which cannot pass MSG_NOSIGNAL.
+ *
+ * Unlike SIG_IGN, a handler is reset by exec, so CGI scripts still see the
+ * default disposition.
+ **/
+static void sigpipe_handler(int signum)
+{
+}
+
+/**
+ * Select application protocol (ALPN), preferring HTTP/2.
+ **/
+static int tls_select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                           const unsigned char *in, unsigned int inlen, void *arg)
+{
+    static const unsigned char Protocols[] = "\x02h2\x08http/1.1";
+
+    if (SSL_select_next_proto((unsigned char **)out, outlen, Protocols, sizeof(Protocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Initialize server TLS context.
+ *
+ * @param   certificate Path to PEM certificate chain.
+ * @param   key         Path to PEM private key.
+ * @return  0 on success, -1 on error (errors are logged).
+ *
+ * Sessions may be resumed from the server cache or from session tickets.
+ * Ticket keys are created with the context, so in forking mode tickets issued
+ * by one child are accepted by every other child.  When KernelTls is set,
+ * OpenSSL hands record encryption to the kernel after each handshake.
+ *
+ * Calling this again (on reload) replaces the context only if the new
+ * certificate and key load; sessions in progress keep the old context until
+ * they are freed.
+ **/
+int tls_init(const char *certificate, const char *key)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+
+    if (!ctx)
+        goto fail;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+    if (KernelTls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, certificate) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+        goto fail;
+
+    /* Session resumption: stateful cache plus stateless tickets */
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"spidey", 6);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+    SSL_CTX_set_num_tickets(ctx, 2);
+
+    SSL_CTX_set_alpn_select_cb(ctx, tls_select_alpn, NULL);
+
+    struct sigaction action = {.sa_handler = sigpipe_handler, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPIPE, &action, NULL);
+
+    SSL_CTX_free(TlsContext);
+    TlsContext = ctx;
+    return 0;
+
+fail:
+    tls_log_errors("Unable to initialize TLS");
+    SSL_CTX_free(ctx);
+    return -1;
+}
+
+/**
+ * Return whether the listener terminates TLS.
+ **/
+bool tls_enabled(void)
+{
+    return TlsContext != NULL;
+}
+
+/**
+ * Handle result of non-blocking SSL operation.
+ *
+ * @param   r           Request structure.
+ * @param   result      Return value of SSL operation.
+ * @return  0 if operation should be retried, -1 on error or timeout.
+ *
+ * When OpenSSL needs the socket to become readable or writable, this waits
+ * for it under the request's current deadline.
+ **/
+static int tls_retry(Request *r, int result)
+{
+    int error = SSL_get_error(r->tls, result);
+
+    switch (error)
+    {
+    case SSL_ERROR_WANT_READ:
+        return request_wait(r, POLLIN);
+    case SSL_ERROR_WANT_WRITE:
+        return request_wait(r, POLLOUT);
+    case SSL_ERROR_SYSCALL:
+        if (errno == EINTR)
+            return 0;
+        /* Fall through */
+    default:
+        /* Fatal errors forbid sending close_notify */
+        debug("TLS error %d: %s", error, strerror(errno));
+        tls_log_errors("TLS error");
+        SSL_set_quiet_shutdown(r->tls, 1);
+        return -1;
+    }
+}
+
+/**
+ * Perform TLS handshake on accepted client.
+ *
+ * @param   r           Request structure.
+ * @return  0 on success, -1 on error or timeout.
+ *
+ * The handshake runs under the header deadline.  If kernel TLS transmit was
+ * enabled, the request keeps writing to the socket directly (so sendfile
+ * stays zero-copy); otherwise responses are encrypted by TlsSink.
+ **/
+int tls_accept(Request *r)
+{
+    int result;
+
+    if (!(r->tls = SSL_new(TlsContext)) || SSL_set_fd(r->tls, r->fd) != 1)
+    {
+        tls_log_errors("Unable to create TLS session");
+        return -1;
+    }
+
+    request_deadline(r, DEADLINE_HEADER);
+    do
+    {
+        ERR_clear_error();
+        if ((result = SSL_accept(r->tls)) == 1)
+            break;
+    } while (tls_retry(r, result) == 0);
+    request_deadline(r, DEADLINE_NONE);
+
+    if (result != 1)
+        return -1;
+
+    r->sink = BIO_get_ktls_send(SSL_get_wbio(r->tls)) ? &SocketSink : &TlsSink;
+    debug("TLS handshake: %s %s%s%s", SSL_get_version(r->tls), SSL_get_cipher_name(r->tls),
+          SSL_session_reused(r->tls) ? " (resumed)" : "",
+          r->sink == &SocketSink ? " (kTLS)" : "");
+    return 0;
+}
+
+/**
+ * Read decrypted data from client.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to store data.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read, 0 on end-of-file, -1 on error or timeout.
+ **/
+ssize_t tls_recv(Request *r, void *buffer, size_t size)
+{
+    size_t nread;
+    int result;
+
+    while (true)
+    {
+        ERR_clear_error();
+        if ((result = SSL_read_ex(r->tls, buffer, size, &nread)) == 1)
+            return nread;
+        if (SSL_get_error(r->tls, result) == SSL_ERROR_ZERO_RETURN)
+            return 0;
+        if (tls_retry(r, result) < 0)
+            return -1;
+    }
+}
+
+/**
+ * Write buffer as TLS records.
+ **/
+static int tls_write(Request *r, const void *buffer, size_t length)
+{
+    size_t nwritten;
+    int result;
+
+    while (length > 0)
+    {
+        ERR_clear_error();
+        if ((result = SSL_write_ex(r->tls, buffer, length, &nwritten)) == 1)
+        {
+            buffer = (const char *)buffer + nwritten;
+            length -= nwritten;
+            continue;
+        }
+
+        request_deadline(r, DEADLINE_WRITE);
+        if (tls_retry(r, result) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write response bytes through OpenSSL (Sink interface).
+ *
+ * @param   r           Request structure.
+ * @param   iov         Data to write.
+ * @param   iovcnt      Number of iovecs.
+ * @param   more        Whether more data will follow (unused).
+ * @return  Number of bytes written or -1 on error.
+ *
+ * Small iovecs (status line, headers) are gathered into one record so that
+ * a response head does not cost a record per header.
+ **/
+static ssize_t tls_writev(Request *r, struct iovec *iov, int iovcnt, bool more)
+{
+    char    record[TLS_RECORD_SIZE];
+    size_t  used = 0;
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (used + iov[i].iov_len <= sizeof(record))
+        {
+            memcpy(record + used, iov[i].iov_base, iov[i].iov_len);
+            used += iov[i].iov_len;
+        }
+        else
+        {
+            if ((used && tls_write(r, record, used) < 0) || tls_write(r, iov[i].iov_base, iov[i].iov_len) < 0)
+                return -1;
+            used = 0;
+        }
+        total += iov[i].iov_len;
+    }
+
+    if (used && tls_write(r, record, used) < 0)
+        return -1;
+    return total;
+}
+
+Sink TlsSink = { tls_writev };
+
+/**
+ * Shut down and free TLS session.
+ *
+ * @param   r           Request structure.
+ *
+ * A single close_notify is attempted without waiting for the peer's reply.
+ **/
+void tls_close(Request *r)
+{
+    if (!r->tls)
+        return;
+
+    ERR_clear_error();
+    if (SSL_is_init_finished(r->tls))
+        SSL_shutdown(r->tls);
+    SSL_free(r->tls);
+    r->tls = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,118 +6,362 @@
 #include <errno.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <limits.h>
+
+#include <linux/openat2.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 /**
- * Determine mime-type from file extension.
+ * Mimetype of one file extension.
+ **/
+typedef struct {
+    char *extension;                    /*< File extension (NULL if slot unused) */
+    char *mimetype;                     /*< Mimetype of extension */
+} MimeEntry;
+
+static MimeEntry *MimeTable = NULL;     /* Open-addressed table of extensions */
+static size_t     MimeMask = 0;         /* Table size - 1 (size is a power of 2) */
+
+/**
+ * Hash string (FNV-1a).
  *
- * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
+ * @param   s           String to hash.
+ * @return  32-bit hash of string.
  *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
+ * This is also the hash of archive index entries, so it must not change
+ * without changing ARCHIVE_MAGIC.
+ **/
+uint32_t hash_string(const char *s)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *s; s++)
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    return hash;
+}
+
+/**
+ * Free mimetype table.
+ **/
+static void mimetypes_free(MimeEntry *table, size_t mask)
+{
+    for (size_t i = 0; table && i <= mask; i++)
+    {
+        free(table[i].extension);
+        free(table[i].mimetype);
+    }
+    free(table);
+}
+
+/**
+ * Load mimetypes file into extension table.
+ *
+ * @param   path        Path to mimetypes file.
+ * @return  true if the file was read (the current table is then replaced).
  *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
- * following format:
+ * The file (typically /etc/mime.types) consists of rules in the following
+ * format:
  *
  *  <MIMETYPE>      <EXT1> <EXT2> ...
  *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
+ * When an extension appears in several rules, the first one wins.  The file
+ * is read once here rather than on every request; it is loaded again when the
+ * server reloads its configuration.
+ **/
+bool mimetypes_load(const char *path)
+{
+    char buffer[BUFSIZ];
+    char *saveptr;
+    MimeEntry *table;
+    size_t size = 1024;
+    size_t count = 0;
+    FILE *fs = fopen(path, "r");
+
+    if (!fs)
+    {
+        log("Unable to open mimetypes file %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    /* Count extensions to size the table (at most half full) */
+    while (fgets(buffer, BUFSIZ, fs))
+    {
+        char *mimetype = strtok_r(buffer, WHITESPACE, &saveptr);
+        if (!mimetype || mimetype[0] == '#')
+            continue;
+        while (strtok_r(NULL, WHITESPACE, &saveptr))
+            count++;
+    }
+    while (size < 2 * count)
+        size <<= 1;
+
+    if (!(table = calloc(size, sizeof(MimeEntry))))
+    {
+        log("Unable to allocate mimetypes table: %s", strerror(errno));
+        fclose(fs);
+        return false;
+    }
+
+    rewind(fs);
+    while (fgets(buffer, BUFSIZ, fs))
+    {
+        char *mimetype = strtok_r(buffer, WHITESPACE, &saveptr);
+        if (!mimetype || mimetype[0] == '#')
+            continue;
+
+        for (char *ext = strtok_r(NULL, WHITESPACE, &saveptr); ext; ext = strtok_r(NULL, WHITESPACE, &saveptr))
+        {
+            size_t slot = hash_string(ext) & (size - 1);
+
+            while (table[slot].extension && !streq(table[slot].extension, ext))
+                slot = (slot + 1) & (size - 1);
+
+            if (!table[slot].extension)
+            {
+                table[slot].extension = strdup(ext);
+                table[slot].mimetype  = strdup(mimetype);
+            }
+        }
+    }
+    fclose(fs);
+
+    mimetypes_free(MimeTable, MimeMask);
+    MimeTable = table;
+    MimeMask  = size - 1;
+    return true;
+}
+
+/**
+ * Determine mime-type from file extension.
+ *
+ * @param   path        Path to file.
+ * @param   fallback    Mimetype to use when none is found.
+ * @return  An allocated string containing the mime-type of the specified file.
+ *
+ * This function finds the file's extension and looks it up in the table
+ * loaded from MimeTypesPath by mimetypes_load.
  *
  * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
+ * fallback (the virtual host's default mimetype).
  *
  * This function returns an allocated string that must be free'd.
  **/
-char *determine_mimetype(const char *path)
+char *determine_mimetype(const char *path, const char *fallback)
 {
     char *ext;
-    char *mimetype = NULL;
-    char *token;
-    char buffer[BUFSIZ];
-    FILE *fs = NULL;
 
     /* Find file extension */
     ext = strrchr(path, '.');
-    if (!ext)
-        return strdup(DefaultMimeType);
+    if (!ext || !MimeTable)
+        return strdup(fallback);
 
     ext++;
     log("Extension: %s", ext);
 
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath, "r");
-    if (!fs)
+    /* Probe table for extension */
+    for (size_t slot = hash_string(ext) & MimeMask; MimeTable[slot].extension; slot = (slot + 1) & MimeMask)
     {
-        debug("Can't fopen file: %s", strerror(errno));
-        mimetype = DefaultMimeType;
+        if (streq(MimeTable[slot].extension, ext))
+            return strdup(MimeTable[slot].mimetype);
     }
-    char *sub;
-    /* Scan file for matching file extensions */
-    while (fgets(buffer, BUFSIZ, fs))
+    return strdup(fallback);
+}
+
+/**
+ * Decode and normalize URI into a path relative to the root directory.
+ *
+ * @param   uri         Resource path of URI.
+ * @param   buffer      Buffer to store normalized relative path.
+ * @param   size        Size of buffer.
+ * @return  Length of normalized path or -1 on error.
+ *
+ * This function percent-decodes the URI while collapsing empty and "."
+ * segments and resolving ".." segments in a single pass.  A ".." that would
+ * climb above the root, a decoded NUL byte, or a malformed escape is treated
+ * as an error.  The root itself is represented as ".".
+ **/
+int normalize_uri(const char *uri, char *buffer, size_t size)
+{
+    size_t length  = 0;     /* Bytes written to buffer */
+    size_t segment = 0;     /* Start of current segment in buffer */
+
+    for (const char *s = uri; ; s++)
     {
-        token = skip_nonwhitespace(buffer);
+        bool end = (*s == '\0');
+        int  c   = *s;
 
-        token = skip_whitespace(token);
+        if (c == '%')
+        {
+            if (!isxdigit((unsigned char)s[1]) || !isxdigit((unsigned char)s[2]))
+                return -1;
 
-        mimetype = strtok(buffer, WHITESPACE);
-        if (!mimetype || mimetype[0] == '#')
+            char hex[3] = {s[1], s[2], '\0'};
+            c  = strtol(hex, NULL, 16);
+            s += 2;
+            if (c == '\0')
+                return -1;
+        }
+
+        if (c != '/' && !end)
         {
+            if (length + 1 >= size)
+                return -1;
+            buffer[length++] = c;
             continue;
         }
 
-        sub = strtok(token, WHITESPACE);
+        /* End of segment: drop ".", unwind "..", and collapse "//" */
+        size_t n = length - segment;
+        if (n == 1 && buffer[segment] == '.')
+        {
+            length = segment;
+        }
+        else if (n == 2 && buffer[segment] == '.' && buffer[segment + 1] == '.')
+        {
+            if (segment == 0)
+                return -1;
 
-        while (sub)
+            length = segment - 1;
+            while (length > 0 && buffer[length - 1] != '/')
+                length--;
+        }
+        else if (n > 0 && !end)
         {
-            if (streq(ext, sub))
-            {
-                if (fs)
-                {
-                    goto finish;
-                }
-            }
-            sub = strtok(NULL, WHITESPACE);
+            if (length + 1 >= size)
+                return -1;
+            buffer[length++] = '/';
         }
+        segment = length;
+
+        if (end)
+            break;
     }
-    mimetype = DefaultMimeType;
-finish:
-    fclose(fs);
-    return strdup(mimetype);
+
+    /* Strip trailing slash and represent the root as "." */
+    if (length > 0 && buffer[length - 1] == '/')
+        length--;
+    if (length == 0)
+        buffer[length++] = '.';
+    buffer[length] = '\0';
+    return length;
 }
 
 /**
- * Determine actual filesystem path based on RootPath and URI.
+ * Open relative path beneath root directory.
+ *
+ * @param   rootfd      Directory file descriptor of root.
+ * @param   root        Path of root directory.
+ * @param   relative    Normalized path relative to root.
+ * @return  File descriptor of resource or -1 on error.
  *
+ * This uses openat2(2) with RESOLVE_BENEATH so that the kernel resolves the
+ * whole path in one system call and refuses to follow anything (symbolic
+ * links, magic links) out of the root directory.
+ *
+ * The resource is opened for reading (non-blocking so that FIFOs cannot stall
+ * the server); if it is not readable, an O_PATH descriptor is returned so that
+ * the caller can still fstat(2) it.
+ *
+ * On kernels without openat2(2), this falls back to realpath(3) and checks
+ * that the result lies within the root directory.
+ **/
+static int open_beneath(int rootfd, const char *root, const char *relative)
+{
+    static bool NoOpenat2 = false;
+    struct open_how how = {
+        .flags   = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd;
+
+    if (!NoOpenat2)
+    {
+        fd = syscall(SYS_openat2, rootfd, relative, &how, sizeof(how));
+        if (fd < 0 && errno == EACCES)
+        {
+            how.flags = O_PATH | O_CLOEXEC;
+            fd = syscall(SYS_openat2, rootfd, relative, &how, sizeof(how));
+        }
+        if (fd >= 0 || (errno != ENOSYS && errno != EPERM))
+            return fd;
+
+        debug("openat2 unavailable, falling back to realpath: %s", strerror(errno));
+        NoOpenat2 = true;
+    }
+
+    char path[PATH_MAX];
+    char real[PATH_MAX];
+    size_t rootlen = strlen(root);
+
+    if (snprintf(path, sizeof(path), "%s/%s", root, relative) >= sizeof(path))
+        return -1;
+
+    if (!realpath(path, real))
+        return -1;
+
+    /* Accept the root itself or anything below it, but not siblings */
+    if (strncmp(real, root, rootlen) || (real[rootlen] != '/' && real[rootlen] != '\0'))
+        return -1;
+
+    fd = open(real, how.flags);
+    if (fd < 0 && errno == EACCES)
+        fd = open(real, O_PATH | O_CLOEXEC);
+    return fd;
+}
+
+/**
+ * Determine actual filesystem path based on virtual host root and URI.
+ *
+ * @param   host        Virtual host serving the request.
  * @param   uri         Resource path of URI.
+ * @param   fd          Pointer to store opened file descriptor of resource.
  * @return  An allocated string containing the full path of the resource on the
  * local filesystem.
  *
- * This function uses realpath(3) to generate the realpath of the
- * file requested in the URI.
+ * This function normalizes the URI and then opens it relative to the host's
+ * root directory descriptor, which guarantees that the resource is contained
+ * within that host's root.
  *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
+ * If the URI is malformed (errno is EINVAL) or the resource cannot be opened
+ * (errno is that of the open), then return NULL.
  *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
+ * Otherwise, return a newly allocated string containing the path and store the
+ * opened file descriptor in fd.  Both must later be released.
  **/
-char *determine_request_path(const char *uri)
+char *determine_request_path(const VirtualHost *host, const char *uri, int *fd)
 {
-    char path[BUFSIZ];
-    char actual_path[BUFSIZ];
+    char relative[PATH_MAX];
+    char *path;
 
-    if ((snprintf(path, BUFSIZ, "%s/%s", RootPath, uri)) < 0)
+    if (normalize_uri(uri, relative, sizeof(relative)) < 0)
+    {
+        errno = EINVAL;                 /* Not ENOENT: malformed URIs are not cached as missing */
         return NULL;
+    }
 
-    realpath(path, actual_path);
-
-    if (strncmp(actual_path, RootPath, strlen(RootPath)))
+    *fd = open_beneath(host->rootfd, host->root, relative);
+    if (*fd < 0)
+    {
+        int error = errno;              /* Callers tell missing files by errno */
+        debug("Unable to open %s: %s", relative, strerror(error));
+        errno = error;
         return NULL;
+    }
 
-    return strdup(actual_path);
+    if (streq(relative, "."))
+        path = strdup(host->root);
+    else if (asprintf(&path, "%s/%s", host->root, relative) < 0)
+        path = NULL;
+
+    if (!path)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+    return path;
 }
 
 /**
@@ -130,24 +374,22 @@ char *determine_request_path(const char *uri)
  **/
 const char *http_status_string(Status status)
 {
-    static char *StatusStrings[] = {
-        "200 OK",                    // 0
-        "400 Bad Request",           // 1
-        "404 Not Found",             // 2
-        "500 Internal Server Error", // 3
-        "418 I'm A Teapot",          // 4
+    static const char *StatusStrings[] = {
+        [HTTP_STATUS_OK]                    = "200 OK",
+        [HTTP_STATUS_NOT_MODIFIED]          = "304 Not Modified",
+        [HTTP_STATUS_BAD_REQUEST]           = "400 Bad Request",
+        [HTTP_STATUS_NOT_FOUND]             = "404 Not Found",
+        [HTTP_STATUS_REQUEST_TIMEOUT]       = "408 Request Timeout",
+        [HTTP_STATUS_TOO_MANY_REQUESTS]     = "429 Too Many Requests",
+        [HTTP_STATUS_INTERNAL_SERVER_ERROR] = "500 Internal Server Error",
+        [HTTP_STATUS_BAD_GATEWAY]           = "502 Bad Gateway",
+        [HTTP_STATUS_SERVICE_UNAVAILABLE]   = "503 Service Unavailable",
     };
 
-    if (status == HTTP_STATUS_OK)
-        return StatusStrings[0];
-    else if (status == HTTP_STATUS_BAD_REQUEST)
-        return StatusStrings[1];
-    else if (status == HTTP_STATUS_NOT_FOUND)
-        return StatusStrings[2];
-    else if (status == HTTP_STATUS_INTERNAL_SERVER_ERROR)
-        return StatusStrings[3];
+    if (status < sizeof(StatusStrings) / sizeof(StatusStrings[0]) && StatusStrings[status])
+        return StatusStrings[status];
     else
-        return StatusStrings[4];
+        return "418 I'm A Teapot";
 }
 
 /**
@@ -158,7 +400,7 @@ const char *http_status_string(Status status)
  **/
 char *skip_nonwhitespace(char *s)
 {
-    while (!isspace(*s))
+    while (!isspace((unsigned char)*s))
         s++;
 
     return s;
@@ -172,7 +414,7 @@ char *skip_nonwhitespace(char *s)
  **/
 char *skip_whitespace(char *s)
 {
-    while (isspace(*s))
+    while (isspace((unsigned char)*s))
         s++;
 
     return s;
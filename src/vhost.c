@@ -0,0 +1,273 @@
+/* vhost.c: Virtual Hosts */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define VHOST_MAX       1024            /* Maximum number of -V hosts */
+
+static VirtualHost  DefaultHost;        /* Serves unknown or missing Host */
+static VirtualHost  Hosts[VHOST_MAX];   /* Configured hosts */
+static size_t       NHosts = 0;
+static VirtualHost **Table = NULL;      /* Open-addressed table of Hosts */
+static size_t       TableMask = 0;      /* Table size - 1 (size is a power of 2) */
+
+/**
+ * Hash prefix (if not NUL) followed by string (FNV-1a).
+ **/
+static uint32_t vhost_hash(char prefix, const char *s)
+{
+    uint32_t hash = 2166136261u;
+
+    if (prefix)
+        hash = (hash ^ (unsigned char)prefix) * 16777619u;
+    for (; *s; s++)
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    return hash;
+}
+
+/**
+ * Parse boolean setting value.
+ **/
+static bool vhost_flag(const char *value, bool *flag)
+{
+    if (streq(value, "1") || streq(value, "on") || streq(value, "yes"))
+        *flag = true;
+    else if (streq(value, "0") || streq(value, "off") || streq(value, "no"))
+        *flag = false;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Add virtual host.
+ *
+ * @param   spec        String of the form name=root[,mime=type][,cgi=0|1][,browse=0|1].
+ * @return  true if the host was parsed and its root opened.
+ *
+ * A name of the form "*.example.com" matches any subdomain of example.com
+ * (but not example.com itself).  Exact names take precedence, then the
+ * longest matching wildcard.
+ **/
+bool vhost_add(const char *spec)
+{
+    const char *equal = strchr(spec, '=');
+    VirtualHost *host = &Hosts[NHosts];
+    char *settings;
+    char *saveptr;
+    char *root;
+    bool  valid = true;
+
+    if (!equal || equal == spec || NHosts >= VHOST_MAX)
+        return false;
+
+    host->name = strndup(spec, equal - spec);
+    for (char *c = host->name; *c; c++)
+        *c = tolower(*c);
+    host->mimetype = NULL;
+    host->cgi = true;
+    host->browse = true;
+
+    settings = strdup(equal + 1);
+    root = strtok_r(settings, ",", &saveptr);
+    for (char *s = strtok_r(NULL, ",", &saveptr); s && valid; s = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(s, '=');
+        if (!value)
+        {
+            valid = false;
+            break;
+        }
+        *value++ = '\0';
+
+        if (streq(s, "mime"))
+            host->mimetype = strdup(value);
+        else if (streq(s, "cgi"))
+            valid = vhost_flag(value, &host->cgi);
+        else if (streq(s, "browse"))
+            valid = vhost_flag(value, &host->browse);
+        else
+            valid = false;
+    }
+
+    if (!valid || !root || !(host->root = realpath(root, NULL)))
+    {
+        log("Invalid virtual host %s: %s", spec, valid && root ? strerror(errno) : "bad setting");
+        free(settings);
+        return false;
+    }
+    host->path = strdup(root);
+    free(settings);
+
+    host->rootfd = open(host->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (host->rootfd < 0)
+    {
+        log("Unable to open root directory %s: %s", host->root, strerror(errno));
+        return false;
+    }
+
+    NHosts++;
+    return true;
+}
+
+/**
+ * Build virtual host lookup table.
+ *
+ * The default host serves RootPath (opened as RootFd) with DefaultMimeType,
+ * after the packed archive if one was given,
+ * which is also the default mimetype of hosts that do not set one, and so
+ * this must be called after those have been determined.  The table is
+ * sized to a power of two at least twice the number of hosts, so probes stay
+ * short and lookups never rehash.  Building again (after a reload) replaces
+ * the previous table.
+ **/
+void vhost_build(void)
+{
+    size_t size = 16;
+
+    DefaultHost = (VirtualHost){
+        .name     = "",
+        .root     = RootPath,
+        .rootfd   = RootFd,
+        .mimetype = DefaultMimeType,
+        .cgi      = true,
+        .browse   = true,
+        .archive  = ArchivePath != NULL,
+    };
+
+    while (size < 2 * NHosts)
+        size <<= 1;
+
+    free(Table);
+    Table = calloc(size, sizeof(VirtualHost *));
+    if (!Table)
+    {
+        fatal("Unable to allocate virtual host table: %s", strerror(errno));
+    }
+    TableMask = size - 1;
+
+    for (size_t i = 0; i < NHosts; i++)
+    {
+        size_t slot = vhost_hash(0, Hosts[i].name) & TableMask;
+
+        if (!Hosts[i].mimetype)
+            Hosts[i].mimetype = DefaultMimeType;
+
+        while (Table[slot] && !streq(Table[slot]->name, Hosts[i].name))
+            slot = (slot + 1) & TableMask;
+
+        if (Table[slot])
+            log("Duplicate virtual host %s ignored", Hosts[i].name);
+        else
+            Table[slot] = &Hosts[i];
+        debug("VirtualHost     = %s -> %s", Hosts[i].name, Hosts[i].root);
+    }
+}
+
+/**
+ * Reopen document roots of virtual hosts.
+ *
+ * Each configured root is resolved again, so a root that is a symbolic link
+ * to a release directory switches to the link's new target.  A host whose root
+ * can no longer be opened keeps its previous one.  vhost_build must be called
+ * afterwards to rebuild the default host and the table.
+ **/
+void vhost_reload(void)
+{
+    for (size_t i = 0; i < NHosts; i++)
+    {
+        VirtualHost *host = &Hosts[i];
+        char *root = realpath(host->path, NULL);
+        int   rootfd = root ? open(root, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+
+        if (rootfd < 0)
+        {
+            log("Unable to reopen root directory %s of %s: %s", host->path, host->name, strerror(errno));
+            free(root);
+            continue;
+        }
+
+        control_retire(host->root, 0, host->rootfd);
+        host->root = root;
+        host->rootfd = rootfd;
+    }
+}
+
+/**
+ * Call function for the default host, then for each configured host.
+ *
+ * @param   callback    Function called with each host.
+ **/
+void vhost_foreach(void (*callback)(const VirtualHost *host))
+{
+    callback(&DefaultHost);
+    for (size_t i = 0; i < NHosts; i++)
+        callback(&Hosts[i]);
+}
+
+/**
+ * Probe table for prefix (if not NUL) followed by name.
+ **/
+static VirtualHost *vhost_find(char prefix, const char *name)
+{
+    size_t slot = vhost_hash(prefix, name) & TableMask;
+
+    for (VirtualHost *host; (host = Table[slot]); slot = (slot + 1) & TableMask)
+    {
+        if (prefix ? (host->name[0] == prefix && streq(host->name + 1, name)) : streq(host->name, name))
+            return host;
+    }
+    return NULL;
+}
+
+/**
+ * Look up virtual host for Host header.
+ *
+ * @param   name        Value of Host header (may be NULL).
+ * @return  Matching VirtualHost, or the default host.
+ *
+ * The name is lowercased and stripped of any port and trailing dot.  An exact
+ * match is tried first, then "*.<suffix>" for each successively shorter
+ * suffix, each with a single hash probe.
+ **/
+const VirtualHost *vhost_lookup(const char *name)
+{
+    char host[NI_MAXHOST];
+    size_t length = 0;
+    bool literal = name && name[0] == '[';
+    VirtualHost *match;
+
+    if (!name || !Table || NHosts == 0)
+        return &DefaultHost;
+
+    /* Normalize: lowercase, without port (IPv6 literals keep brackets) */
+    for (const char *s = name; *s && length + 1 < sizeof(host); s++)
+    {
+        if (*s == ':' && !literal)
+            break;
+        host[length++] = tolower(*s);
+        if (*s == ']')
+            break;
+    }
+    if (length > 0 && host[length - 1] == '.')
+        length--;
+    host[length] = '\0';
+
+    if ((match = vhost_find(0, host)))
+        return match;
+
+    for (const char *dot = strchr(host, '.'); dot; dot = strchr(dot + 1, '.'))
+    {
+        if ((match = vhost_find('*', dot)))
+            return match;
+    }
+    return &DefaultHost;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
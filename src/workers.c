@@ -0,0 +1,327 @@
+/* workers.c: Per-CPU Worker Processes */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define WORKERS_MAX     1024            /* Largest worker pool */
+#define WORKER_RESPAWN  1000            /* Milliseconds before restarting a worker that died */
+
+typedef struct {
+    pid_t    pid;                       /*< Worker process (0 if not running) */
+    int      fd;                        /*< Listening socket of worker */
+    int      cpu;                       /*< CPU worker is pinned to (-1 if not pinned) */
+    uint64_t started;                   /*< When worker was last started (milliseconds) */
+} Worker;
+
+static cpu_set_t CpuSet;                /* CPUs the server may run on (at startup) */
+static Worker   *Pool = NULL;           /* Worker pool (NULL in workers and without pool) */
+static size_t    PoolSize = 0;          /* Number of workers in pool */
+
+/**
+ * Record the CPUs the server may run on (before anything is pinned).
+ **/
+void workers_init(void)
+{
+    CPU_ZERO(&CpuSet);
+    if (sched_getaffinity(0, sizeof(CpuSet), &CpuSet) < 0)
+        debug("Unable to get CPU affinity: %s", strerror(errno));
+}
+
+/**
+ * Pin calling process to CPU and allocate its memory from the CPU's node.
+ *
+ * Memory is placed when first touched, so everything the process allocates
+ * from here on (request buffers, HPACK tables, proxy pools) is local.
+ **/
+static void workers_pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        debug("Unable to pin to CPU %d: %s", cpu, strerror(errno));
+
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0 && errno != ENOSYS)
+        debug("Unable to set local memory policy: %s", strerror(errno));
+}
+
+/**
+ * Pin forked child to the CPU that received its client's packets.
+ *
+ * @param   fd          Client socket file descriptor.
+ *
+ * This keeps the child on the core (and node) where the kernel already
+ * holds the connection's state.  Nothing is done unless CpuAffinity is set,
+ * or if the CPU is not one the server may run on.
+ **/
+void workers_pin_client(int fd)
+{
+    socklen_t length = sizeof(int);
+    int cpu;
+
+    if (!CpuAffinity || getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) < 0 ||
+        cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &CpuSet))
+        return;
+
+    workers_pin(cpu);
+}
+
+/**
+ * Steer each connection to the worker pinned to the CPU that received it.
+ *
+ * @param   sfd         Socket of first worker (any member sets the group program).
+ *
+ * The classic BPF program returns the index, in the SO_REUSEPORT group, of
+ * the worker whose CPU matches the receiving CPU, and otherwise spreads by
+ * CPU number.  Group indices follow the order in which the sockets started
+ * listening, which is worker order.
+ **/
+static void workers_steer(int sfd)
+{
+    struct sock_filter code[2 * WORKERS_MAX + 3];
+    struct sock_fprog program = {.filter = code};
+    size_t length = 0;
+
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (size_t i = 0; i < PoolSize; i++)
+    {
+        code[length++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, Pool[i].cpu, 0, 1);
+        code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, PoolSize);
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    program.len = length;
+
+    if (setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0)
+        log("Unable to attach accept steering program: %s", strerror(errno));
+}
+
+/**
+ * Set up listening socket of each worker.
+ *
+ * @param   sfd         Server socket file descriptor (used by first worker).
+ * @return  Whether every worker has a socket.
+ *
+ * With AcceptShard, each worker gets its own SO_REUSEPORT socket, so
+ * workers do not contend for one accept queue.  With CpuAffinity too, each
+ * socket is tagged with its worker's CPU (SO_INCOMING_CPU) and connections
+ * are steered by CPU:
+ *
+ * - A new group is steered by workers_steer, as long as every worker has a
+ *   CPU of its own.
+ * - A group inherited on upgrade still holds the old server's sockets, so
+ *   group indices do not match workers.  Any program is detached, and the
+ *   kernel (Linux 6.2 and later) picks the socket tagged with the receiving
+ *   CPU instead.
+ **/
+static bool workers_sockets(int sfd, size_t cpus)
+{
+    Pool[0].fd = sfd;
+    for (size_t i = 1; i < PoolSize; i++)
+    {
+        Pool[i].fd = AcceptShard ? socket_clone(sfd) : sfd;
+        if (Pool[i].fd < 0)
+            return false;
+    }
+
+    if (!AcceptShard || !CpuAffinity)
+        return true;
+
+    for (size_t i = 0; i < PoolSize; i++)
+        if (setsockopt(Pool[i].fd, SOL_SOCKET, SO_INCOMING_CPU, &Pool[i].cpu, sizeof(int)) < 0)
+            debug("Unable to set SO_INCOMING_CPU: %s", strerror(errno));
+
+    if (socket_inherited())
+    {
+        int none = 0;
+        setsockopt(sfd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &none, sizeof(none));
+    }
+    else if (PoolSize <= cpus)
+    {
+        workers_steer(sfd);
+    }
+    return true;
+}
+
+/**
+ * Start worker process.
+ *
+ * @param   w           Worker to start.
+ * @param   server      Server loop run by worker (single_server or forking_server).
+ *
+ * Workers get SIGTERM when the supervisor dies, however it is killed, so a
+ * pool never outlives its supervisor (it would keep serving, unsupervised
+ * and unreachable by reload or drain).
+ **/
+static void workers_start(Worker *w, int (*server)(int))
+{
+    pid_t supervisor = getpid();
+
+    w->started = now_ms();
+    w->pid = fork();
+    if (w->pid < 0)
+    {
+        log("Unable to fork worker: %s", strerror(errno));
+        w->pid = 0;
+        return;
+    }
+
+    if (w->pid == 0)
+    {
+        signal(SIGCHLD, SIG_DFL);
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != supervisor)
+            _exit(EXIT_FAILURE);        /* Supervisor already gone */
+        control_worker();
+        if (w->cpu >= 0)
+            workers_pin(w->cpu);
+
+        /* Keep only this worker's socket */
+        for (size_t i = 0; i < PoolSize; i++)
+            if (Pool[i].fd != w->fd)
+                close(Pool[i].fd);
+        int fd = w->fd;
+        free(Pool);
+        Pool = NULL;
+        PoolSize = 0;
+        exit(server(fd));
+    }
+
+    debug("Worker %d started on CPU %d", w->pid, w->cpu);
+}
+
+/**
+ * Send signal to every worker.
+ *
+ * @param   signum      Signal to send (SIGHUP to reload, SIGQUIT to drain).
+ **/
+void workers_signal(int signum)
+{
+    for (size_t i = 0; i < PoolSize; i++)
+        if (Pool[i].pid > 0)
+            kill(Pool[i].pid, signum);
+}
+
+/**
+ * Interrupt the supervisor's wait when a worker exits.
+ **/
+static void workers_sigchld(int signum)
+{
+}
+
+/**
+ * Run server loop in a pool of worker processes.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   server      Server loop run by each worker.
+ * @return  Exit status of server.
+ *
+ * Workers is the size of the pool (0 for one worker per CPU).  With a single
+ * worker, the server loop runs in this process.  Otherwise this process
+ * supervises: it restarts workers that die, forwards SIGHUP to them, and on
+ * drain tells them to drain and waits for them.
+ *
+ * With CpuAffinity, worker i is pinned to the i-th CPU the server may run on
+ * (wrapping around), and allocates from that CPU's NUMA node.  In forking
+ * mode, each child moves to the CPU that received its connection (see
+ * workers_pin_client), which is its worker's CPU when accepts are sharded.
+ **/
+int workers_server(int sfd, int (*server)(int))
+{
+    int cpus[CPU_SETSIZE];
+    size_t ncpus = 0;
+    pid_t pid;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &CpuSet))
+            cpus[ncpus++] = cpu;
+
+    PoolSize = Workers > 0 ? (size_t)Workers : ncpus;
+    if (PoolSize > WORKERS_MAX)
+        PoolSize = WORKERS_MAX;
+    if (PoolSize <= 1)
+    {
+        PoolSize = 0;
+        return server(sfd);
+    }
+
+    Pool = calloc(PoolSize, sizeof(Worker));
+    if (!Pool)
+    {
+        fatal("Unable to allocate workers: %s", strerror(errno));
+    }
+
+    for (size_t i = 0; i < PoolSize; i++)
+        Pool[i].cpu = CpuAffinity && ncpus ? cpus[i % ncpus] : -1;
+
+    if (!workers_sockets(sfd, ncpus))
+    {
+        fatal("Unable to create worker sockets: %s", strerror(errno));
+    }
+
+    log("Starting %zu workers%s%s", PoolSize, CpuAffinity ? " (pinned)" : "", AcceptShard ? " (sharded)" : "");
+
+    struct sigaction action = {.sa_handler = workers_sigchld};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+
+    /* Supervise workers (until told to drain) */
+    while (control_poll(sfd))
+    {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        {
+            if (control_reaped(pid))
+                continue;
+            for (size_t i = 0; i < PoolSize; i++)
+            {
+                if (Pool[i].pid == pid)
+                {
+                    log("Worker %d exited: restarting", pid);
+                    Pool[i].pid = 0;
+                }
+            }
+        }
+
+        /* Start missing workers (a worker that keeps dying waits between starts) */
+        uint64_t now = now_ms();
+        for (size_t i = 0; i < PoolSize; i++)
+            if (Pool[i].pid == 0 && (Pool[i].started == 0 || now >= Pool[i].started + WORKER_RESPAWN))
+                workers_start(&Pool[i], server);
+
+        /* Wait for a signal or the next respawn check */
+        struct timespec tick = {.tv_sec = WORKER_RESPAWN / 1000};
+        nanosleep(&tick, NULL);
+    }
+
+    /* Drain workers, then close their sockets */
+    workers_signal(SIGQUIT);
+    for (size_t i = 0; i < PoolSize; i++)
+    {
+        while (Pool[i].pid > 0)
+        {
+            if ((pid = waitpid(Pool[i].pid, NULL, 0)) == Pool[i].pid || (pid < 0 && errno != EINTR))
+                Pool[i].pid = 0;
+        }
+        if (Pool[i].fd != sfd)
+            close(Pool[i].fd);
+    }
+    close(sfd);
+    free(Pool);
+    Pool = NULL;
+    PoolSize = 0;
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
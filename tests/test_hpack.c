@@ -0,0 +1,190 @@
+/* test_hpack: HPACK Decoder Tests */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#define MAX_FIELDS  16
+
+typedef struct {
+    const char *name;
+    const char *value;
+} Field;
+
+typedef struct {
+    size_t count;
+    char  *names[MAX_FIELDS];
+    char  *values[MAX_FIELDS];
+} Decoded;
+
+static int Failures = 0;
+
+/**
+ * Collect decoded header field.
+ **/
+static void collect(void *context, const char *name, const char *value)
+{
+    Decoded *decoded = context;
+
+    if (decoded->count < MAX_FIELDS)
+    {
+        decoded->names[decoded->count] = strdup(name);
+        decoded->values[decoded->count] = strdup(value);
+    }
+    decoded->count++;
+}
+
+/**
+ * Convert hex string (spaces ignored) to octets.
+ *
+ * @return  Number of octets.
+ **/
+static size_t unhex(const char *hex, uint8_t *buffer, size_t size)
+{
+    size_t length = 0;
+    unsigned int octet;
+
+    while (*hex && length < size)
+    {
+        if (*hex == ' ')
+        {
+            hex++;
+            continue;
+        }
+        if (sscanf(hex, "%2x", &octet) != 1)
+            break;
+        buffer[length++] = octet;
+        hex += 2;
+    }
+    return length;
+}
+
+/**
+ * Decode header block and check fields and resulting table size.
+ *
+ * @param   label       Name of test case.
+ * @param   table       Decoder dynamic table (carried between cases).
+ * @param   hex         Header block in hex.
+ * @param   expected    Expected fields (terminated by a NULL name).
+ * @param   size        Expected size of dynamic table afterwards.
+ **/
+static void check(const char *label, HpackTable *table, const char *hex, const Field *expected, size_t size)
+{
+    uint8_t block[BUFSIZ];
+    Decoded decoded = {0};
+    size_t length = unhex(hex, block, sizeof(block));
+    size_t count = 0;
+    bool failed = false;
+
+    if (hpack_decode(table, block, length, collect, &decoded) < 0)
+    {
+        fprintf(stderr, "%s: decoding failed\n", label);
+        failed = true;
+    }
+
+    for (; expected[count].name; count++)
+    {
+        if (count >= decoded.count || !streq(decoded.names[count], expected[count].name) || !streq(decoded.values[count], expected[count].value))
+        {
+            fprintf(stderr, "%s: field %zu is not %s: %s\n", label, count, expected[count].name, expected[count].value);
+            failed = true;
+        }
+    }
+    if (decoded.count != count)
+    {
+        fprintf(stderr, "%s: decoded %zu fields, expected %zu\n", label, decoded.count, count);
+        failed = true;
+    }
+    if (table->size != size)
+    {
+        fprintf(stderr, "%s: table size is %zu, expected %zu\n", label, table->size, size);
+        failed = true;
+    }
+
+    for (size_t i = 0; i < decoded.count && i < MAX_FIELDS; i++)
+    {
+        free(decoded.names[i]);
+        free(decoded.values[i]);
+    }
+    printf("%-40s %s\n", label, failed ? "FAILURE" : "Success");
+    Failures += failed;
+}
+
+/* RFC 7541 Appendix C.3 and C.4: requests (without and with Huffman coding) */
+
+static const Field Request1[] = {
+    {":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}, {NULL, NULL},
+};
+static const Field Request2[] = {
+    {":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+    {"cache-control", "no-cache"}, {NULL, NULL},
+};
+static const Field Request3[] = {
+    {":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+    {"custom-key", "custom-value"}, {NULL, NULL},
+};
+
+/* RFC 7541 Appendix C.5: responses with eviction (256-octet table) */
+
+static const Field Response1[] = {
+    {":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+    {"location", "https://www.example.com"}, {NULL, NULL},
+};
+static const Field Response2[] = {
+    {":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+    {"location", "https://www.example.com"}, {NULL, NULL},
+};
+static const Field Response3[] = {
+    {":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+    {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+    {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}, {NULL, NULL},
+};
+
+/* Literal whose indexed name belongs to the entry its insertion evicts */
+
+static const Field Evicting1[] = {{"x-a", "1"}, {NULL, NULL}};
+static const Field Evicting2[] = {{"x-a", "0123456789"}, {NULL, NULL}};
+
+int main(void)
+{
+    HpackTable table;
+
+    hpack_table_init(&table, 4096);
+    check("C.3.1 request", &table, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", Request1, 57);
+    check("C.3.2 request", &table, "8286 84be 5808 6e6f 2d63 6163 6865", Request2, 110);
+    check("C.3.3 request", &table, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", Request3, 164);
+    hpack_table_free(&table);
+
+    hpack_table_init(&table, 4096);
+    check("C.4.1 request (Huffman)", &table, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", Request1, 57);
+    check("C.4.2 request (Huffman)", &table, "8286 84be 5886 a8eb 1064 9cbf", Request2, 110);
+    check("C.4.3 request (Huffman)", &table, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", Request3, 164);
+    hpack_table_free(&table);
+
+    hpack_table_init(&table, 256);
+    check("C.5.1 response", &table,
+          "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 "
+          "3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", Response1, 222);
+    check("C.5.2 response", &table, "4803 3330 37c1 c0bf", Response2, 222);
+    check("C.5.3 response", &table,
+          "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 "
+          "7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 "
+          "6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31", Response3, 215);
+    hpack_table_free(&table);
+
+    /* "x-a: 1" (36 octets) fills a 64-octet table, then "x-a: 0123456789"
+     * (45 octets) names it by index (62) and evicts it */
+    hpack_table_init(&table, 64);
+    check("Eviction of indexed name (add)", &table, "4003 782d 6101 31", Evicting1, 36);
+    check("Eviction of indexed name (evict)", &table, "7e0a 3031 3233 3435 3637 3839", Evicting2, 45);
+    if (table.count != 1 || !streq(table.entries[0].name, "x-a") || !streq(table.entries[0].value, "0123456789"))
+    {
+        fprintf(stderr, "Eviction of indexed name: table entry is wrong\n");
+        Failures++;
+    }
+    hpack_table_free(&table);
+
+    return Failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,92 @@
+/* test_timer: Timer Wheel Tests */
+
+#include "spidey.h"
+
+#include <time.h>
+
+#define DAY_MS      (24 * 60 * 60 * 1000ULL)
+#define IDLE_CALLS  100
+
+static int Failures = 0;
+
+/**
+ * Count expired timer.
+ **/
+static void expired(Timer *timer)
+{
+    (*(size_t *)timer->data)++;
+}
+
+/**
+ * Record result of test case.
+ **/
+static void check(const char *label, bool passed)
+{
+    printf("%-40s %s\n", label, passed ? "Success" : "FAILURE");
+    Failures += !passed;
+}
+
+/**
+ * Return CPU time of process in milliseconds.
+ **/
+static double cpu_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(void)
+{
+    TimerWheel wheel;
+    Timer timers[4] = {{0}};
+    size_t fired = 0;
+    uint64_t delays[] = {1, 63, 4097, 300000};
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        timers[i].callback = expired;
+        timers[i].data = &fired;
+    }
+
+    /* Timers at every level fire on their tick, not before */
+    timer_wheel_init(&wheel, 1000);
+    for (size_t i = 0; i < 4; i++)
+        timer_add(&wheel, &timers[i], 1000 + delays[i]);
+    bool exact = true;
+    for (size_t i = 0; i < 4; i++)
+    {
+        timer_advance(&wheel, 1000 + delays[i] - 1);
+        exact &= fired == i;
+        exact &= timer_timeout(&wheel, 1000 + delays[i] - 1) >= 0;
+        timer_advance(&wheel, 1000 + delays[i]);
+        exact &= fired == i + 1;
+    }
+    check("Expiration at each level", exact && wheel.count == 0 && timer_timeout(&wheel, wheel.now) == -1);
+
+    /* A wheel left a day behind (as a forked child inherits it) catches up
+     * without walking every millisecond, and still fires on time */
+    double start = cpu_ms();
+    bool late = true;
+    fired = 0;
+    for (uint64_t call = 0; call < IDLE_CALLS; call++)
+    {
+        uint64_t now = DAY_MS + call;
+
+        timer_wheel_init(&wheel, 0);
+        timer_add(&wheel, &timers[0], now + 5000);
+        timer_advance(&wheel, now);
+        late &= fired == call && timer_timeout(&wheel, now) > 0;
+        timer_advance(&wheel, now + 4999);
+        late &= fired == call;
+        timer_advance(&wheel, now + 5000);
+        late &= fired == call + 1;
+    }
+    check("Expiration after idle day", late);
+    check("Advancing after idle day is bounded", cpu_ms() - start < IDLE_CALLS);
+
+    return Failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */